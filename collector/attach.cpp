@@ -0,0 +1,172 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bg_readings.hpp"
+#include "clone.hpp"
+#include "const.hpp"
+#include "debug.hpp"
+#include "perf_reader.hpp"
+#include "shared.hpp"
+#include "symbols.hpp"
+#include "util.hpp"
+#include "wattsup.hpp"
+
+// clone.cpp interposes pthread_create for the preloaded collector, but nothing
+// is interposed here so the background readings can use the real one directly
+pthread_create_fn_t real_pthread_create = pthread_create;
+
+namespace alex {
+
+using std::ifstream;
+using std::istreambuf_iterator;
+using std::string;
+using std::vector;
+
+/*
+ * Reads the null separated command line of pid out of /proc/<pid>/cmdline.
+ */
+vector<string> read_cmdline(pid_t pid) {
+  ifstream cmdline_file("/proc/" + std::to_string(pid) + "/cmdline",
+                        std::ios::binary);
+  string contents((istreambuf_iterator<char>(cmdline_file)),
+                  istreambuf_iterator<char>());
+  vector<string> args;
+  std::istringstream contents_stream(contents);
+  for (string arg; getline(contents_stream, arg, '\0');) {
+    args.push_back(arg);
+  }
+  return args;
+}
+
+/*
+ * Resolves the path of the executable that pid is running.
+ */
+string read_exe_path(pid_t pid) {
+  char path[PATH_MAX];
+  string link = "/proc/" + std::to_string(pid) + "/exe";
+  ssize_t len = readlink(link.c_str(), path, sizeof(path) - 1);
+  if (len == -1) {
+    return "";
+  }
+  path[len] = '\0';
+  return path;
+}
+
+int setup_done_handler() {
+  sigset_t done_mask;
+  sigemptyset(&done_mask);
+  sigaddset(&done_mask, SIGTERM);
+  sigaddset(&done_mask, SIGINT);
+  int done_fd = signalfd(-1, &done_mask, SFD_NONBLOCK);
+
+  // detach cleanly rather than being killed
+  sigprocmask(SIG_BLOCK, &done_mask, nullptr);
+
+  return done_fd;
+}
+
+/*
+ * Attaches the collector to an already running process rather than forking
+ * the subject itself. Every thread of the subject is monitored until it exits
+ * or the collector receives SIGTERM/SIGINT, at which point the perf events are
+ * closed and the subject carries on unaware.
+ */
+int attach_main(int argc, char **argv) {
+  DEBUG_CRITICAL("Version: " << VERSION);
+
+  if (argc != 2) {
+    std::cerr << "usage: " << argv[0] << " <pid>" << std::endl;
+    return PARAM_ERROR;
+  }
+
+  pid_t subject_pid = atoi(argv[1]);
+  if (subject_pid <= 0 || kill(subject_pid, 0) == -1) {
+    std::cerr << "no process with pid " << argv[1] << std::endl;
+    return PARAM_ERROR;
+  }
+
+  string exe_path = read_exe_path(subject_pid);
+  vector<string> args = read_cmdline(subject_pid);
+  if (exe_path.empty() || args.empty()) {
+    perror("couldn't read subject's executable");
+    return PARAM_ERROR;
+  }
+  // the header and symbol index expect argv from the subject's point of view
+  vector<char *> subject_argv;
+  for (auto &arg : args) {
+    subject_argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  subject_argv.push_back(nullptr);
+
+  setup_global_vars();
+  set_subject_pid(subject_pid);
+  set_attached();
+
+  string env_res = getenv_safe("COLLECTOR_RESULT_FILE", "result.bin");
+  DEBUG("result file " << env_res);
+  ofstream result_file(env_res, std::ios::binary);
+  if (result_file.fail()) {
+    SHUTDOWN_PERROR(subject_pid, result_file, INTERNAL_ERROR,
+                    "couldn't open result file");
+  }
+
+  int done_fd = setup_done_handler();
+
+  DEBUG("initializing pfm");
+  pfm_initialize();
+
+  const bool wattsup_enabled = preset_enabled("wattsup");
+  int wu_fd = -1;
+  if (wattsup_enabled) {
+    wu_fd = wu_setup();
+    DEBUG("wu_fd is " << wu_fd);
+  }
+
+  DEBUG_CRITICAL("attaching to " << exe_path << " (pid: " << subject_pid
+                                 << ")");
+  setup_collect_perf_data(done_fd, -1, &wu_fd, &result_file,
+                          subject_argv.size() - 1, subject_argv.data(),
+                          getenv_safe("COLLECTOR_INPUT"));
+
+  DEBUG("starting symbol index thread");
+  bg_reading symbol_reading{nullptr};
+  if (!setup_reading(&symbol_reading, build_symbol_index,
+                     const_cast<char *>(exe_path.c_str()))) {
+    SHUTDOWN_MSG(subject_pid, result_file, INTERNAL_ERROR,
+                 "couldn't start symbol index thread");
+  }
+  restart_reading(&symbol_reading);
+
+  if (getenv_safe("COLLECTOR_NOTIFY_START") == "yes") {
+    DEBUG("notifying parent process of collector start");
+    kill(getppid(), SIGUSR2);
+  }
+
+  int result = collect_perf_data(done_fd, -1, &symbol_reading);
+
+  DEBUG_CRITICAL("finished collector, detaching");
+  unregister_all_perf_fds();
+
+  if (wattsup_enabled && wu_fd != -1) {
+    wu_shutdown(wu_fd);
+  }
+  result_file.close();
+  close(done_fd);
+
+  return result;
+}
+
+}  // namespace alex
+
+int main(int argc, char **argv) { return alex::attach_main(argc, argv); }
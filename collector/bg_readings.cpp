@@ -24,10 +24,12 @@ void *reading_fn_wrapper(void *raw_args) {
   while (reading->running) {
     lock.unlock();
     DEBUG(t << ": running function");
-    reading->result = args->reading_fn(args->args);
-    DEBUG(t << ": stored result " << ptr_fmt(reading->result)
-            << ", acquiring lock");
+    void *result = args->reading_fn(args->args);
+    DEBUG(t << ": got result " << ptr_fmt(result) << ", acquiring lock");
     lock.lock();
+    reading->result = result;
+    // wake up anyone blocked in wait_for_result
+    reading->cv.notify_all();
     if (!reading->running) {
       DEBUG_CRITICAL(
           t << ": received notification to stop while function was running");
@@ -89,7 +91,7 @@ void restart_reading(bg_reading *reading) {
   unique_lock<mutex> lock(reading->mtx);
   reading->ready = true;
   lock.unlock();
-  reading->cv.notify_one();
+  reading->cv.notify_all();
 }
 
 void stop_reading(bg_reading *reading) {
@@ -103,7 +105,7 @@ void stop_reading(bg_reading *reading) {
   reading->running = false;
   reading->ready = true;
   lock.unlock();
-  reading->cv.notify_one();
+  reading->cv.notify_all();
   pthread_join(reading->thread, nullptr);
 }
 
@@ -111,6 +113,16 @@ bool has_result(bg_reading *reading) {
   return reading->running && reading->result != nullptr;
 }
 
+void *wait_for_result(bg_reading *reading) {
+  DEBUG("waiting for result from tid " << reading->thread);
+  unique_lock<mutex> lock(reading->mtx);
+  reading->cv.wait(lock, [&reading] {
+    return reading->result != nullptr || !reading->running;
+  });
+  lock.unlock();
+  return get_result(reading);
+}
+
 void *get_result(bg_reading *reading) {
   if (!reading->running) {
     DEBUG_CRITICAL("background tid " << reading->thread
@@ -27,6 +27,8 @@ void stop_reading(bg_reading* reading);
 
 bool has_result(bg_reading* reading);
 void* get_result(bg_reading* reading);
+// blocks until the reading function has produced a result
+void* wait_for_result(bg_reading* reading);
 
 }  // namespace alex
 
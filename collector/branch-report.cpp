@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "result_reader.hpp"
+#include "util.hpp"
+
+using alex::demangle;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+// a "block" longer than this must have had branches in it that the LBR didn't
+// record (eg. in the kernel), so it isn't counted
+enum : uint64_t { MAX_BLOCK_SIZE = 4096 };
+
+struct edge_count {
+  uint64_t taken = 0;
+  uint64_t mispredicted = 0;
+};
+
+/*
+ * Execution counts for one function, keyed by address range for blocks and by
+ * (from, to) for taken branches.
+ */
+struct function_profile {
+  map<pair<uint64_t, uint64_t>, uint64_t> blocks;
+  map<pair<uint64_t, uint64_t>, edge_count> edges;
+  uint64_t total_blocks = 0;
+};
+
+/*
+ * Adds one branch stack to the profiles. Each taken branch is an edge, and the
+ * code between where one branch landed and where the next one left from ran
+ * straight through, so it's a basic block that executed once.
+ */
+void add_branch_stack(const alex::BranchStack &stack,
+                      map<string, function_profile> *profiles) {
+  int n = stack.branches_size();
+  for (int i = 0; i < n; i++) {
+    const alex::Branch &branch = stack.branches(i);
+    function_profile &profile = (*profiles)[branch.symbol()];
+
+    edge_count &edge = profile.edges[{branch.from_ip(), branch.to_ip()}];
+    edge.taken++;
+    if (branch.mispredicted()) {
+      edge.mispredicted++;
+    }
+
+    // the stack is most recent first, so the previous branch is the next one
+    if (i + 1 < n) {
+      uint64_t start = stack.branches(i + 1).to_ip(), end = branch.from_ip();
+      if (start <= end && end - start < MAX_BLOCK_SIZE) {
+        profile.blocks[{start, end}]++;
+        profile.total_blocks++;
+      }
+    }
+  }
+}
+
+template <class K, class V>
+vector<pair<K, V>> sorted_by(const map<K, V> &m,
+                             uint64_t (*count)(const V &)) {
+  vector<pair<K, V>> entries(m.begin(), m.end());
+  std::stable_sort(entries.begin(), entries.end(),
+                   [count](const pair<K, V> &a, const pair<K, V> &b) {
+                     return count(a.second) > count(b.second);
+                   });
+  return entries;
+}
+
+void print_report(const map<string, function_profile> &profiles) {
+  vector<pair<string, function_profile>> functions = sorted_by<string>(
+      profiles,
+      +[](const function_profile &p) -> uint64_t { return p.total_blocks; });
+
+  for (const auto &function : functions) {
+    const function_profile &profile = function.second;
+    cout << (function.first.empty() ? "[unknown]" : demangle(function.first))
+         << " (" << profile.total_blocks << " block executions)" << endl;
+
+    cout << "  blocks:" << endl;
+    for (const auto &block : sorted_by<pair<uint64_t, uint64_t>>(
+             profile.blocks, +[](const uint64_t &c) { return c; })) {
+      printf("    0x%" PRIx64 "-0x%" PRIx64 " %" PRIu64 "\n", block.first.first,
+             block.first.second, block.second);
+    }
+
+    cout << "  taken branches:" << endl;
+    for (const auto &edge : sorted_by<pair<uint64_t, uint64_t>>(
+             profile.edges,
+             +[](const edge_count &e) -> uint64_t { return e.taken; })) {
+      printf("    0x%" PRIx64 " -> 0x%" PRIx64 " %" PRIu64
+             " (%" PRIu64 " mispredicted)\n",
+             edge.first.first, edge.first.second, edge.second.taken,
+             edge.second.mispredicted);
+    }
+    fflush(stdout);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    cerr << "usage: branch-report <result file>" << endl;
+    return 1;
+  }
+
+  alex::Header header;
+  map<string, function_profile> profiles;
+  size_t num_stacks = 0;
+  int result = alex::read_result_file(
+      argv[1], &header, [&](const alex::Timeslice &timeslice) {
+        for (const auto &stack : timeslice.branch_stacks()) {
+          add_branch_stack(stack, &profiles);
+          num_stacks++;
+        }
+      });
+  if (result != 0) {
+    return result;
+  }
+
+  if (num_stacks == 0) {
+    cerr << "no branch stacks in " << argv[1]
+         << ", was it collected with the lbr preset?" << endl;
+    return 4;
+  }
+  cout << header.program_name() << ": " << num_stacks << " branch stacks"
+       << endl;
+  print_report(profiles);
+  return 0;
+}
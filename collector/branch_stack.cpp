@@ -0,0 +1,56 @@
+#include <linux/perf_event.h>
+#include <perfmon/perf_event.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include "branch_stack.hpp"
+#include "const.hpp"
+#include "debug.hpp"
+
+namespace alex {
+
+int open_branch_sampler(pid_t target) {
+  perf_event_attr attr{};
+  memset(&attr, 0, sizeof(perf_event_attr));
+  attr.size = sizeof(perf_event_attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.disabled = true;
+  attr.exclude_kernel = true;
+  attr.sample_type = BRANCH_SAMPLE_TYPE;
+  attr.sample_period = BRANCH_SAMPLE_PERIOD;
+  attr.sample_id_all = SAMPLE_ID_ALL;
+  attr.use_clockid = true;
+  attr.clockid = SAMPLE_CLOCK;
+  attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_ANY;
+
+  int fd = perf_event_open(&attr, target, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  if (fd == -1) {
+    DEBUG("couldn't open branch sampler: " << strerror(errno));
+  }
+  return fd;
+}
+
+bool branch_stack_available() {
+  int fd = open_branch_sampler(0);
+  if (fd == -1) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+void add_branch_symbols(Timeslice *timeslice, const symbol_index &syms) {
+  for (auto &stack : *timeslice->mutable_branch_stacks()) {
+    for (auto &branch : *stack.mutable_branches()) {
+      uint64_t from = branch.from_ip();
+      const string *sym = syms.find_symbol(from);
+      if (sym != nullptr) {
+        branch.set_symbol(*sym);
+      }
+    }
+  }
+}
+
+}  // namespace alex
@@ -0,0 +1,33 @@
+#ifndef COLLECTOR_BRANCH_STACK
+#define COLLECTOR_BRANCH_STACK
+
+#include <sys/types.h>
+
+#include "protos/timeslice.pb.h"
+#include "symbols.hpp"
+
+namespace alex {
+
+/*
+ * Opens the branch sampler for target, a cpu cycles event that records the
+ * last branch record (the most recent taken branches in user code) once every
+ * BRANCH_SAMPLE_PERIOD cycles. The cpu clock can't record it itself since
+ * only hardware events have access to the LBR. Starts disabled, and returns
+ * -1 with errno set if the CPU (or a VM's virtual CPU) has no LBR.
+ */
+int open_branch_sampler(pid_t target);
+
+/*
+ * Whether a branch sampler can be opened in this process.
+ */
+bool branch_stack_available();
+
+/*
+ * Fills in the function containing each branch in the timeslice's branch
+ * stacks.
+ */
+void add_branch_symbols(Timeslice* timeslice, const symbol_index& syms);
+
+}  // namespace alex
+
+#endif
@@ -69,8 +69,18 @@ void set_perf_register_sock(int sock) { perf_register_sock = sock; }
 void close_fds(perf_fd_info info) {
   DEBUG("closing leader fd: " << info.cpu_clock_fd);
   close(info.cpu_clock_fd);
+  for (int leader_fd : info.core_pmu_leader_fds) {
+    DEBUG("closing core PMU leader fd: " << leader_fd);
+    close(leader_fd);
+  }
   for (const auto &entry : info.event_fds) {
-    DEBUG("closing fd: " << entry.second);
+    for (int event_fd : entry.second) {
+      DEBUG("closing fd: " << event_fd);
+      close(event_fd);
+    }
+  }
+  for (const auto &entry : info.sampler_fds) {
+    DEBUG("closing sampler fd: " << entry.second);
     close(entry.second);
   }
 }
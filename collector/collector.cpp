@@ -1,16 +1,17 @@
 #include <dlfcn.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include <cerrno>
 #include <csignal>
 #include <fstream>
 #include <map>
 #include <sstream>
 #include <string>
-#include <unordered_set>
 
 #include <libelfin/dwarf/dwarf++.hh>
 #include <libelfin/elf/elf++.hh>
@@ -23,29 +24,64 @@
 #include "inspect.hpp"
 #include "perf_reader.hpp"
 #include "shared.hpp"
+#include "symbols.hpp"
 #include "util.hpp"
 #include "wattsup.hpp"
 
 namespace alex {
 
-using std::ifstream;
-using std::istringstream;
 using std::map;
 using std::ofstream;
 using std::ostringstream;
 using std::string;
-using std::unordered_set;
 
 using main_fn_t = int (*)(int, char **, char **);
 
 static main_fn_t subject_main_fn;
 
-bool ready = false;
+/*
+ * Sends this side's startup status (0 if ready, otherwise an error code) to
+ * the other side of the handshake between the collector and the subject.
+ */
+bool send_handshake(int fd, int status) {
+  ssize_t count;
+  do {
+    count = write(fd, &status, sizeof(status));
+  } while (count == -1 && errno == EINTR);
+  return count == sizeof(status);
+}
+
+/*
+ * Blocks until the other side of the handshake sends its startup status.
+ * Returns the status, or INTERNAL_ERROR if the other side exited or didn't
+ * respond within timeout_ms.
+ */
+int wait_for_handshake(int fd, int timeout_ms) {
+  pollfd pfd = {fd, POLLIN, 0};
+  int ready_fds;
+  do {
+    ready_fds = poll(&pfd, 1, timeout_ms);
+  } while (ready_fds == -1 && errno == EINTR);
+  if (ready_fds == -1) {
+    perror("waiting for handshake");
+    return INTERNAL_ERROR;
+  }
+  if (ready_fds == 0) {
+    DEBUG_CRITICAL("timed out after " << timeout_ms
+                                      << "ms waiting for handshake");
+    return INTERNAL_ERROR;
+  }
 
-void ready_handler(int signum) {
-  if (signum == SIGUSR2) {
-    ready = true;
+  int status;
+  ssize_t count;
+  do {
+    count = read(fd, &status, sizeof(status));
+  } while (count == -1 && errno == EINTR);
+  if (count != sizeof(status)) {
+    DEBUG_CRITICAL("other side closed the handshake without a status");
+    return INTERNAL_ERROR;
   }
+  return status;
 }
 
 void sigint_handler(int signum) {
@@ -58,97 +94,6 @@ void sigint_handler(int signum) {
   }
 }
 
-void setup_global_vars() {
-  DEBUG("setting up globals");
-  // set up period
-  uint64_t period = -1;
-
-  if (period == -1) {
-    try {
-      period = stoull(getenv_safe("COLLECTOR_PERIOD", "10000000"));
-      // catch stoll exceptions
-    } catch (std::invalid_argument &e) {
-      DEBUG("failed to get period: invalid argument");
-      exit(ENV_ERROR);
-    } catch (std::out_of_range &e) {
-      DEBUG("failed to get period: out of range");
-      exit(ENV_ERROR);
-    }
-  }
-  DEBUG("period is " << period);
-
-  if (period < MIN_PERIOD) {
-    DEBUG_CRITICAL("period is smaller than " << MIN_PERIOD);
-    exit(PARAM_ERROR);
-  }
-
-  // set up events array, will be a set later though
-  DEBUG("getting events from env var");
-  auto events = str_split_set(getenv_safe("COLLECTOR_EVENTS"), ",");
-  auto presets = str_split_set(getenv_safe("COLLECTOR_PRESETS"), ",");
-  if (presets.find("cpu") != presets.end()) {
-    map<string, vector<string>> cpu = build_preset("cpu");
-    for (auto &it : cpu) {
-      for (const auto &event : it.second) {
-        events.insert(event);
-      }
-    }
-  }
-
-  if (presets.find("cache") != presets.end()) {
-    map<string, vector<string>> cache = build_preset("cache");
-    for (auto &it : cache) {
-      for (const auto &event : it.second) {
-        events.insert(event);
-      }
-    }
-  }
-
-  if (presets.find("branches") != presets.end()) {
-    map<string, vector<string>> branches = build_preset("branches");
-    for (auto &it : branches) {
-      for (const auto &event : it.second) {
-        events.insert(event);
-      }
-    }
-  }
-
-  auto collector_pid = getpid();
-
-  init_global_vars(period, collector_pid, events, presets);
-}
-
-map<uint64_t, kernel_sym> read_kernel_syms(
-    const char *path = "/proc/kallsyms") {
-  ifstream input(path);
-  map<uint64_t, kernel_sym> syms;
-
-  for (string line; getline(input, line);) {
-    kernel_sym sym;
-    istringstream line_stream(line);
-    string addr_s, type_s, tail;
-    uint64_t addr;
-
-    getline(line_stream, addr_s, ' ');
-    addr = stoul(addr_s, nullptr, 16);
-    getline(line_stream, type_s, ' ');
-    sym.type = type_s[0];
-    getline(line_stream, tail);
-    size_t tab;
-    if ((tab = tail.find('\t')) == string::npos) {
-      sym.sym = tail;
-      sym.cat = "";
-    } else {
-      sym.sym = tail.substr(0, tab);
-      sym.cat = tail.substr(tab + 1);
-    }
-
-    syms[addr] = sym;
-  }
-
-  return syms;
-}
-
 int setup_sigterm_handler() {
   sigset_t done_mask;
   sigemptyset(&done_mask);
@@ -194,12 +139,6 @@ static int collector_main(int argc, char **argv, char **env) {
 
   int result = 0;
 
-  struct sigaction ready_act {};
-  ready_act.sa_handler = ready_handler;
-  sigemptyset(&ready_act.sa_mask);
-  ready_act.sa_flags = 0;
-  sigaction(SIGUSR2, &ready_act, nullptr);
-
   struct sigaction sigint_act {};
   sigint_act.sa_handler = sigint_handler;
   sigemptyset(&sigint_act.sa_mask);
@@ -212,6 +151,14 @@ static int collector_main(int argc, char **argv, char **env) {
     exit(INTERNAL_ERROR);
   }
 
+  // startup handshake, one pipe in each direction
+  int to_subject[2], to_collector[2];
+  if (pipe2(to_subject, O_CLOEXEC) == -1 ||
+      pipe2(to_collector, O_CLOEXEC) == -1) {
+    perror("setting up handshake pipes");
+    exit(INTERNAL_ERROR);
+  }
+
   DEBUG("initializing pfm");
   pfm_initialize();
 
@@ -221,14 +168,21 @@ static int collector_main(int argc, char **argv, char **env) {
                    << getpid() << ")");
 
     close(sockets[0]);
+    close(to_subject[1]);
+    close(to_collector[0]);
     set_perf_register_sock(sockets[1]);
 
-    if (kill(global->collector_pid, SIGUSR2)) {
+    if (!send_handshake(to_collector[1], 0)) {
       perror("couldn't signal collector process");
       exit(INTERNAL_ERROR);
     }
-    while (!ready) {
-      // wait for parent
+    close(to_collector[1]);
+
+    int status = wait_for_handshake(to_subject[0], STARTUP_TIMEOUT);
+    close(to_subject[0]);
+    if (status != 0) {
+      DEBUG_CRITICAL("collector failed to start (" << status << "), exiting");
+      exit(status);
     }
 
     DEBUG_CRITICAL("received parent ready signal, starting child/real main");
@@ -245,6 +199,12 @@ static int collector_main(int argc, char **argv, char **env) {
           << global->collector_pid << ")");
     set_subject_pid(subject_pid);
 
+    close(to_subject[0]);
+    close(to_collector[1]);
+    // until the subject is told to start, errors are sent to it through the
+    // handshake instead of killing it
+    set_startup_fd(to_subject[1]);
+
     string env_res = getenv_safe("COLLECTOR_RESULT_FILE", "result.bin");
     DEBUG("result file " << env_res);
     ofstream result_file(env_res, std::ios::binary);
@@ -256,25 +216,8 @@ static int collector_main(int argc, char **argv, char **env) {
                       "couldn't open result file");
     }
 
-    DEBUG("checking for debug symbols");
-
-    vector<string> source_scope_v = {"%%"};
-    unordered_set<string> source_scope(source_scope_v.begin(),
-                                       source_scope_v.end());
-
-    // Get all the dwarf files for debug symbols
-
-    map<interval, string, cmpByInterval> sym_map;
-
-    memory_map::get_instance().build(source_scope, &sym_map, argv[0]);
-
-    std::map<interval, std::shared_ptr<line>, cmpByInterval> ranges =
-        memory_map::get_instance().ranges();
-
     int sigterm_fd = setup_sigterm_handler();
 
-    map<uint64_t, kernel_sym> kernel_syms = read_kernel_syms();
-
     const bool wattsup_enabled = preset_enabled("wattsup");
     int wu_fd = -1;
     if (wattsup_enabled) {
@@ -284,16 +227,34 @@ static int collector_main(int argc, char **argv, char **env) {
     }
 
     DEBUG("setting up collector");
-    bg_reading rapl_reading{nullptr}, wattsup_reading{nullptr};
-    setup_collect_perf_data(sigterm_fd, sockets[0], wu_fd, &result_file, argc,
-                            argv, getenv_safe("COLLECTOR_INPUT"), &rapl_reading,
-                            &wattsup_reading);
+    setup_collect_perf_data(sigterm_fd, sockets[0], &wu_fd, &result_file, argc,
+                            argv, getenv_safe("COLLECTOR_INPUT"));
+
+    // Loading debug symbols can take a long time for big executables, so do it
+    // in the background and let the subject start running in the meantime.
+    // Samples taken before it finishes are buffered by collect_perf_data.
+    DEBUG("starting symbol index thread");
+    bg_reading symbol_reading{nullptr};
+    if (!setup_reading(&symbol_reading, build_symbol_index, argv[0])) {
+      SHUTDOWN_MSG(subject_pid, result_file, INTERNAL_ERROR,
+                   "couldn't start symbol index thread");
+    }
+    restart_reading(&symbol_reading);
 
-    DEBUG("result file opened, sending ready (SIGUSR2) signal to child");
+    DEBUG("result file opened, sending ready signal to child");
+
+    set_startup_fd(-1);
+    if (!send_handshake(to_subject[1], 0)) {
+      SHUTDOWN_PERROR(subject_pid, result_file, INTERNAL_ERROR,
+                      "couldn't signal subject process");
+    }
+    close(to_subject[1]);
 
-    kill(subject_pid, SIGUSR2);
-    while (!ready) {
-      // wait for child
+    int status = wait_for_handshake(to_collector[0], STARTUP_TIMEOUT);
+    close(to_collector[0]);
+    if (status != 0) {
+      SHUTDOWN_MSG(subject_pid, result_file, INTERNAL_ERROR,
+                   "subject process failed to start");
     }
 
     DEBUG("received child ready signal, starting collector");
@@ -303,9 +264,7 @@ static int collector_main(int argc, char **argv, char **env) {
       kill(getppid(), SIGUSR2);
     }
 
-    result =
-        collect_perf_data(kernel_syms, sigterm_fd, sockets[0], &rapl_reading,
-                          &wattsup_reading, sym_map, ranges);
+    result = collect_perf_data(sigterm_fd, sockets[0], &symbol_reading);
 
     DEBUG_CRITICAL("finished collector, closing file");
 
@@ -3,6 +3,7 @@
 
 #include <linux/perf_event.h>
 #include <cinttypes>
+#include <ctime>
 #include "protos/timeslice.pb.h"
 
 namespace alex {
@@ -36,17 +37,43 @@ const char* callchain_str(perf_callchain_context callchain);
 StackFrame_Section callchain_enum(perf_callchain_context callchain);
 
 #define SAMPLE_ID_ALL true  // whether sample_id_all should be set
+// the clock every event's sample times are on (through use_clockid), and the
+// energy sampler's readings too, so the two can be lined up
+#define SAMPLE_CLOCK CLOCK_MONOTONIC
 #ifndef SAMPLE_MAX_STACK    // can be set by make command
 #define SAMPLE_MAX_STACK \
   127  // default value found in /proc/sys/kernel/perf_event_max_stacks
 #endif
 enum : uint32_t {
-  SAMPLE_TYPE = (PERF_SAMPLE_TIME | PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_TID),
+  SAMPLE_TYPE = (PERF_SAMPLE_TIME | PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_TID |
+                 PERF_SAMPLE_CPU),
   SAMPLE_ID_ALL_TYPE = (PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_STREAM_ID),
-  SAMPLE_TYPE_COMBINED = (SAMPLE_TYPE | SAMPLE_ID_ALL_TYPE)
+  SAMPLE_TYPE_COMBINED = (SAMPLE_TYPE | SAMPLE_ID_ALL_TYPE),
+  // memory samples are written to the cpu clock's buffer, so they need the
+  // same sample_id fields to be told apart from its samples (and the same
+  // PERF_SAMPLE_CPU, which is in every record's sample_id too)
+  MEMORY_SAMPLE_TYPE = (PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+                        PERF_SAMPLE_ADDR | PERF_SAMPLE_CPU |
+                        PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC |
+                        SAMPLE_ID_ALL_TYPE),
+  MEMORY_SAMPLE_PERIOD = 2003,  // loads between memory samples, prime so it
+                                // doesn't line up with loop iterations
+  MEMORY_SAMPLE_LATENCY = 30,   // min cycles for a load to be sampled
+  // likewise for the branch sampler
+  BRANCH_SAMPLE_TYPE = (PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CPU |
+                        PERF_SAMPLE_BRANCH_STACK | SAMPLE_ID_ALL_TYPE),
+  BRANCH_SAMPLE_PERIOD = 1000003,  // cycles between branch samples
+  BRANCH_STACK_MAX_ENTRIES = 32,   // the deepest LBR so far
+  // the cpu clock's extra fields when unwinding with call frame information
+  USER_STACK_SAMPLE_TYPE = (PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER),
+  DEFAULT_STACK_DUMP_SIZE = 8192,  // bytes of user stack copied per sample
+  MAX_STACK_DUMP_SIZE = 65528      // the most the kernel will copy, since
+                                   // records' sizes are 16 bit
 };
 
 enum : int {
+  STARTUP_TIMEOUT = 30000,    // ms to wait for the other side of the startup
+                              // handshake before giving up
   SAMPLE_EPOLL_TIMEOUT = -1,  // wait "forever"
   MAX_SAMPLE_PERIOD_SKIPS = 30,
   MAX_RECORD_READS = 100  // max number of times to check for another record
@@ -54,11 +81,28 @@ enum : int {
 };
 
 enum : size_t {
-  EPOLL_TIME_DIFF_MAX = 100,  // max timestamp difference between epoll_wait
-                              // before printing to err log
-  PERIOD_ADJUST_SCALE = 10,   // scale to increase/decrease period due to
-                              // throttle/unthrottle events
-  MIN_PERIOD = 100000         // any lower will break everything
+  EPOLL_TIME_DIFF_MAX = 100,       // max timestamp difference between
+                                   // epoll_wait before printing to err log
+  PERIOD_ADJUST_SCALE = 10,        // scale to increase/decrease period due to
+                                   // throttle/unthrottle events
+  MIN_PERIOD = 100000,             // any lower will break everything
+  KALLSYMS_READ_SIZE = 1 << 20,    // bytes to read from /proc/kallsyms at once
+  PERF_MAP_READ_SIZE = 1 << 16,    // bytes to read from a perf map at once
+  PERF_MAP_REREAD_INTERVAL = 100,  // min ms between rereading a perf map for
+                                   // a missing symbol
+  PERF_MAP_MAX_OVERLAP = 8,        // number of earlier perf map symbols to
+                                   // check for one containing an address
+  DWARF_TYPE_MAX_DEPTH = 16,       // max typedefs/qualifiers to follow when
+                                   // working out the size of a variable
+  DATA_MAP_REREAD_INTERVAL = 100,  // min ms between rereading the subject's
+                                   // maps for an unknown data address
+  DEFAULT_NUM_COUNTERS = 4,        // generic counters to assume if libpfm
+                                   // doesn't know the PMU
+  OFF_CPU_MAX_PENDING = 256,       // off-CPU intervals a thread can have
+                                   // waiting for its next timeslice before
+                                   // they're written without one
+  // likewise for memory samples
+  MEMORY_SAMPLE_MAX_PENDING = 4096
 };
 
 const char* record_type_str(int type);
@@ -0,0 +1,135 @@
+#include <elf.h>
+#include <zlib.h>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "debug.hpp"
+#include "debug_loader.hpp"
+
+namespace alex {
+
+using std::map;
+using std::string;
+using std::vector;
+
+/*
+ * Returns the name of the old style compressed version of a debug section,
+ * eg. .zdebug_info for .debug_info.
+ */
+static string zdebug_name(const string& name) { return ".z" + name.substr(1); }
+
+bool has_debug_info(const elf::elf& f) {
+  return f.get_section(".debug_info").valid() ||
+         f.get_section(zdebug_name(".debug_info")).valid();
+}
+
+/*
+ * Inflates a zlib stream into out, which must already be the size of the
+ * uncompressed data. Returns false if the data is corrupt or the wrong size.
+ */
+static bool inflate_section(const void* data, size_t size, vector<char>* out) {
+  uLongf out_size = out->size();
+  if (uncompress(reinterpret_cast<Bytef*>(out->data()), &out_size,
+                 static_cast<const Bytef*>(data), size) != Z_OK) {
+    return false;
+  }
+  return out_size == out->size();
+}
+
+class debug_loader : public ::dwarf::loader {
+ public:
+  explicit debug_loader(elf::elf f) : _f(std::move(f)) {}
+
+  const void* load(::dwarf::section_type section, size_t* size_out) override {
+    auto cached = _decompressed.find(section);
+    if (cached != _decompressed.end()) {
+      *size_out = cached->second.size();
+      return cached->second.data();
+    }
+
+    string name = ::dwarf::elf::section_type_to_name(section);
+    const auto& sec = _f.get_section(name);
+    if (sec.valid()) {
+      if ((static_cast<uint64_t>(sec.get_hdr().flags) & SHF_COMPRESSED) == 0) {
+        *size_out = sec.size();
+        return sec.data();
+      }
+      // starts with an Elf32_Chdr or Elf64_Chdr, depending on the file's
+      // class, giving the compression type and size
+      bool is_32 = _f.get_hdr().ei_class == elf::elfclass::_32;
+      size_t chdr_size = is_32 ? sizeof(Elf32_Chdr) : sizeof(Elf64_Chdr);
+      if (sec.size() < chdr_size) {
+        DEBUG_CRITICAL("compressed section " << name << " is truncated");
+        return nullptr;
+      }
+      uint32_t type;
+      uint64_t raw_size;
+      if (is_32) {
+        Elf32_Chdr chdr;
+        memcpy(&chdr, sec.data(), sizeof(chdr));
+        type = chdr.ch_type;
+        raw_size = chdr.ch_size;
+      } else {
+        Elf64_Chdr chdr;
+        memcpy(&chdr, sec.data(), sizeof(chdr));
+        type = chdr.ch_type;
+        raw_size = chdr.ch_size;
+      }
+      if (type != ELFCOMPRESS_ZLIB) {
+        DEBUG_CRITICAL("unsupported compression type " << type << " for "
+                                                       << name);
+        return nullptr;
+      }
+      return decompress(section, name,
+                        static_cast<const char*>(sec.data()) + chdr_size,
+                        sec.size() - chdr_size, raw_size, size_out);
+    }
+
+    const auto& zsec = _f.get_section(zdebug_name(name));
+    if (zsec.valid()) {
+      // "ZLIB" followed by the uncompressed size as a big endian uint64
+      const auto* data = static_cast<const unsigned char*>(zsec.data());
+      if (zsec.size() < 12 || memcmp(data, "ZLIB", 4) != 0) {
+        DEBUG_CRITICAL("malformed section " << zdebug_name(name));
+        return nullptr;
+      }
+      uint64_t size = 0;
+      for (int i = 4; i < 12; i++) {
+        size = (size << 8) | data[i];
+      }
+      return decompress(section, name, data + 12, zsec.size() - 12, size,
+                        size_out);
+    }
+
+    return nullptr;
+  }
+
+ private:
+  const void* decompress(::dwarf::section_type section, const string& name,
+                         const void* data, size_t size, uint64_t raw_size,
+                         size_t* size_out) {
+    DEBUG("decompressing " << name << " (" << size << " -> " << raw_size
+                           << " bytes)");
+    vector<char>& out = _decompressed[section];
+    out.resize(raw_size);
+    if (!inflate_section(data, size, &out)) {
+      DEBUG_CRITICAL("failed to decompress " << name);
+      _decompressed.erase(section);
+      return nullptr;
+    }
+    *size_out = out.size();
+    return out.data();
+  }
+
+  elf::elf _f;
+  map<::dwarf::section_type, vector<char>> _decompressed;
+};
+
+std::shared_ptr<::dwarf::loader> create_debug_loader(const elf::elf& f) {
+  return std::make_shared<debug_loader>(f);
+}
+
+}  // namespace alex
@@ -0,0 +1,26 @@
+#ifndef COLLECTOR_DEBUG_LOADER
+#define COLLECTOR_DEBUG_LOADER
+
+#include <memory>
+
+#include <libelfin/dwarf/dwarf++.hh>
+#include <libelfin/elf/elf++.hh>
+
+namespace alex {
+
+/*
+ * Whether the ELF file has a .debug_info section, compressed or not.
+ */
+bool has_debug_info(const elf::elf& f);
+
+/*
+ * Like dwarf::elf::create_loader, but also reads zlib compressed sections,
+ * both SHF_COMPRESSED ones and the older .zdebug_* format. Each compressed
+ * section is decompressed once, the first time it's loaded, and kept for the
+ * life of the loader.
+ */
+std::shared_ptr<::dwarf::loader> create_debug_loader(const elf::elf& f);
+
+}  // namespace alex
+
+#endif
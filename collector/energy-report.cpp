@@ -0,0 +1,314 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "result_reader.hpp"
+#include "util.hpp"
+
+using alex::demangle;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+// the cumulative energy of each package is in the events under this, followed
+// by the package's number (its subzones have a slash after that)
+#define RAPL_PACKAGE_EVENT "package-"
+#define WATTSUP_EVENT "wattsup"
+
+// z for a two sided 95% interval, the bounds are a normal approximation
+const double CONFIDENCE_Z = 1.96;
+// how far off a single reading can be, in joules for RAPL (its energy status
+// unit is usually 2^-14 J) and watts for WattsUp (the collector records whole
+// watts)
+const double RAPL_RESOLUTION = 61e-6;
+const double WATTSUP_RESOLUTION = 0.5;
+
+/*
+ * A timeslice, reduced to what's needed to attribute energy to it. It covers
+ * the time since its thread's previous timeslice.
+ */
+struct slice {
+  uint64_t start;
+  uint64_t end;
+  // timer ticks per ns of the slice, proportional to the share of it the
+  // thread spent running, since the cpu clock only ticks while it is
+  double rate;
+  int package;
+  string function;
+  string line;
+  // joules attributed to it, and the measurement error they carry
+  double energy = 0;
+  double error = 0;
+};
+
+/*
+ * Energy used between two readings, by a package or (for WattsUp) the whole
+ * machine.
+ */
+struct energy_interval {
+  uint64_t start;
+  uint64_t end;
+  double joules;
+  // how far off joules could be from the readings' resolution
+  double error;
+};
+
+/*
+ * Energy attributed to a function or line, with the terms of its variance.
+ */
+struct attribution {
+  double joules = 0;
+  // sum of each timeslice's joules squared, for the sampling error
+  double squares = 0;
+  double measurement = 0;
+  size_t timeslices = 0;
+};
+
+/*
+ * The intervals between consecutive readings of a cumulative energy counter
+ * in microjoules, given as (time, reading) in any order.
+ */
+vector<energy_interval> counter_intervals(
+    vector<pair<uint64_t, uint64_t>> readings) {
+  std::sort(readings.begin(), readings.end());
+  vector<energy_interval> intervals;
+  for (size_t i = 1; i < readings.size(); i++) {
+    const auto &prev = readings[i - 1], &next = readings[i];
+    if (next.first == prev.first || next.second < prev.second) {
+      continue;
+    }
+    intervals.push_back({prev.first, next.first,
+                         (next.second - prev.second) / 1e6,
+                         2 * RAPL_RESOLUTION});
+  }
+  return intervals;
+}
+
+/*
+ * The intervals between consecutive readings of a power meter in watts, given
+ * as (time, reading) in any order, with the power over each taken as the
+ * average of its ends.
+ */
+vector<energy_interval> power_intervals(
+    vector<pair<uint64_t, uint64_t>> readings) {
+  std::sort(readings.begin(), readings.end());
+  vector<energy_interval> intervals;
+  for (size_t i = 1; i < readings.size(); i++) {
+    const auto &prev = readings[i - 1], &next = readings[i];
+    if (next.first == prev.first) {
+      continue;
+    }
+    double seconds = (next.first - prev.first) / 1e9;
+    intervals.push_back({prev.first, next.first,
+                         (prev.second + next.second) / 2.0 * seconds,
+                         WATTSUP_RESOLUTION * seconds});
+  }
+  return intervals;
+}
+
+/*
+ * Splits each interval's energy across the slices that overlap it, weighted by
+ * how long each overlaps it and how much of that its thread spent running.
+ * Returns the joules of intervals that no slice overlapped.
+ */
+double attribute(const vector<energy_interval> &intervals,
+                 vector<slice *> slices) {
+  std::sort(slices.begin(), slices.end(),
+            [](const slice *a, const slice *b) { return a->start < b->start; });
+  double unattributed = 0;
+  size_t next = 0;
+  vector<slice *> active;
+  vector<double> weights;
+  for (const auto &interval : intervals) {
+    while (next < slices.size() && slices[next]->start < interval.end) {
+      active.push_back(slices[next++]);
+    }
+    active.erase(std::remove_if(active.begin(), active.end(),
+                                [&interval](const slice *s) {
+                                  return s->end <= interval.start;
+                                }),
+                 active.end());
+
+    double total = 0;
+    weights.assign(active.size(), 0);
+    for (size_t i = 0; i < active.size(); i++) {
+      uint64_t overlap_start = std::max(interval.start, active[i]->start),
+               overlap_end = std::min(interval.end, active[i]->end);
+      if (overlap_end > overlap_start) {
+        weights[i] = (overlap_end - overlap_start) * active[i]->rate;
+        total += weights[i];
+      }
+    }
+    if (total == 0) {
+      unattributed += interval.joules;
+      continue;
+    }
+    for (size_t i = 0; i < active.size(); i++) {
+      double fraction = weights[i] / total;
+      active[i]->energy += fraction * interval.joules;
+      active[i]->error += fraction * interval.error;
+    }
+  }
+  return unattributed;
+}
+
+void print_attributions(const char *title, const map<string, attribution> &m,
+                        double total) {
+  vector<pair<string, attribution>> entries(m.begin(), m.end());
+  std::stable_sort(
+      entries.begin(), entries.end(),
+      [](const pair<string, attribution> &a,
+         const pair<string, attribution> &b) {
+        return a.second.joules > b.second.joules;
+      });
+
+  cout << title << ":" << endl;
+  for (const auto &entry : entries) {
+    const attribution &a = entry.second;
+    // each timeslice's energy goes to wherever its sample landed, which is a
+    // draw from where the thread was during it, so the sum has the variance
+    // of a weighted binomial, plus the readings' own error
+    double share = total > 0 ? a.joules / total : 0;
+    double deviation =
+        std::sqrt(a.squares * (1 - share) + a.measurement * a.measurement);
+    printf("  %12.6f J  [%.6f, %.6f]  %5.1f%%  %s (%zu timeslices)\n",
+           a.joules, std::max(0.0, a.joules - CONFIDENCE_Z * deviation),
+           a.joules + CONFIDENCE_Z * deviation, 100 * share,
+           entry.first.c_str(), a.timeslices);
+  }
+  fflush(stdout);
+}
+
+/*
+ * Totals up the slices' energy by leaf function and line and prints them.
+ */
+void print_report(const char *source, const vector<slice> &slices,
+                  double unattributed) {
+  map<string, attribution> functions, lines;
+  double total = 0;
+  for (const auto &s : slices) {
+    total += s.energy;
+    for (attribution *a : {&functions[s.function], &lines[s.line]}) {
+      a->joules += s.energy;
+      a->squares += s.energy * s.energy;
+      // the error in one interval's readings is shared by every slice it was
+      // split across, so it adds up linearly rather than in quadrature
+      a->measurement += s.error;
+      a->timeslices++;
+    }
+  }
+  printf("%s energy: %.6f J attributed, %.6f J while no timeslice was "
+         "running\n",
+         source, total, unattributed);
+  print_attributions("functions", functions, total);
+  print_attributions("lines", lines, total);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    cerr << "usage: energy-report <result file>" << endl;
+    return 1;
+  }
+
+  alex::Header header;
+  vector<slice> slices;
+  // cumulative readings of each package, and the meter's
+  map<int, vector<pair<uint64_t, uint64_t>>> package_readings;
+  vector<pair<uint64_t, uint64_t>> wattsup_readings;
+  map<uint32_t, uint64_t> last_times;
+  auto add_timeslice = [&](const alex::Timeslice &timeslice) {
+    // timeslices without ticks only carry records the thread had waiting, and
+    // don't end a stretch of its running time
+    if (timeslice.num_cpu_timer_ticks() == 0) {
+      return;
+    }
+    uint64_t time = timeslice.cpu_time();
+    for (const auto &event : timeslice.events()) {
+      const string &name = event.first;
+      if (name == WATTSUP_EVENT) {
+        wattsup_readings.emplace_back(time, event.second);
+      } else if (name.compare(0, strlen(RAPL_PACKAGE_EVENT),
+                              RAPL_PACKAGE_EVENT) == 0 &&
+                 name.find('/') == string::npos) {
+        int package = atoi(name.c_str() + strlen(RAPL_PACKAGE_EVENT));
+        package_readings[package].emplace_back(time, event.second);
+      }
+    }
+
+    // a thread's first timeslice has no start, so it isn't attributed any
+    auto last_time = last_times.find(timeslice.tid());
+    uint64_t start = last_time == last_times.end() ? time : last_time->second;
+    last_times[timeslice.tid()] = time;
+    if (start >= time || timeslice.stack_frames_size() == 0) {
+      return;
+    }
+    const alex::StackFrame &leaf = timeslice.stack_frames(0);
+    slice s;
+    s.start = start;
+    s.end = time;
+    s.rate = static_cast<double>(timeslice.num_cpu_timer_ticks()) /
+             (s.end - s.start);
+    s.package = timeslice.package();
+    s.function =
+        leaf.symbol().empty() ? "[unknown]" : demangle(leaf.symbol());
+    const string &file =
+        leaf.full_location().empty() ? leaf.file_name() : leaf.full_location();
+    s.line = file.empty() || leaf.line() == 0
+                 ? "[unknown] in " + s.function
+                 : file + ":" + std::to_string(leaf.line());
+    slices.push_back(s);
+  };
+  int result = alex::read_result_file(argv[1], &header, add_timeslice);
+  if (result != 0) {
+    return result;
+  }
+
+  if (package_readings.empty() && wattsup_readings.empty()) {
+    cerr << "no energy readings in " << argv[1]
+         << ", was it collected with the rapl or wattsup preset?" << endl;
+    return 4;
+  }
+  cout << header.program_name() << ": " << slices.size() << " timeslices"
+       << endl;
+
+  if (!package_readings.empty()) {
+    // each package's energy only goes to the timeslices that ran on it
+    double unattributed = 0;
+    for (const auto &entry : package_readings) {
+      vector<slice *> on_package;
+      for (auto &s : slices) {
+        if (s.package == entry.first) {
+          on_package.push_back(&s);
+        }
+      }
+      unattributed +=
+          attribute(counter_intervals(entry.second), on_package);
+    }
+    print_report("RAPL", slices, unattributed);
+  }
+
+  if (!wattsup_readings.empty()) {
+    for (auto &s : slices) {
+      s.energy = s.error = 0;
+    }
+    vector<slice *> all;
+    for (auto &s : slices) {
+      all.push_back(&s);
+    }
+    // the meter measures the whole machine, so every timeslice shares it
+    double unattributed = attribute(power_intervals(wattsup_readings), all);
+    print_report("WattsUp", slices, unattributed);
+  }
+  return 0;
+}
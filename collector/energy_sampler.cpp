@@ -0,0 +1,190 @@
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "clone.hpp"
+#include "const.hpp"
+#include "debug.hpp"
+#include "energy_sampler.hpp"
+#include "rapl.hpp"
+
+namespace alex {
+
+using std::atomic;
+using std::deque;
+using std::map;
+using std::string;
+using std::vector;
+
+/*
+ * Readings passed from the sampler thread to the collector. Each slot is a
+ * timestamp followed by one reading per zone. The thread only moves head and
+ * the collector only moves tail, so neither waits on the other.
+ */
+struct energy_ring {
+  vector<uint64_t> slots;
+  size_t width;
+  atomic<uint64_t> head{0};
+  atomic<uint64_t> tail{0};
+};
+
+energy_ring ring;
+
+// the readings taken out of the ring, oldest first, each laid out like a slot
+deque<vector<uint64_t>> energy_history;
+
+int energy_timer_fd = -1;
+pthread_t energy_thread;
+atomic<bool> energy_sampling{false};
+
+static uint64_t sample_clock_ns() {
+  timespec ts{};
+  clock_gettime(SAMPLE_CLOCK, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void *sample_energy(void *) {
+  uint64_t dropped = 0;
+  while (energy_sampling.load(std::memory_order_acquire)) {
+    uint64_t expirations;
+    if (read(energy_timer_fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations)) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DEBUG_CRITICAL("couldn't read energy timer: " << strerror(errno));
+      break;
+    }
+    if (!energy_sampling.load(std::memory_order_acquire)) {
+      break;
+    }
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) == ENERGY_RING_SIZE) {
+      dropped++;
+      continue;
+    }
+    uint64_t *slot = &ring.slots[(head % ENERGY_RING_SIZE) * ring.width];
+    // reading every zone takes a few syscalls, so stamp it with the middle
+    uint64_t before = sample_clock_ns();
+    read_energy_zones(slot + 1);
+    slot[0] = before + (sample_clock_ns() - before) / 2;
+    ring.head.store(head + 1, std::memory_order_release);
+  }
+  if (dropped != 0) {
+    DEBUG_CRITICAL("dropped " << dropped
+                              << " energy readings, the collector fell behind");
+  }
+  return nullptr;
+}
+
+bool start_energy_sampler(uint64_t interval) {
+  ring.width = 1 + energy_zones.size();
+  ring.slots.assign(ENERGY_RING_SIZE * ring.width, 0);
+  ring.head.store(0);
+  ring.tail.store(0);
+  energy_history.clear();
+
+  energy_timer_fd = timerfd_create(SAMPLE_CLOCK, TFD_CLOEXEC);
+  if (energy_timer_fd == -1) {
+    DEBUG_CRITICAL("couldn't create energy timer: " << strerror(errno));
+    return false;
+  }
+  itimerspec spec{};
+  spec.it_interval.tv_sec = interval / 1000000;
+  spec.it_interval.tv_nsec = (interval % 1000000) * 1000;
+  spec.it_value = spec.it_interval;
+  if (timerfd_settime(energy_timer_fd, 0, &spec, nullptr) == -1) {
+    DEBUG_CRITICAL("couldn't start energy timer: " << strerror(errno));
+    close(energy_timer_fd);
+    energy_timer_fd = -1;
+    return false;
+  }
+
+  energy_sampling.store(true, std::memory_order_release);
+  if ((errno = real_pthread_create(&energy_thread, nullptr, sample_energy,
+                                   nullptr)) != 0) {
+    DEBUG_CRITICAL("couldn't create energy sampler thread: "
+                   << strerror(errno));
+    energy_sampling.store(false);
+    close(energy_timer_fd);
+    energy_timer_fd = -1;
+    return false;
+  }
+  DEBUG("sampling energy every " << interval << "us in thread "
+                                 << energy_thread);
+  return true;
+}
+
+/*
+ * Moves the readings the thread has taken since the last call into
+ * energy_history, and drops the ones too old to be asked for again.
+ */
+static void drain_energy_ring() {
+  uint64_t head = ring.head.load(std::memory_order_acquire);
+  uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  for (; tail != head; tail++) {
+    auto slot = ring.slots.begin() + (tail % ENERGY_RING_SIZE) * ring.width;
+    energy_history.emplace_back(slot, slot + ring.width);
+  }
+  ring.tail.store(tail, std::memory_order_release);
+
+  if (!energy_history.empty()) {
+    uint64_t newest = energy_history.back()[0];
+    while (energy_history.size() > 1 &&
+           energy_history[1][0] + ENERGY_HISTORY < newest) {
+      energy_history.pop_front();
+    }
+  }
+}
+
+bool energy_at(uint64_t time, map<string, uint64_t> *energy) {
+  drain_energy_ring();
+  if (energy_history.empty()) {
+    return false;
+  }
+  // the first reading taken after time
+  auto before = [](uint64_t t, const vector<uint64_t> &reading) {
+    return t < reading[0];
+  };
+  auto after = std::upper_bound(energy_history.begin(), energy_history.end(),
+                                time, before);
+  const vector<uint64_t> &prev =
+      after == energy_history.begin() ? *after : *(after - 1);
+  const vector<uint64_t> &next = after == energy_history.end() ? prev : *after;
+
+  double fraction = 0;
+  if (next[0] > prev[0]) {
+    fraction = static_cast<double>(time - prev[0]) / (next[0] - prev[0]);
+  }
+  for (size_t i = 0; i < energy_zones.size(); i++) {
+    (*energy)[energy_zones[i].name] =
+        prev[i + 1] +
+        static_cast<uint64_t>(fraction * (next[i + 1] - prev[i + 1]));
+  }
+  return true;
+}
+
+void stop_energy_sampler() {
+  if (!energy_sampling.load()) {
+    return;
+  }
+  energy_sampling.store(false, std::memory_order_release);
+  // fire the timer now rather than waiting out the interval
+  itimerspec spec{};
+  spec.it_value.tv_nsec = 1;
+  timerfd_settime(energy_timer_fd, 0, &spec, nullptr);
+  pthread_join(energy_thread, nullptr);
+  close(energy_timer_fd);
+  energy_timer_fd = -1;
+  energy_history.clear();
+}
+
+}  // namespace alex
@@ -0,0 +1,43 @@
+#ifndef COLLECTOR_ENERGY_SAMPLER
+#define COLLECTOR_ENERGY_SAMPLER
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace alex {
+
+enum : uint64_t {
+  ENERGY_RING_SIZE = 4096,  // readings the sampler can get ahead of the
+                            // collector by before it starts dropping them
+  ENERGY_HISTORY = 1000000000  // ns of readings kept behind the newest, since
+                               // samples from different threads' buffers
+                               // arrive a little out of order
+};
+
+/*
+ * Starts a thread reading every one of energy_zones each interval
+ * microseconds, on a timerfd so the readings come at a fixed rate however busy
+ * the collector is. Each reading is stamped with SAMPLE_CLOCK, the clock the
+ * perf events' sample times are on, and put in a ring for energy_at to take.
+ * The zones must already be open. Returns false if the thread couldn't be
+ * started.
+ */
+bool start_energy_sampler(uint64_t interval);
+
+/*
+ * Each zone's energy at time, in microjoules by zone name, interpolated
+ * between the readings either side of it. Times after the newest reading get
+ * the newest reading, since the next one isn't in yet. Returns false if there
+ * are no readings yet.
+ */
+bool energy_at(uint64_t time, std::map<std::string, uint64_t>* energy);
+
+/*
+ * Stops and joins the thread. The readings it took are dropped.
+ */
+void stop_energy_sampler();
+
+}  // namespace alex
+
+#endif
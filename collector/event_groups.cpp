@@ -0,0 +1,151 @@
+#include <linux/perf_event.h>
+#include <perfmon/pfmlib.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "const.hpp"
+#include "debug.hpp"
+#include "event_groups.hpp"
+#include "perf_sampler.hpp"
+#include "topdown.hpp"
+
+namespace alex {
+
+using std::ifstream;
+using std::map;
+using std::string;
+using std::vector;
+
+/*
+ * Whether the core PMU has fixed counters, which cycles and instructions are
+ * counted on rather than taking up a generic counter.
+ */
+static bool has_fixed_counters() {
+  pfm_pmu_t pmu;
+  pfm_for_all_pmus(pmu) {
+    pfm_pmu_info_t pinfo{};
+    pinfo.size = sizeof(pfm_pmu_info_t);
+    if (pfm_get_pmu_info(pmu, &pinfo) == PFM_SUCCESS && pinfo.is_present &&
+        pinfo.type == PFM_PMU_TYPE_CORE && pinfo.num_fixed_cntrs > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t available_counters() {
+  pfm_initialize();
+  int counters = 0;
+  pfm_pmu_t pmu;
+  pfm_for_all_pmus(pmu) {
+    pfm_pmu_info_t pinfo{};
+    pinfo.size = sizeof(pfm_pmu_info_t);
+    if (pfm_get_pmu_info(pmu, &pinfo) == PFM_SUCCESS && pinfo.is_present &&
+        pinfo.type == PFM_PMU_TYPE_CORE) {
+      DEBUG("core PMU " << pinfo.name << " has " << pinfo.num_cntrs
+                        << " generic counters");
+      counters = std::max(counters, pinfo.num_cntrs);
+    }
+  }
+  if (counters == 0) {
+    DEBUG_CRITICAL("couldn't find the number of counters, assuming "
+                   << DEFAULT_NUM_COUNTERS);
+    counters = DEFAULT_NUM_COUNTERS;
+  }
+
+  ifstream nmi_watchdog("/proc/sys/kernel/nmi_watchdog");
+  int watchdog_enabled = 0;
+  if (nmi_watchdog >> watchdog_enabled && watchdog_enabled != 0 &&
+      counters > 1) {
+    DEBUG("NMI watchdog is using a counter");
+    counters--;
+  }
+  return counters;
+}
+
+bool uses_counter(const string &event) {
+  if (is_topdown_event(event)) {
+    // the slots counter is fixed, and the metrics come from PERF_METRICS
+    return false;
+  }
+  perf_event_attr attr{};
+  memset(&attr, 0, sizeof(perf_event_attr));
+  if (setup_pfm_os_event(&attr, const_cast<char *>(event.c_str())) !=
+      PFM_SUCCESS) {
+    // it'll fail to open later anyway
+    return false;
+  }
+  if (attr.type == PERF_TYPE_HARDWARE &&
+      (attr.config == PERF_COUNT_HW_CPU_CYCLES ||
+       attr.config == PERF_COUNT_HW_INSTRUCTIONS) &&
+      has_fixed_counters()) {
+    return false;
+  }
+  if (attr.type == PERF_TYPE_HARDWARE || attr.type == PERF_TYPE_HW_CACHE ||
+      attr.type == PERF_TYPE_RAW) {
+    return true;
+  }
+  // the core PMU's own type, which libpfm sometimes uses instead of raw
+  ifstream type_file(PMU_ROOT "cpu/type");
+  uint32_t cpu_type;
+  return type_file >> cpu_type && attr.type == cpu_type;
+}
+
+map<string, size_t> schedule_event_groups(const vector<vector<string>> &units,
+                                          size_t counters) {
+  map<string, size_t> groups;
+  // each unit's events that need a counter, split into pieces no bigger than
+  // a group
+  vector<vector<string>> pieces;
+  for (const auto &unit : units) {
+    vector<string> piece;
+    for (const auto &event : unit) {
+      if (groups.count(event) != 0) {
+        continue;
+      }
+      if (!uses_counter(event)) {
+        groups[event] = ALL_EVENT_GROUPS;
+        continue;
+      }
+      // placeholder so events in several units are only placed once
+      groups[event] = 0;
+      piece.push_back(event);
+      if (piece.size() == counters) {
+        pieces.push_back(piece);
+        piece.clear();
+      }
+    }
+    if (!piece.empty()) {
+      pieces.push_back(piece);
+    }
+  }
+
+  std::stable_sort(pieces.begin(), pieces.end(),
+                   [](const vector<string> &a, const vector<string> &b) {
+                     return a.size() > b.size();
+                   });
+  // the number of counters used in each group so far
+  vector<size_t> used;
+  for (const auto &piece : pieces) {
+    size_t group = 0;
+    while (group < used.size() && used[group] + piece.size() > counters) {
+      group++;
+    }
+    if (group == used.size()) {
+      used.push_back(0);
+    }
+    used[group] += piece.size();
+    for (const auto &event : piece) {
+      groups[event] = group;
+    }
+  }
+  DEBUG("scheduled events into " << used.size() << " groups of " << counters
+                                 << " counters");
+  return groups;
+}
+
+}  // namespace alex
@@ -0,0 +1,40 @@
+#ifndef COLLECTOR_EVENT_GROUPS
+#define COLLECTOR_EVENT_GROUPS
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace alex {
+
+// the group of events that don't take up a counter, which are counted in
+// every timeslice no matter which group is active
+enum : size_t { ALL_EVENT_GROUPS = SIZE_MAX };
+
+/*
+ * The number of generic counters on the core PMU, according to libpfm, less
+ * the one the NMI watchdog holds on to if it's enabled.
+ */
+size_t available_counters();
+
+/*
+ * Whether the event takes up one of the core PMU's generic counters, as opposed
+ * to a fixed counter, being a software event, or belonging to a PMU with
+ * counters of its own (eg. msr).
+ */
+bool uses_counter(const std::string& event);
+
+/*
+ * Splits events into groups of at most counters events that use a counter,
+ * returning each event's group. Each unit is a set of related events (eg. a
+ * preset's) that are kept in the same group where they fit, so ratios between
+ * them come from the same time. Units are placed largest first, each in the
+ * first group with room.
+ */
+std::map<std::string, size_t> schedule_event_groups(
+    const std::vector<std::vector<std::string>>& units, size_t counters);
+
+}  // namespace alex
+
+#endif
@@ -1,9 +1,20 @@
+#include <perfmon/perf_event.h>
+#include <perfmon/pfmlib.h>
+#include <unistd.h>
+#include <cstring>
 #include <iostream>
 
+#include "branch_stack.hpp"
+#include "const.hpp"
 #include "debug.hpp"
 #include "find_events.hpp"
+#include "membw.hpp"
+#include "perf_sampler.hpp"
 #include "rapl.hpp"
 #include "shared.hpp"
+#include "topdown.hpp"
+#include "topology.hpp"
+#include "wattsup.hpp"
 
 namespace alex {
 
@@ -23,7 +34,28 @@ map<string, preset_info> get_all_preset_info() {
       pair<string, preset_info>(
           "wattsup", {.description = "Low frequency external power meter."}),
       pair<string, preset_info>(
-          "branches", {.description = "Branch prediction success rates."})};
+          "branches", {.description = "Branch prediction success rates."}),
+      pair<string, preset_info>(
+          "lbr", {.description = "Recently taken branches, for hot paths "
+                                 "through functions."}),
+      pair<string, preset_info>(
+          "memory", {.description = "Sampled load addresses and latencies, "
+                                    "and where their data came from."}),
+      pair<string, preset_info>(
+          "frequency", {.description = "Effective CPU frequency, from the "
+                                       "APERF and MPERF counters."}),
+      pair<string, preset_info>(
+          "topdown", {.description = "Where pipeline slots go: frontend, bad "
+                                     "speculation, backend, or retiring."}),
+      pair<string, preset_info>(
+          "membw", {.description = "Memory bandwidth of each socket, from "
+                                   "the memory controllers (system-wide)."}),
+      pair<string, preset_info>(
+          "software", {.description = "Page faults, context switches, and "
+                                      "migrations, which don't need a PMU."}),
+      pair<string, preset_info>(
+          "offcpu", {.description = "Time spent blocked or preempted, and "
+                                    "where threads were when it started."})};
 }
 
 set<string> get_all_presets() {
@@ -60,10 +92,117 @@ map<string, vector<string>> build_preset(const string &preset) {
     events.insert(pair<string, vector<string>>("branches", {"branches"}));
   } else if (preset == "rapl") {
     find_rapl_events(&events);
+  } else if (preset == "memory") {
+    // sampled by open_memory_sampler rather than counted, so these aren't
+    // added to the events; the first that can be encoded is used
+    events.insert(pair<string, vector<string>>(
+        "loads",
+        {"MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=" +
+             std::to_string(MEMORY_SAMPLE_LATENCY),
+         "MEM_INST_RETIRED:ALL_LOADS", "MEM_UOPS_RETIRED:ALL_LOADS"}));
+  } else if (preset == "lbr") {
+    // sampled by open_branch_sampler rather than counted
+    events.insert(pair<string, vector<string>>("branchStack", {"cpu-cycles"}));
+  } else if (preset == "frequency") {
+    // APERF counts at the actual frequency and MPERF at the base frequency,
+    // so their ratio is how far above or below base the CPU ran
+    events.insert(pair<string, vector<string>>("aperf", {APERF_EVENT}));
+    events.insert(pair<string, vector<string>>("mperf", {MPERF_EVENT}));
+  } else if (preset == "topdown") {
+    find_topdown_events(&events);
+  } else if (preset == "membw") {
+    // counted system-wide by open_membw_counters rather than per thread
+    find_membw_events(&events);
+  } else if (preset == "offcpu") {
+    // sampled by open_off_cpu_sampler rather than counted
+    events.insert(pair<string, vector<string>>(
+        "contextSwitches", {"PERF_COUNT_SW_CONTEXT_SWITCHES"}));
+  } else if (preset == "software") {
+    // counted by the kernel rather than the PMU, so these work in VMs and
+    // containers without one
+    events.insert(pair<string, vector<string>>("taskClock",
+                                               {"PERF_COUNT_SW_TASK_CLOCK"}));
+    events.insert(pair<string, vector<string>>("pageFaults",
+                                               {"PERF_COUNT_SW_PAGE_FAULTS"}));
+    events.insert(pair<string, vector<string>>(
+        "majorFaults", {"PERF_COUNT_SW_PAGE_FAULTS_MAJ"}));
+    events.insert(pair<string, vector<string>>(
+        "minorFaults", {"PERF_COUNT_SW_PAGE_FAULTS_MIN"}));
+    events.insert(pair<string, vector<string>>(
+        "contextSwitches", {"PERF_COUNT_SW_CONTEXT_SWITCHES"}));
+    events.insert(pair<string, vector<string>>(
+        "cpuMigrations", {"PERF_COUNT_SW_CPU_MIGRATIONS"}));
+    events.insert(pair<string, vector<string>>(
+        "alignmentFaults", {"PERF_COUNT_SW_ALIGNMENT_FAULTS"}));
   } else if (preset == "wattsup") {
     events.insert(pair<string, vector<string>>("wattsup", {"wattsup"}));
   }
   return events;
 }
 
+bool event_is_available(const string &event) {
+  pfm_initialize();
+  perf_event_attr attr{};
+  memset(&attr, 0, sizeof(perf_event_attr));
+  int pfm_result =
+      setup_pfm_os_event(&attr, const_cast<char *>(event.c_str()));
+  if (pfm_result != PFM_SUCCESS) {
+    DEBUG("pfm encoding error for " << event << ": "
+                                    << pfm_strerror(pfm_result));
+    return false;
+  }
+  // libpfm encodes events for the CPU model whether or not a PMU is exposed to
+  // this host (eg. in a VM), so only opening the event says if it's usable
+  int fd = perf_event_open(&attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  if (fd == -1) {
+    DEBUG("can't open " << event << ": " << strerror(errno));
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+bool preset_is_available(const string &preset) {
+  if (preset == "wattsup") {
+    return wu_setup() != -1;
+  } else if (preset == "lbr") {
+    return branch_stack_available();
+  } else if (preset == "membw") {
+    return membw_available();
+  } else if (preset == "topdown") {
+    // only the events this CPU has are in the preset, but the PERF_METRICS
+    // events can only be opened in the slots counter's group
+    auto events = build_preset(preset);
+    for (const auto &entry : events) {
+      const string &event = entry.second.front();
+      if (!is_topdown_event(event) || event == TOPDOWN_SLOTS_EVENT) {
+        if (!event_is_available(event)) {
+          return false;
+        }
+      }
+    }
+    return !events.empty();
+  } else if (preset == "rapl") {
+    return rapl_counters_available() || energy_zones_available();
+  } else {
+    auto presets = build_preset(preset);
+    for (auto entry : presets) {
+      auto low_level_events = entry.second;
+      bool has_low_level_event = false;
+      for (string event : low_level_events) {
+        if (event_is_available(event)) {
+          has_low_level_event = true;
+          break;
+        }
+      }
+
+      if (!has_low_level_event) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+}
+
 }  // namespace alex
\ No newline at end of file
@@ -23,6 +23,19 @@ map<string, preset_info> get_all_preset_info();
 set<string> get_all_presets();
 map<string, vector<string>> build_preset(const string& preset);
 
+/*
+ * Whether the event can be encoded and opened on this host, which is checked
+ * by opening it on the calling thread.
+ */
+bool event_is_available(const string& event);
+
+/*
+ * Whether the preset can run on this host. Counted presets need at least one of
+ * the events for each of their values to open, and the rest are checked by
+ * setting up whatever they read from.
+ */
+bool preset_is_available(const string& preset);
+
 }  // namespace alex
 
 #endif
\ No newline at end of file
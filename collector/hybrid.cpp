@@ -0,0 +1,143 @@
+#include <dirent.h>
+#include <perfmon/pfmlib.h>
+#include <perfmon/pfmlib_perf_event.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "debug.hpp"
+#include "hybrid.hpp"
+#include "perf_sampler.hpp"
+#include "topology.hpp"
+
+namespace alex {
+
+using std::ifstream;
+using std::string;
+using std::vector;
+
+static vector<core_pmu> read_core_pmus() {
+  vector<core_pmu> pmus;
+  DIR *dirp = opendir(PMU_ROOT);
+  if (dirp == nullptr) {
+    DEBUG("no PMUs in " PMU_ROOT);
+    return pmus;
+  }
+  struct dirent *dp;
+  while ((dp = readdir(dirp)) != nullptr) {
+    string name = dp->d_name;
+    if (name.compare(0, strlen(CORE_PMU_PREFIX), CORE_PMU_PREFIX) != 0) {
+      continue;
+    }
+    core_pmu pmu;
+    pmu.name = name;
+    ifstream type_file(PMU_ROOT + name + "/type");
+    ifstream cpus_file(PMU_ROOT + name + "/cpus");
+    string cpus;
+    if (!(type_file >> pmu.type) || !getline(cpus_file, cpus)) {
+      continue;
+    }
+    pmu.cpus = parse_cpu_list(cpus);
+    pmus.push_back(pmu);
+  }
+  closedir(dirp);
+  std::sort(pmus.begin(), pmus.end(),
+            [](const core_pmu &a, const core_pmu &b) { return a.name < b.name; });
+  if (pmus.size() > MAX_CORE_PMUS) {
+    pmus.resize(MAX_CORE_PMUS);
+  }
+  for (const auto &pmu : pmus) {
+    DEBUG("core PMU " << pmu.name << " (type " << pmu.type << ") has "
+                      << pmu.cpus.size() << " cpus");
+  }
+  return pmus;
+}
+
+const vector<core_pmu> &core_pmus() {
+  static const vector<core_pmu> pmus = read_core_pmus();
+  return pmus;
+}
+
+vector<int> read_cpu_core_types() {
+  vector<int> types;
+  for (size_t i = 0; i < core_pmus().size(); i++) {
+    for (int cpu : core_pmus()[i].cpus) {
+      if (static_cast<size_t>(cpu) >= types.size()) {
+        types.resize(cpu + 1, -1);
+      }
+      types[cpu] = i;
+    }
+  }
+  return types;
+}
+
+bool is_core_event(const perf_event_attr &attr) {
+  return attr.type == PERF_TYPE_HARDWARE || attr.type == PERF_TYPE_HW_CACHE ||
+         attr.type == PERF_TYPE_RAW ||
+         std::any_of(core_pmus().begin(), core_pmus().end(),
+                     [&attr](const core_pmu &p) { return p.type == attr.type; });
+}
+
+int setup_core_pmu_event(perf_event_attr *attr, const char *event,
+                         const core_pmu &pmu) {
+  memset(attr, 0, sizeof(perf_event_attr));
+  int pfm_result = setup_pfm_os_event(attr, const_cast<char *>(event));
+  if (pfm_result != PFM_SUCCESS || attr->type == pmu.type) {
+    return pfm_result;
+  }
+  if (attr->type == PERF_TYPE_HARDWARE || attr->type == PERF_TYPE_HW_CACHE) {
+    attr->config |= static_cast<uint64_t>(pmu.type) << CORE_PMU_TYPE_SHIFT;
+    return PFM_SUCCESS;
+  }
+
+  // libpfm picked the event from another kind of core, so ask each of its
+  // core PMUs for the event in turn. It sets the type of hybrid PMUs' events
+  // from sysfs, which is how the right one is told apart
+  pfm_pmu_t p;
+  pfm_for_all_pmus(p) {
+    pfm_pmu_info_t pinfo{};
+    pinfo.size = sizeof(pfm_pmu_info_t);
+    if (pfm_get_pmu_info(p, &pinfo) != PFM_SUCCESS || !pinfo.is_present ||
+        pinfo.type != PFM_PMU_TYPE_CORE) {
+      continue;
+    }
+    string qualified = string(pinfo.name) + "::" + event;
+    memset(attr, 0, sizeof(perf_event_attr));
+    if (setup_pfm_os_event(attr, const_cast<char *>(qualified.c_str())) ==
+            PFM_SUCCESS &&
+        attr->type == pmu.type) {
+      DEBUG("encoded " << event << " for " << pmu.name << " as "
+                       << qualified);
+      return PFM_SUCCESS;
+    }
+  }
+  return PFM_ERR_NOTFOUND;
+}
+
+uint32_t find_event_pmus(const string &event) {
+  if (core_pmus().empty()) {
+    return 0;
+  }
+  perf_event_attr attr{};
+  memset(&attr, 0, sizeof(perf_event_attr));
+  if (setup_pfm_os_event(&attr, const_cast<char *>(event.c_str())) !=
+          PFM_SUCCESS ||
+      !is_core_event(attr)) {
+    return 0;
+  }
+  uint32_t pmus = 0;
+  for (size_t i = 0; i < core_pmus().size(); i++) {
+    if (setup_core_pmu_event(&attr, event.c_str(), core_pmus()[i]) ==
+        PFM_SUCCESS) {
+      pmus |= 1u << i;
+    } else {
+      DEBUG_CRITICAL("no event " << event << " on " << core_pmus()[i].name
+                                 << " cores, it won't be counted on them");
+    }
+  }
+  return pmus;
+}
+
+}  // namespace alex
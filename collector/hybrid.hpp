@@ -0,0 +1,67 @@
+#ifndef COLLECTOR_HYBRID
+#define COLLECTOR_HYBRID
+
+#include <linux/perf_event.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace alex {
+
+// on hybrid CPUs each kind of core has its own PMU, cpu_core and cpu_atom,
+// instead of a single cpu PMU
+#define CORE_PMU_PREFIX "cpu_"
+
+// where the PMU type goes in the config of a hardware or hardware cache event
+// to count it on that PMU (PERF_PMU_TYPE_SHIFT, from Linux 6.0)
+enum : uint32_t { CORE_PMU_TYPE_SHIFT = 32 };
+
+// the most core PMUs an event can be opened on, one bit each in event_pmus
+enum : size_t { MAX_CORE_PMUS = 32 };
+
+/*
+ * One kind of core on a hybrid CPU, and the cpus that are that kind.
+ */
+struct core_pmu {
+  std::string name;
+  uint32_t type;
+  std::vector<int> cpus;
+};
+
+/*
+ * The core PMUs in name order, which is the order event fds are opened in.
+ * Empty unless the CPU is hybrid.
+ */
+const std::vector<core_pmu>& core_pmus();
+
+/*
+ * The index in core_pmus of each cpu's PMU, indexed by cpu number, -1 for cpus
+ * that aren't in any. Empty unless the CPU is hybrid.
+ */
+std::vector<int> read_cpu_core_types();
+
+/*
+ * Whether the event is counted by the core PMU, and so is only counted on the
+ * kind of core it was encoded for.
+ */
+bool is_core_event(const perf_event_attr& attr);
+
+/*
+ * Encodes event for pmu. Hardware events get the PMU's type in their config,
+ * and raw events are encoded by whichever of libpfm's core PMUs it says is
+ * pmu, since the two kinds of core can have different events. Returns a libpfm
+ * error if the event doesn't exist on pmu.
+ */
+int setup_core_pmu_event(perf_event_attr* attr, const char* event,
+                         const core_pmu& pmu);
+
+/*
+ * The core PMUs (as bits of their index in core_pmus) that event can be
+ * counted on, or 0 if it isn't a core event or the CPU isn't hybrid, in which
+ * case it's opened once as usual.
+ */
+uint32_t find_event_pmus(const std::string& event);
+
+}  // namespace alex
+
+#endif
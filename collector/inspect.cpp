@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdlib>
@@ -30,6 +31,7 @@
 
 #include "const.hpp"
 #include "debug.hpp"
+#include "debug_loader.hpp"
 #include "inspect.hpp"
 #include "perf_reader.hpp"
 #include "util.hpp"
@@ -177,7 +179,7 @@ elf::elf locate_debug_executable(const string& filename) {
   f = elf::elf(elf::create_mmap_loader(fd));
 
   // If this file has a .debug_info section, return it
-  if (f.get_section(".debug_info").valid()) {
+  if (has_debug_info(f)) {
     return f;
   }
 
@@ -190,15 +192,33 @@ elf::elf locate_debug_executable(const string& filename) {
   // Build a set of paths to search for a debug version of the file
   vector<string> search_paths;
 
+  // Directories in COLLECTOR_DEBUG_PATH are searched before /usr/lib/debug,
+  // laid out the same way
+  vector<string> debug_dirs;
+  for (const string& dir :
+       str_split_vec(getenv_safe("COLLECTOR_DEBUG_PATH"), ":")) {
+    if (!dir.empty()) {
+      debug_dirs.push_back(dir);
+    }
+  }
+  debug_dirs.emplace_back("/usr/lib/debug");
+
   // Check for a build-id section
   string build_id = find_build_id(f);
   if (build_id.length() > 0) {
+    // an existing debuginfod client cache, <cache>/<build id>/debuginfo. The
+    // collector doesn't download anything itself, so it's only read from.
+    string cache_dir = getenv_safe("COLLECTOR_DEBUG_CACHE");
+    if (!cache_dir.empty()) {
+      search_paths.push_back(cache_dir + "/" + build_id + "/debuginfo");
+    }
+
     string prefix = build_id.substr(0, 2);
     string suffix = build_id.substr(2);
-
-    auto p =
-        string("/usr/lib/debug/.build-id/") + prefix + "/" + suffix + ".debug";
-    search_paths.push_back(p);
+    for (const string& dir : debug_dirs) {
+      search_paths.push_back(dir + "/.build-id/" + prefix + "/" + suffix +
+                             ".debug");
+    }
   }
 
   // Check for a debug_link section
@@ -207,7 +227,9 @@ elf::elf locate_debug_executable(const string& filename) {
 
     search_paths.push_back(directory + "/" + link_name);
     search_paths.push_back(directory + "/.debug/" + link_name);
-    search_paths.push_back("/usr/lib/debug" + directory + "/" + link_name);
+    for (const string& dir : debug_dirs) {
+      search_paths.push_back(dir + directory + "/" + link_name);
+    }
   }
 
   // Clear the loaded file so if we have to return it, it won't be valid()
@@ -218,7 +240,8 @@ elf::elf locate_debug_executable(const string& filename) {
     fd = open(path.c_str(), O_RDONLY);
     if (fd >= 0) {
       f = elf::elf(elf::create_mmap_loader(fd));
-      if (f.get_section(".debug_info").valid()) {
+      if (has_debug_info(f)) {
+        DEBUG("found debug information for " << filename << " in " << path);
         break;
       }
       f = elf::elf();
@@ -228,10 +251,17 @@ elf::elf locate_debug_executable(const string& filename) {
   return f;
 }
 
-unordered_map<string, uintptr_t> get_loaded_files() {
+/**
+ * Reads the executable mappings of absolute paths out of a /proc/<pid>/maps
+ * file. Returns the load base of each file, and adds every mapping to the
+ * mappings table.
+ */
+unordered_map<string, uintptr_t> get_loaded_files(
+    const string& maps_path,
+    std::map<interval, mapped_file, cmpByInterval>* mappings) {
   unordered_map<string, uintptr_t> result;
 
-  ifstream maps("/proc/self/maps");
+  ifstream maps(maps_path);
   while (maps.good() && !maps.eof()) {
     uintptr_t base, limit;
     char perms[5];
@@ -273,7 +303,9 @@ unordered_map<string, uintptr_t> get_loaded_files() {
 
     // If this is an executable mapping of an absolute path, include it
     if (perms[2] == 'x' && path[0] == '/') {
-      result[path] = base;
+      uintptr_t load_base = base - offset;
+      result[path] = load_base;
+      mappings->emplace(interval(base, limit), mapped_file{path, load_base});
     }
   }
 
@@ -332,14 +364,15 @@ bool in_scope(const string& name, const unordered_set<string>& scope) {
   return false;
 }
 
-void memory_map::build(const unordered_set<string>& source_scope,
-                       std::map<interval, string, cmpByInterval>* sym_table,
-                       char* arg) {
+void memory_map::build(const unordered_set<string>& source_scope, char* arg,
+                       const string& maps_path) {
   size_t in_scope_count = 0;
-  for (const auto& f : get_loaded_files()) {
+  begin_segment();
+  for (const auto& f : get_loaded_files(maps_path, &_mappings)) {
     // if (in_scope(f.first, binary_scope)) {
+    _loaded.emplace(f.first, f.second);
     try {
-      if (process_file(f.first, f.second, source_scope, sym_table)) {
+      if (process_file(f.first, f.second, source_scope)) {
         DEBUG("Including lines from executable " << f.first);
         in_scope_count++;
       } else {
@@ -362,6 +395,33 @@ void memory_map::build(const unordered_set<string>& source_scope,
                         "debug information was not found for any in-scope "
                         "executables or libraries");
   }
+  end_segment();
+}
+
+bool memory_map::add_file(const mapped_file& f, const interval& range,
+                          const unordered_set<string>& source_scope) {
+  // replaces any old mapping at the same address, eg. after a dlclose
+  _mappings.erase(range);
+  _mappings.emplace(range, f);
+
+  if (!_loaded.emplace(f.path, f.load_base).second) {
+    DEBUG("already processed " << f.path << " at " << ptr_fmt(f.load_base));
+    return false;
+  }
+
+  begin_segment();
+  try {
+    if (process_file(f.path, f.load_base, source_scope)) {
+      DEBUG("Including lines from newly mapped executable " << f.path);
+      end_segment();
+      return true;
+    }
+    DEBUG("Unable to locate debug information for " << f.path);
+  } catch (const system_error& e) {
+    DEBUG_CRITICAL("Processing file \"" << f.path << "\" failed: " << e.what());
+  }
+  _segment.reset();
+  return false;
 }
 
 ::dwarf::value find_attribute(const ::dwarf::die& d, ::dwarf::DW_AT attr) {
@@ -398,33 +458,140 @@ void memory_map::build(const unordered_set<string>& source_scope,
   return {};
 }
 
+const packed_range* line_index::find(uintptr_t addr) const {
+  auto next = std::upper_bound(
+      ranges.begin(), ranges.end(), addr,
+      [](uintptr_t a, const packed_range& r) { return a < r.base; });
+  if (next == ranges.begin()) {
+    return nullptr;
+  }
+  --next;
+  if (addr - next->base >= next->len) {
+    return nullptr;
+  }
+  return &*next;
+}
+
+void line_index::finalize() {
+  std::stable_sort(ranges.begin(), ranges.end(),
+                   [](const packed_range& a, const packed_range& b) {
+                     return a.base < b.base;
+                   });
+  ranges.erase(std::unique(ranges.begin(), ranges.end(),
+                           [](const packed_range& a, const packed_range& b) {
+                             return a.base == b.base;
+                           }),
+               ranges.end());
+  ranges.shrink_to_fit();
+  lines.shrink_to_fit();
+
+  // sort the inlined calls too, keeping parents before children that start at
+  // the same address so lookups find the innermost call, and then point the
+  // parent indices at the new positions
+  vector<uint32_t> order(inlines.size());
+  for (uint32_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+    return inlines[a].low < inlines[b].low;
+  });
+  vector<uint32_t> new_pos(order.size());
+  vector<packed_inline> sorted;
+  sorted.reserve(order.size());
+  for (uint32_t i = 0; i < order.size(); i++) {
+    new_pos[order[i]] = i;
+    sorted.push_back(inlines[order[i]]);
+  }
+  for (auto& inl : sorted) {
+    if (inl.parent != NO_INLINE_PARENT) {
+      inl.parent = new_pos[inl.parent];
+    }
+  }
+  inlines.swap(sorted);
+}
+
+const packed_inline* line_index::find_inline(uintptr_t addr) const {
+  auto next = std::upper_bound(
+      inlines.begin(), inlines.end(), addr,
+      [](uintptr_t a, const packed_inline& inl) { return a < inl.low; });
+  if (next == inlines.begin()) {
+    return nullptr;
+  }
+  // calls are nested, so if the closest call starting before addr doesn't
+  // contain it then the innermost one that does is one of its parents
+  const packed_inline* inl = &*(next - 1);
+  while (inl != nullptr && addr - inl->low >= inl->len) {
+    inl = parent_of(*inl);
+  }
+  return inl;
+}
+
+size_t line_index::memory_usage() const {
+  size_t bytes = lines.capacity() * sizeof(packed_line) +
+                 ranges.capacity() * sizeof(packed_range) +
+                 inlines.capacity() * sizeof(packed_inline) +
+                 file_names.capacity() * sizeof(string) +
+                 inline_names.capacity() * sizeof(string);
+  for (const auto& name : file_names) {
+    bytes += name.capacity();
+  }
+  for (const auto& name : inline_names) {
+    bytes += name.capacity();
+  }
+  return bytes;
+}
+
+void memory_map::begin_segment() {
+  _segment = std::make_shared<debug_segment>();
+  _file_ids.clear();
+  _inline_name_ids.clear();
+}
+
+void memory_map::end_segment() {
+  _segment->lines.finalize();
+  _segments.push_back(std::move(_segment));
+}
+
 void memory_map::add_range(const std::string& filename, size_t line_no,
                            interval range) {
-  shared_ptr<file> f = get_file(filename);
-  shared_ptr<line> l = f->get_line(line_no);
-  // Add the entry
-  _ranges.emplace(range, l);
+  uint32_t file_id = get_file_id(filename);
+  // consecutive ranges in a line table usually share a line, so only those
+  // are deduplicated; a full lookup table would cost more than it saves
+  line_index& table = _segment->lines;
+  if (table.lines.empty() || table.lines.back().file_id != file_id ||
+      table.lines.back().line != line_no) {
+    table.lines.push_back({file_id, static_cast<uint32_t>(line_no)});
+  }
+  table.ranges.push_back(
+      {range.get_base(),
+       static_cast<uint32_t>(range.get_limit() - range.get_base()),
+       static_cast<uint32_t>(table.lines.size() - 1)});
 }
 
-void memory_map::process_inlines(
-    const ::dwarf::die& d, const ::dwarf::line_table& table,
-    const unordered_set<string>& source_scope, uintptr_t load_address,
-    std::map<interval, string, cmpByInterval>& sym_table) {
+void memory_map::process_inlines(const ::dwarf::die& d,
+                                 const ::dwarf::line_table& table,
+                                 const unordered_set<string>& source_scope,
+                                 uintptr_t load_address, uint32_t parent_begin,
+                                 uint32_t parent_end) {
   if (!d.valid()) {
     return;
   }
 
+  if (d.tag == ::dwarf::DW_TAG::subprogram) {
+    // a nested function isn't inlined into the enclosing one
+    parent_begin = parent_end;
+  }
+
   try {
     if (d.tag == ::dwarf::DW_TAG::inlined_subroutine) {
-      ::dwarf::value origin =
-          find_attribute(d, ::dwarf::DW_AT::abstract_origin);
       string sym_name;
-
-      auto entry = origin.as_reference();
-      ::dwarf::value real_name = find_attribute(entry, ::dwarf::DW_AT::name);
-
-      if (real_name.valid()) {
-        sym_name = real_name.as_string();
+      ::dwarf::value name_val =
+          find_attribute(d, ::dwarf::DW_AT::linkage_name);
+      if (!name_val.valid()) {
+        name_val = find_attribute(d, ::dwarf::DW_AT::name);
+      }
+      if (name_val.valid()) {
+        sym_name = name_val.as_string();
       }
 
       string decl_file;
@@ -436,40 +603,8 @@ void memory_map::process_inlines(
 
       string call_file;
       if (d.has(::dwarf::DW_AT::call_file) && table.valid()) {
-        call_file =
-            table.get_file(d[::dwarf::DW_AT::call_file].as_uconstant())->path;
-
-        if (!call_file.empty()) {
-          if (d.has(::dwarf::DW_AT::low_pc) && d.has(::dwarf::DW_AT::high_pc)) {
-            ::dwarf::value low_pc_val =
-                find_attribute(d, ::dwarf::DW_AT::low_pc);
-            ::dwarf::value high_pc_val =
-                find_attribute(d, ::dwarf::DW_AT::high_pc);
-
-            if (low_pc_val.valid() && high_pc_val.valid()) {
-              uint64_t low_pc = 0;
-              uint64_t high_pc = 0;
-
-              if (low_pc_val.get_type() == ::dwarf::value::type::address) {
-                low_pc = low_pc_val.as_address();
-              } else if (low_pc_val.get_type() ==
-                         ::dwarf::value::type::uconstant) {
-                low_pc = low_pc_val.as_uconstant();
-              } else if (low_pc_val.get_type() ==
-                         ::dwarf::value::type::sconstant) {
-                low_pc = low_pc_val.as_sconstant();
-              }
-
-              high_pc = high_pc_val.as_sconstant();
-              // TODO(builinh): find class of inline functions
-              if (high_pc != 0 && low_pc != 0) {
-                sym_table.insert(pair<interval, string>(
-                    (interval(low_pc, low_pc + high_pc) + load_address),
-                    sym_name));
-              }
-            }
-          }
-        }
+        call_file = canonicalize_path(
+            table.get_file(d[::dwarf::DW_AT::call_file].as_uconstant())->path);
       }
 
       size_t call_line = 0;
@@ -477,69 +612,142 @@ void memory_map::process_inlines(
         call_line = d[::dwarf::DW_AT::call_line].as_uconstant();
       }
 
-      // If the call location is in scope but the function is not, add an
-      // entry
-      if (!decl_file.empty() && !call_file.empty()) {
-        if (!in_scope(decl_file, source_scope) &&
-            in_scope(call_file, source_scope)) {
-          // Does this inline have separate ranges?
-          ::dwarf::value ranges_val = find_attribute(d, ::dwarf::DW_AT::ranges);
-          if (ranges_val.valid()) {
-            // Add each range
-            for (auto r : ranges_val.as_rangelist()) {
-              // NEED MORE TESTING
-              add_range(call_file, call_line,
-                        interval(r.low, r.low + r.high) + load_address);
-              sym_table.insert(pair<interval, string>(
-                  (interval(r.low, r.low + r.high) + load_address), sym_name));
-            }
-          } else {
-            // Must just be one range. Add it
-            ::dwarf::value low_pc_val =
-                find_attribute(d, ::dwarf::DW_AT::low_pc);
-            ::dwarf::value high_pc_val =
-                find_attribute(d, ::dwarf::DW_AT::high_pc);
-
-            if (low_pc_val.valid() && high_pc_val.valid()) {
-              uint64_t low_pc = 0, high_pc = 0;
-
-              if (low_pc_val.get_type() == ::dwarf::value::type::address) {
-                low_pc = low_pc_val.as_address();
-              } else if (low_pc_val.get_type() ==
-                         ::dwarf::value::type::uconstant) {
-                low_pc = low_pc_val.as_uconstant();
-              } else if (low_pc_val.get_type() ==
-                         ::dwarf::value::type::sconstant) {
-                low_pc = low_pc_val.as_sconstant();
-              }
-
-              if (high_pc_val.get_type() == ::dwarf::value::type::address) {
-                high_pc = high_pc_val.as_address();
-              } else if (high_pc_val.get_type() ==
-                         ::dwarf::value::type::uconstant) {
-                high_pc = high_pc_val.as_uconstant();
-              } else if (high_pc_val.get_type() ==
-                         ::dwarf::value::type::sconstant) {
-                high_pc = high_pc_val.as_sconstant();
-              }
-              // NEED MORE TESTING
-
-              add_range(call_file, call_line,
-                        interval(low_pc, low_pc + high_pc) + load_address);
-              sym_table.insert(pair<interval, string>(
-                  (interval(low_pc, low_pc + high_pc) + load_address),
-                  sym_name));
-            }
+      // If the call location is in scope but the function is not, attribute
+      // the inlined code to the call site
+      bool attribute_to_call =
+          !decl_file.empty() && !call_file.empty() &&
+          !in_scope(decl_file, source_scope) && in_scope(call_file, source_scope);
+
+      uint32_t name_id = get_inline_name_id(sym_name);
+      uint32_t call_file_id = get_file_id(call_file);
+      uint32_t first = _segment->lines.inlines.size();
+      // die_pc_range handles both a low_pc/high_pc pair (where high_pc may be
+      // an address or an offset from low_pc) and a ranges list
+      for (const auto& r : ::dwarf::die_pc_range(d)) {
+        if (r.high <= r.low) {
+          continue;
+        }
+        interval range = interval(r.low, r.high) + load_address;
+
+        // a parent with several ranges only contains the child in one of them
+        uint32_t parent = NO_INLINE_PARENT;
+        for (uint32_t i = parent_begin; i < parent_end; i++) {
+          const packed_inline& p = _segment->lines.inlines[i];
+          if (p.low <= range.get_base() && range.get_base() - p.low < p.len) {
+            parent = i;
+            break;
           }
         }
+        _segment->lines.inlines.push_back(
+            {range.get_base(),
+             static_cast<uint32_t>(range.get_limit() - range.get_base()),
+             parent, name_id, call_file_id, static_cast<uint32_t>(call_line)});
+
+        if (attribute_to_call) {
+          add_range(call_file, call_line, range);
+        }
       }
+      parent_begin = first;
+      parent_end = _segment->lines.inlines.size();
     }
   } catch (::dwarf::format_error& e) {
     DEBUG("ignoring dwarf format error " << e.what());
   }
 
   for (const auto& child : d) {
-    process_inlines(child, table, source_scope, load_address, sym_table);
+    process_inlines(child, table, source_scope, load_address, parent_begin,
+                    parent_end);
+  }
+}
+
+/*
+ * The size in bytes of an object of the given type, or 0 if it can't be
+ * worked out. Qualifiers and typedefs are followed to the underlying type, and
+ * arrays are the size of their elements times the length of each dimension.
+ */
+static uint64_t type_size(const ::dwarf::die& type, size_t depth = 0) {
+  if (!type.valid() || depth > DWARF_TYPE_MAX_DEPTH) {
+    return 0;
+  }
+  if (type.has(::dwarf::DW_AT::byte_size)) {
+    return type[::dwarf::DW_AT::byte_size].as_uconstant();
+  }
+  if (!type.has(::dwarf::DW_AT::type)) {
+    return 0;
+  }
+  uint64_t size =
+      type_size(type[::dwarf::DW_AT::type].as_reference(), depth + 1);
+  if (type.tag == ::dwarf::DW_TAG::array_type) {
+    for (const auto& dim : type) {
+      if (dim.tag != ::dwarf::DW_TAG::subrange_type) {
+        continue;
+      }
+      if (dim.has(::dwarf::DW_AT::count)) {
+        size *= dim[::dwarf::DW_AT::count].as_uconstant();
+      } else if (dim.has(::dwarf::DW_AT::upper_bound)) {
+        size *= dim[::dwarf::DW_AT::upper_bound].as_uconstant() + 1;
+      } else {
+        // flexible array, so the real length isn't known
+        return 0;
+      }
+    }
+  }
+  return size;
+}
+
+void memory_map::process_variables(const ::dwarf::die& d,
+                                   uintptr_t load_address) {
+  if (!d.valid()) {
+    return;
+  }
+
+  try {
+    if (d.tag == ::dwarf::DW_TAG::variable &&
+        d.has(::dwarf::DW_AT::location) &&
+        d[::dwarf::DW_AT::location].get_type() ==
+            ::dwarf::value::type::exprloc) {
+      // a fixed address is just DW_OP_addr, which needs no registers or
+      // memory to evaluate
+      ::dwarf::expr_result location =
+          d[::dwarf::DW_AT::location].as_exprloc().evaluate(
+              &::dwarf::no_expr_context);
+      if (location.location_type == ::dwarf::expr_result::type::address &&
+          location.value != 0) {
+        string name;
+        ::dwarf::value name_val =
+            find_attribute(d, ::dwarf::DW_AT::linkage_name);
+        if (!name_val.valid()) {
+          name_val = find_attribute(d, ::dwarf::DW_AT::name);
+        }
+        if (name_val.valid()) {
+          name = name_val.as_string();
+        }
+
+        uint64_t size = 0;
+        ::dwarf::value type_val = find_attribute(d, ::dwarf::DW_AT::type);
+        if (type_val.valid()) {
+          size = type_size(type_val.as_reference());
+        }
+        if (!name.empty()) {
+          // at least attribute accesses to the variable's first byte
+          uint64_t end = location.value + std::max<uint64_t>(size, 1);
+          _segment->variables.emplace(
+              interval(location.value, end) + load_address, name);
+        }
+      }
+    }
+  } catch (std::runtime_error& e) {
+    // covers both format errors and expressions that need a running process
+    DEBUG("ignoring variable location error " << e.what());
+  }
+
+  if (d.tag == ::dwarf::DW_TAG::subprogram ||
+      d.tag == ::dwarf::DW_TAG::inlined_subroutine ||
+      d.tag == ::dwarf::DW_TAG::lexical_block) {
+    return;
+  }
+  for (const auto& child : d) {
+    process_variables(child, load_address);
   }
 }
 
@@ -574,31 +782,13 @@ void dump_tree(const ::dwarf::die& d,
 
       if (!decl_file.empty()) {
         if (in_scope(decl_file, source_scope)) {
-          if (d.has(::dwarf::DW_AT::low_pc) && d.has(::dwarf::DW_AT::high_pc)) {
-            ::dwarf::value low_pc_val =
-                find_attribute(d, ::dwarf::DW_AT::low_pc);
-            ::dwarf::value high_pc_val =
-                find_attribute(d, ::dwarf::DW_AT::high_pc);
-
-            if (low_pc_val.valid() && high_pc_val.valid()) {
-              uint64_t low_pc = 0;
-              uint64_t high_pc = 0;
-
-              if (low_pc_val.get_type() == ::dwarf::value::type::address) {
-                low_pc = low_pc_val.as_address();
-              } else if (low_pc_val.get_type() ==
-                         ::dwarf::value::type::uconstant) {
-                low_pc = low_pc_val.as_uconstant();
-              } else if (low_pc_val.get_type() ==
-                         ::dwarf::value::type::sconstant) {
-                low_pc = low_pc_val.as_sconstant();
-              }
-
-              high_pc = high_pc_val.as_sconstant();
-              if (high_pc != 0 && low_pc != 0) {
-                sym_table->insert(pair<interval, string>(
-                    (interval(low_pc, low_pc + high_pc) + load_address), name));
-              }
+          // high_pc may be either an address or an offset from low_pc, and
+          // functions split into hot and cold parts have a ranges list
+          // instead, all of which die_pc_range handles
+          for (const auto& r : ::dwarf::die_pc_range(d)) {
+            if (r.low != 0 && r.high > r.low) {
+              sym_table->insert(pair<interval, string>(
+                  (interval(r.low, r.high) + load_address), name));
             }
           }
         }
@@ -613,10 +803,8 @@ void dump_tree(const ::dwarf::die& d,
   }
 }
 
-bool memory_map::process_file(
-    const string& name, uintptr_t load_address,
-    const unordered_set<string>& source_scope,
-    std::map<interval, string, cmpByInterval>* sym_table) {
+bool memory_map::process_file(const string& name, uintptr_t load_address,
+                              const unordered_set<string>& source_scope) {
   elf::elf f = locate_debug_executable(name);
   // If a debug version of the file could not be located, return false
   if (!f.valid()) {
@@ -638,13 +826,14 @@ bool memory_map::process_file(
   }
 
   // Read the ::dwarf information from the chosen file
-  ::dwarf::dwarf d(::dwarf::elf::create_loader(f));
+  ::dwarf::dwarf d(create_debug_loader(f));
 
   // Walk through the compilation units (source files) in the executable
   for (const auto& unit : d.compilation_units()) {
     auto& lineTable = unit.get_line_table();
     // dump_tree(unit.root());
-    dump_tree(unit.root(), sym_table, load_address, lineTable, source_scope, 0);
+    dump_tree(unit.root(), &_segment->symbols, load_address, lineTable,
+              source_scope, 0);
     int fileIndex = 0;
     bool needProcess = false;
     // check if files using by lineTable are in source_scope
@@ -687,7 +876,8 @@ bool memory_map::process_file(
           }
         }
         process_inlines(unit.root(), unit.get_line_table(), source_scope,
-                        load_address, *sym_table);
+                        load_address);
+        process_variables(unit.root(), load_address);
 
       } catch (::dwarf::format_error& e) {
         DEBUG_CRITICAL("ignoring dwarf format error when reading line table: "
@@ -712,12 +902,15 @@ shared_ptr<line> memory_map::find_line(const string& name) {
   size_t line_no;
   stringstream(line_no_str) >> line_no;
 
-  for (const auto& f : files()) {
-    string::size_type last_pos = f.first.rfind(filename);
-    if (last_pos != string::npos &&
-        last_pos + filename.size() == f.first.size()) {
-      if (f.second->has_line(line_no)) {
-        return f.second->get_line(line_no);
+  for (const auto& segment : _segments) {
+    for (const auto& l : segment->lines.lines) {
+      if (l.line != line_no) {
+        continue;
+      }
+      const string& f = segment->lines.file_name_of(l);
+      string::size_type last_pos = f.rfind(filename);
+      if (last_pos != string::npos && last_pos + filename.size() == f.size()) {
+        return std::make_shared<line>(std::make_shared<file>(f), line_no);
       }
     }
   }
@@ -726,9 +919,13 @@ shared_ptr<line> memory_map::find_line(const string& name) {
 }
 
 shared_ptr<line> memory_map::find_line(uintptr_t addr) {
-  auto iter = _ranges.find(interval(addr));
-  if (iter != _ranges.end()) {
-    return iter->second;
+  for (const auto& segment : _segments) {
+    const packed_range* range = segment->lines.find(addr);
+    if (range != nullptr) {
+      const packed_line& l = segment->lines.line_of(*range);
+      return std::make_shared<line>(
+          std::make_shared<file>(segment->lines.file_name_of(l)), l.line);
+    }
   }
   DEBUG_CRITICAL("cannot find lines");
   return shared_ptr<line>();
@@ -9,17 +9,18 @@
 #ifndef COLLECTOR_INSPECT
 #define COLLECTOR_INSPECT
 
-#include <atomic>
 #include <cstdint>
 #include <ios>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <new>
+#include <set>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include <libelfin/dwarf/dwarf++.hh>
 #include <libelfin/elf/elf++.hh>
@@ -39,24 +40,19 @@ class line;
 class memory_map;
 
 /**
- * Handle for a single line in the program's memory map
+ * Handle for a single line in the program's memory map. Lines are stored
+ * packed in a line_index, so these are only created when looked up.
  */
 class line {
  public:
-  line(std::weak_ptr<file> f, size_t l)
-      : _file(std::move(std::move(f))), _line(l) {}
+  line(std::shared_ptr<file> f, size_t l) : _file(std::move(f)), _line(l) {}
 
-  inline std::shared_ptr<file> get_file() const { return _file.lock(); }
+  inline std::shared_ptr<file> get_file() const { return _file; }
   inline size_t get_line() const { return _line; }
-  inline void add_sample() { _samples.fetch_add(1, std::memory_order_relaxed); }
-  inline size_t get_samples() const {
-    return _samples.load(std::memory_order_relaxed);
-  }
 
  private:
-  std::weak_ptr<file> _file;
+  std::shared_ptr<file> _file;
   size_t _line;
-  std::atomic<size_t> _samples = ATOMIC_VAR_INIT(0);
 };
 
 class interval {
@@ -104,40 +100,111 @@ struct cmpByInterval {
   }
 };
 
+/**
+ * An executable file mapping in the subject's address space
+ */
+struct mapped_file {
+  std::string path;
+  // where the start of the file would be mapped, ie. the mapping's start minus
+  // its offset in the file
+  uintptr_t load_base;
+};
+
 /**
  * Handle for a file in the program's memory map
  */
-class file : public std::enable_shared_from_this<file> {
+class file {
  public:
   explicit file(std::string name) : _name(std::move(name)) {}
-  file(const file&) = default;
-  file& operator=(const file&) = default;
 
   inline const std::string& get_name() const { return _name; }
 
-  inline const std::map<size_t, std::shared_ptr<line>> lines() const {
-    return _lines;
-  }
-
  private:
-  friend class memory_map;
+  std::string _name;
+};
 
-  inline std::shared_ptr<line> get_line(size_t index) {
-    auto iter = _lines.find(index);
-    if (iter != _lines.end()) {
-      return iter->second;
-    }
-    std::shared_ptr<line> l(new line(shared_from_this(), index));
-    _lines.emplace(index, l);
-    return l;
-  }
+/**
+ * A source line, as an index into line_index::file_names
+ */
+struct packed_line {
+  uint32_t file_id;
+  uint32_t line;
+};
+
+/**
+ * An address range that maps to a single source line, as an index into
+ * line_index::lines
+ */
+struct packed_range {
+  uint64_t base;
+  uint32_t len;
+  uint32_t line_idx;
+};
+
+enum : uint32_t { NO_INLINE_PARENT = UINT32_MAX };
 
-  inline bool has_line(size_t index) {
-    return _lines.find(index) != _lines.end();
+/**
+ * A range of addresses that an inlined call covers
+ */
+struct packed_inline {
+  uint64_t low;
+  uint32_t len;
+  // index of the inlined call this one is nested in, or NO_INLINE_PARENT if
+  // it was inlined directly into a real function
+  uint32_t parent;
+  // index into line_index::inline_names
+  uint32_t name;
+  // where the call was made from, file_id indexes line_index::file_names
+  uint32_t call_file_id;
+  uint32_t call_line;
+};
+
+/**
+ * Compact table from address ranges to source lines. Big binaries have
+ * millions of ranges, so everything is kept in flat arrays of small structs
+ * rather than maps of pointers.
+ */
+struct line_index {
+  std::vector<std::string> file_names;
+  std::vector<packed_line> lines;
+  // sorted by base once finalized
+  std::vector<packed_range> ranges;
+  // the tree of inlined calls, sorted by low once finalized
+  std::vector<packed_inline> inlines;
+  std::vector<std::string> inline_names;
+
+  /// The range containing addr, or nullptr if there is none
+  const packed_range* find(uintptr_t addr) const;
+  /// The innermost inlined call containing addr, or nullptr if addr isn't in
+  /// an inlined call. Its callers can be found with parent_of.
+  const packed_inline* find_inline(uintptr_t addr) const;
+  /// Sorts the ranges, dropping any that start at the same address as an
+  /// earlier one, and sorts the inlined calls
+  void finalize();
+  /// Approximate number of bytes used by the tables
+  size_t memory_usage() const;
+
+  inline const packed_line& line_of(const packed_range& range) const {
+    return lines[range.line_idx];
+  }
+  inline const std::string& file_name_of(const packed_line& l) const {
+    return file_names[l.file_id];
+  }
+  inline const packed_inline* parent_of(const packed_inline& inl) const {
+    return inl.parent == NO_INLINE_PARENT ? nullptr : &inlines[inl.parent];
   }
+};
 
-  std::string _name;
-  std::map<size_t, std::shared_ptr<line>> _lines;
+/**
+ * What was read from the debug information of one batch of files: every file
+ * found by memory_map::build, or a single file added after it
+ */
+struct debug_segment {
+  // function names by address range
+  std::map<interval, string, cmpByInterval> symbols;
+  line_index lines;
+  // address ranges of global variables, by linkage name if there is one
+  std::map<interval, string, cmpByInterval> variables;
 };
 
 /**
@@ -146,19 +213,28 @@ class file : public std::enable_shared_from_this<file> {
  */
 class memory_map {
  public:
-  inline const std::map<std::string, std::shared_ptr<file>>& files() const {
-    return _files;
+  /// One segment for the files read by build, then one for each file added
+  /// after it. Finished segments never change, so they're shared with the
+  /// symbol indexes instead of copied.
+  inline const std::vector<std::shared_ptr<const debug_segment>>& segments()
+      const {
+    return _segments;
   }
-  inline const std::map<interval, std::shared_ptr<line>, cmpByInterval>&
-  ranges() const {
-    return _ranges;
+  inline const std::map<interval, mapped_file, cmpByInterval>& mappings()
+      const {
+    return _mappings;
   }
 
   /// Build a map from addresses to source lines by examining binaries that
   /// match the provided scope patterns, adding only source files matching the
-  /// source scope patterns.
-  void build(const std::unordered_set<std::string>& source_scope,
-             std::map<interval, string, cmpByInterval>* sym_table, char* arg);
+  /// source scope patterns. The loaded binaries are read from maps_path.
+  void build(const std::unordered_set<std::string>& source_scope, char* arg,
+             const std::string& maps_path = "/proc/self/maps");
+
+  /// Add a file that was mapped after the map was built, such as a library
+  /// loaded through dlopen. Returns true if new debug information was added.
+  bool add_file(const mapped_file& f, const interval& range,
+                const std::unordered_set<std::string>& source_scope);
 
   std::shared_ptr<line> find_line(const std::string& name);
   std::shared_ptr<line> find_line(uintptr_t addr);
@@ -169,36 +245,65 @@ class memory_map {
   memory_map& operator=(const memory_map&) = delete;
 
  private:
-  memory_map()
-      : _files(std::map<std::string, std::shared_ptr<file>>()),
-        _ranges(std::map<interval, std::shared_ptr<line>, cmpByInterval>()) {}
+  memory_map() = default;
 
-  inline std::shared_ptr<file> get_file(const std::string& filename) {
-    auto iter = _files.find(filename);
-    if (iter != _files.end()) {
+  inline uint32_t get_file_id(const std::string& filename) {
+    auto iter = _file_ids.find(filename);
+    if (iter != _file_ids.end()) {
       return iter->second;
     }
-    std::shared_ptr<file> f(new file(filename));
-    _files.emplace(filename, f);
-    return f;
+    uint32_t id = _segment->lines.file_names.size();
+    _segment->lines.file_names.push_back(filename);
+    _file_ids.emplace(filename, id);
+    return id;
   }
 
+  inline uint32_t get_inline_name_id(const std::string& name) {
+    auto iter = _inline_name_ids.find(name);
+    if (iter != _inline_name_ids.end()) {
+      return iter->second;
+    }
+    uint32_t id = _segment->lines.inline_names.size();
+    _segment->lines.inline_names.push_back(name);
+    _inline_name_ids.emplace(name, id);
+    return id;
+  }
+
+  /// Start a new segment, which the files processed from now on add to
+  void begin_segment();
+  /// Finalize the current segment's line table and share the segment
+  void end_segment();
+
   void add_range(const std::string& filename, size_t line_no, interval range);
 
   /// Find a debug version of provided file and add all of its in-scope lines to
   /// the map
   bool process_file(const std::string& name, uintptr_t load_address,
-                    const std::unordered_set<std::string>& source_scope,
-                    std::map<interval, string, cmpByInterval>* sym_table);
+                    const std::unordered_set<std::string>& source_scope);
 
-  /// Add entries for all inlined calls
+  /// Add every inlined call under d to the inline tree, nested in the calls
+  /// between parent_begin and parent_end (the ranges of the enclosing call)
   void process_inlines(const ::dwarf::die& d, const ::dwarf::line_table& table,
                        const std::unordered_set<std::string>& source_scope,
                        uintptr_t load_address,
-                       std::map<interval, string, cmpByInterval>& sym_table);
-
-  std::map<std::string, std::shared_ptr<file>> _files;
-  std::map<interval, std::shared_ptr<line>, cmpByInterval> _ranges;
+                       uint32_t parent_begin = NO_INLINE_PARENT,
+                       uint32_t parent_end = NO_INLINE_PARENT);
+
+  /// Add every variable under d that lives at a fixed address (globals and
+  /// class/namespace statics) to the variable map. Function bodies are skipped
+  /// since their variables are nearly all on the stack or in registers.
+  void process_variables(const ::dwarf::die& d, uintptr_t load_address);
+
+  // the segment being filled, only set from begin_segment until end_segment
+  std::shared_ptr<debug_segment> _segment;
+  std::vector<std::shared_ptr<const debug_segment>> _segments;
+  // ids in _segment's line table, so they're reset with each new segment
+  std::unordered_map<std::string, uint32_t> _file_ids;
+  std::unordered_map<std::string, uint32_t> _inline_name_ids;
+  std::map<interval, mapped_file, cmpByInterval> _mappings;
+  // every (path, load base) that has been processed, so files that are mapped
+  // more than once aren't read again
+  std::set<std::pair<std::string, uintptr_t>> _loaded;
 };
 
 void dump_tree(
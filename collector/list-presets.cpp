@@ -5,9 +5,6 @@
 
 #include "debug.hpp"
 #include "find_events.hpp"
-#include "perf_sampler.hpp"
-#include "rapl.hpp"
-#include "wattsup.hpp"
 
 namespace alex {
 
@@ -22,46 +19,6 @@ using std::cerr;
 using std::cout;
 using std::endl;
 
-bool event_is_available(string event_name) {
-  pfm_initialize();
-  perf_event_attr attr{};
-  memset(&attr, 0, sizeof(perf_event_attr));
-  int pfm_result =
-      setup_pfm_os_event(&attr, const_cast<char *>(event_name.c_str()));
-  if (pfm_result != PFM_SUCCESS) {
-    DEBUG_CRITICAL("pfm encoding error: " << pfm_strerror(pfm_result));
-    return false;
-  }
-  return true;
-}
-
-bool preset_is_available(string preset) {
-  if (preset == "wattsup") {
-    return wu_setup() != -1;
-  } else if (preset == "rapl") {
-    vector<string> powerzones = find_in_dir(ENERGY_ROOT, "intel-rapl:");
-    return powerzones.size() != 0;
-  } else {
-    auto presets = build_preset(preset);
-    for (auto entry : presets) {
-      auto low_level_events = entry.second;
-      bool has_low_level_event = false;
-      for (string event : low_level_events) {
-        if (event_is_available(event)) {
-          has_low_level_event = true;
-          break;
-        }
-      }
-
-      if (!has_low_level_event) {
-        return false;
-      }
-    }
-
-    return true;
-  }
-}
-
 }  // namespace alex
 
 using namespace alex;
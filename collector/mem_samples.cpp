@@ -0,0 +1,198 @@
+#include <linux/perf_event.h>
+#include <perfmon/perf_event.h>
+#include <perfmon/pfmlib.h>
+#include <perfmon/pfmlib_perf_event.h>
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "const.hpp"
+#include "debug.hpp"
+#include "find_events.hpp"
+#include "mem_samples.hpp"
+#include "perf_sampler.hpp"
+#include "util.hpp"
+
+namespace alex {
+
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+/*
+ * A mapping in a sampled process's address space and the kind of data it
+ * holds.
+ */
+struct data_region {
+  uint64_t start;
+  uint64_t end;
+  MemorySample_Region region;
+};
+
+/*
+ * The address space layout of a sampled process, reread when a sample's
+ * address isn't in any of the known regions.
+ */
+struct data_map {
+  // sorted by start
+  vector<data_region> regions;
+  size_t last_read_ts = 0;
+};
+
+map<pid_t, data_map> data_maps;
+
+int open_memory_sampler(pid_t target) {
+  for (const auto &entry : build_preset("memory")) {
+    for (const auto &event : entry.second) {
+      perf_event_attr attr{};
+      memset(&attr, 0, sizeof(perf_event_attr));
+      int pfm_result =
+          setup_pfm_os_event(&attr, const_cast<char *>(event.c_str()));
+      if (pfm_result != PFM_SUCCESS) {
+        DEBUG("can't encode memory event " << event << ": "
+                                           << pfm_strerror(pfm_result));
+        continue;
+      }
+      attr.sample_type = MEMORY_SAMPLE_TYPE;
+      attr.sample_period = MEMORY_SAMPLE_PERIOD;
+      attr.sample_id_all = SAMPLE_ID_ALL;
+      attr.use_clockid = true;
+      attr.clockid = SAMPLE_CLOCK;
+
+      // the data address and source are only recorded by PEBS, which needs
+      // some amount of precision, so ask for as much as the CPU allows
+      for (attr.precise_ip = 2; attr.precise_ip > 0; attr.precise_ip--) {
+        int fd = perf_event_open(&attr, target, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd != -1) {
+          DEBUG("opened memory event " << event << " with precise_ip "
+                                       << attr.precise_ip << " as fd " << fd);
+          return fd;
+        }
+        if (errno != EINVAL && errno != EOPNOTSUPP) {
+          return -1;
+        }
+      }
+      DEBUG("can't sample memory event " << event << ": " << strerror(errno));
+    }
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+void decode_data_src(MemorySample *sample) {
+  perf_mem_data_src src{};
+  src.val = sample->data_src();
+
+  // nearest first, the first one set is where the load was resolved
+  static const pair<uint64_t, const char *> levels[] = {
+      {PERF_MEM_LVL_L1, "L1"},
+      {PERF_MEM_LVL_LFB, "LFB"},
+      {PERF_MEM_LVL_L2, "L2"},
+      {PERF_MEM_LVL_L3, "L3"},
+      {PERF_MEM_LVL_LOC_RAM, "RAM"},
+      {PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2, "remote RAM"},
+      {PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2, "remote cache"},
+      {PERF_MEM_LVL_IO, "I/O"},
+      {PERF_MEM_LVL_UNC, "uncached"}};
+  for (const auto &level : levels) {
+    if ((src.mem_lvl & level.first) != 0) {
+      sample->set_level(level.second);
+      break;
+    }
+  }
+  sample->set_hit((src.mem_lvl & PERF_MEM_LVL_HIT) != 0);
+  // a load that hit a line modified by another core is the sign of false
+  // sharing
+  sample->set_hitm((src.mem_snoop & PERF_MEM_SNOOP_HITM) != 0);
+}
+
+/*
+ * Reads the regions of pid's address space out of /proc/<pid>/maps. Mappings
+ * of the program's files hold its globals, and anonymous ones are mostly large
+ * allocations and thread stacks.
+ */
+static vector<data_region> read_data_regions(pid_t pid) {
+  vector<data_region> regions;
+  std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+  for (string line; getline(maps, line);) {
+    data_region r{};
+    int path_pos = 0;
+    // <start>-<end> <perms> <offset> <dev> <inode> [path]
+    if (sscanf(line.c_str(), "%" SCNx64 "-%" SCNx64 " %*s %*x %*x:%*x %*u %n",
+               &r.start, &r.end, &path_pos) < 2 ||
+        path_pos == 0) {
+      continue;
+    }
+    const char *path = line.c_str() + path_pos;
+    if (strcmp(path, "[heap]") == 0) {
+      r.region = MemorySample_Region_HEAP;
+    } else if (strncmp(path, "[stack", strlen("[stack")) == 0) {
+      r.region = MemorySample_Region_STACK;
+    } else if (path[0] == '/') {
+      r.region = MemorySample_Region_GLOBAL;
+    } else if (path[0] == '\0') {
+      r.region = MemorySample_Region_ANONYMOUS;
+    } else {
+      // the vdso and friends
+      continue;
+    }
+    regions.push_back(r);
+  }
+  return regions;
+}
+
+static const data_region *find_data_region(const data_map &dm,
+                                           uint64_t addr) {
+  auto next = std::upper_bound(
+      dm.regions.begin(), dm.regions.end(), addr,
+      [](uint64_t a, const data_region &r) { return a < r.start; });
+  if (next == dm.regions.begin() || addr >= (next - 1)->end) {
+    return nullptr;
+  }
+  return &*(next - 1);
+}
+
+void classify_memory_samples(Timeslice *timeslice, const symbol_index &syms) {
+  if (timeslice->memory_samples_size() == 0) {
+    return;
+  }
+  data_map &dm = data_maps[timeslice->pid()];
+  for (auto &sample : *timeslice->mutable_memory_samples()) {
+    uint64_t addr = sample.addr();
+    if (addr == 0) {
+      // the hardware couldn't tell where the load was from
+      continue;
+    }
+
+    const string *var = syms.find_variable(addr);
+    if (var != nullptr) {
+      sample.set_region(MemorySample_Region_GLOBAL);
+      sample.set_variable(demangle(*var));
+      continue;
+    }
+
+    const data_region *r = find_data_region(dm, addr);
+    if (r == nullptr &&
+        time_ms() - dm.last_read_ts >= DATA_MAP_REREAD_INTERVAL) {
+      DEBUG("no region for " << ptr_fmt(addr) << ", rereading maps of "
+                             << timeslice->pid());
+      dm.regions = read_data_regions(timeslice->pid());
+      dm.last_read_ts = time_ms();
+      r = find_data_region(dm, addr);
+    }
+    if (r != nullptr) {
+      sample.set_region(r->region);
+    }
+  }
+}
+
+}  // namespace alex
@@ -0,0 +1,34 @@
+#ifndef COLLECTOR_MEM_SAMPLES
+#define COLLECTOR_MEM_SAMPLES
+
+#include <sys/types.h>
+#include <cstdint>
+
+#include "protos/timeslice.pb.h"
+#include "symbols.hpp"
+
+namespace alex {
+
+/*
+ * Opens the memory sampler for target, a precise load event that records the
+ * data address, latency, and data source of one in every MEMORY_SAMPLE_PERIOD
+ * loads. It's opened outside the cpu clock's group, since only the counted
+ * events are read each timeslice, and starts disabled. Returns -1 with errno
+ * set if none of the memory preset's events could be opened.
+ */
+int open_memory_sampler(pid_t target);
+
+/*
+ * Fills in the sample's level, hit, and hitm from its raw data_src.
+ */
+void decode_data_src(MemorySample* sample);
+
+/*
+ * Works out the region, and the variable if it's a global, that each of the
+ * timeslice's memory samples loaded from.
+ */
+void classify_memory_samples(Timeslice* timeslice, const symbol_index& syms);
+
+}  // namespace alex
+
+#endif
@@ -0,0 +1,206 @@
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <perfmon/perf_event.h>
+#include <perfmon/pfmlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "debug.hpp"
+#include "membw.hpp"
+#include "perf_sampler.hpp"
+#include "topology.hpp"
+
+namespace alex {
+
+using std::deque;
+using std::ifstream;
+using std::map;
+using std::string;
+using std::vector;
+
+// one memory controller event counting on one socket
+struct imc_counter {
+  int fd;
+  int package;
+  bool write;
+  uint64_t last_value;
+};
+
+// a socket's traffic over an interval, in bytes
+struct membw_bytes {
+  uint64_t read = 0;
+  uint64_t write = 0;
+};
+
+// the traffic between two readings, by package
+struct membw_interval {
+  uint64_t start;
+  uint64_t end;
+  map<int, membw_bytes> bytes;
+};
+
+vector<imc_counter> imc_counters;
+
+// oldest first
+deque<membw_interval> membw_intervals;
+
+// the time of the previous reading, 0 before the first
+uint64_t last_membw_read = 0;
+
+/*
+ * The memory controller PMUs that have CAS count events, in name order.
+ */
+static vector<string> find_imc_pmus() {
+  vector<string> pmus;
+  DIR *dirp = opendir(PMU_ROOT);
+  if (dirp == nullptr) {
+    DEBUG("no PMUs in " PMU_ROOT);
+    return pmus;
+  }
+  struct dirent *dp;
+  while ((dp = readdir(dirp)) != nullptr) {
+    string name = dp->d_name;
+    if (name.compare(0, strlen(IMC_PMU_PREFIX), IMC_PMU_PREFIX) == 0 &&
+        ifstream(PMU_ROOT + name + "/events/" IMC_READ_EVENT).good()) {
+      pmus.push_back(name);
+    }
+  }
+  closedir(dirp);
+  std::sort(pmus.begin(), pmus.end());
+  return pmus;
+}
+
+static string imc_event(const string &pmu, const char *event) {
+  return pmu + "/" + event + "/";
+}
+
+void find_membw_events(map<string, vector<string>> *events) {
+  vector<string> reads, writes;
+  for (const auto &pmu : find_imc_pmus()) {
+    reads.push_back(imc_event(pmu, IMC_READ_EVENT));
+    writes.push_back(imc_event(pmu, IMC_WRITE_EVENT));
+  }
+  DEBUG("found " << reads.size() << " memory controllers");
+  if (!reads.empty()) {
+    // every controller is counted, unlike other presets' alternatives
+    (*events)["memoryReads"] = reads;
+    (*events)["memoryWrites"] = writes;
+  }
+}
+
+bool open_membw_counters() {
+  for (const auto &pmu : find_imc_pmus()) {
+    ifstream cpumask_file(PMU_ROOT + pmu + "/cpumask");
+    string cpumask;
+    getline(cpumask_file, cpumask);
+
+    for (const char *event : {IMC_READ_EVENT, IMC_WRITE_EVENT}) {
+      string name = imc_event(pmu, event);
+      perf_event_attr attr{};
+      memset(&attr, 0, sizeof(perf_event_attr));
+      if (setup_pfm_os_event(&attr, const_cast<char *>(name.c_str())) !=
+          PFM_SUCCESS) {
+        DEBUG_CRITICAL("can't encode memory controller event " << name);
+        continue;
+      }
+      attr.disabled = false;
+
+      for (int cpu : parse_cpu_list(cpumask)) {
+        int fd = perf_event_open(&attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd == -1) {
+          DEBUG_CRITICAL("can't open " << name << " on cpu " << cpu << ": "
+                                       << strerror(errno));
+          continue;
+        }
+        DEBUG("opened " << name << " on cpu " << cpu << " as fd " << fd);
+        imc_counters.push_back(
+            {fd, read_cpu_package(cpu), strcmp(event, IMC_WRITE_EVENT) == 0,
+             0});
+      }
+    }
+  }
+  return !imc_counters.empty();
+}
+
+void read_membw_counters(uint64_t time) {
+  map<int, membw_bytes> bytes;
+  for (auto &counter : imc_counters) {
+    uint64_t value;
+    if (read(counter.fd, &value, sizeof(value)) != sizeof(value)) {
+      DEBUG_CRITICAL("couldn't read memory controller fd " << counter.fd);
+      continue;
+    }
+    // the counters are free running, so take the difference rather than
+    // resetting them
+    uint64_t delta = (value - counter.last_value) * IMC_BYTES_PER_CAS;
+    counter.last_value = value;
+    membw_bytes &b = bytes[counter.package];
+    (counter.write ? b.write : b.read) += delta;
+  }
+
+  if (last_membw_read == 0) {
+    // the counters have been running since they were opened, so the first
+    // reading is only a baseline
+  } else if (time > last_membw_read) {
+    membw_intervals.push_back({last_membw_read, time, bytes});
+  } else if (!membw_intervals.empty()) {
+    for (const auto &entry : bytes) {
+      membw_bytes &b = membw_intervals.back().bytes[entry.first];
+      b.read += entry.second.read;
+      b.write += entry.second.write;
+    }
+  }
+  last_membw_read = std::max(last_membw_read, time);
+}
+
+void add_membw(Timeslice *timeslice, uint64_t start, uint64_t end) {
+  map<int, double> reads, writes;
+  for (const auto &interval : membw_intervals) {
+    uint64_t overlap_start = std::max(start, interval.start),
+             overlap_end = std::min(end, interval.end);
+    if (overlap_start >= overlap_end) {
+      continue;
+    }
+    double fraction = static_cast<double>(overlap_end - overlap_start) /
+                      (interval.end - interval.start);
+    for (const auto &entry : interval.bytes) {
+      reads[entry.first] += fraction * entry.second.read;
+      writes[entry.first] += fraction * entry.second.write;
+    }
+  }
+  for (const auto &entry : reads) {
+    MemoryBandwidth *bandwidth = timeslice->add_memory_bandwidth();
+    bandwidth->set_package(entry.first);
+    bandwidth->set_read_bytes(static_cast<uint64_t>(entry.second));
+    bandwidth->set_write_bytes(static_cast<uint64_t>(writes[entry.first]));
+  }
+}
+
+void trim_membw_intervals(uint64_t time) {
+  while (!membw_intervals.empty() && membw_intervals.front().end < time) {
+    membw_intervals.pop_front();
+  }
+}
+
+void close_membw_counters() {
+  for (const auto &counter : imc_counters) {
+    close(counter.fd);
+  }
+  imc_counters.clear();
+  membw_intervals.clear();
+}
+
+bool membw_available() {
+  bool available = open_membw_counters();
+  close_membw_counters();
+  return available;
+}
+
+}  // namespace alex
@@ -0,0 +1,72 @@
+#ifndef COLLECTOR_MEMBW
+#define COLLECTOR_MEMBW
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "protos/timeslice.pb.h"
+
+namespace alex {
+
+// the memory controller PMUs, one or more per socket (uncore_imc_0, ...)
+#define IMC_PMU_PREFIX "uncore_imc"
+// column address strobes, each of which moves one cache line
+#define IMC_READ_EVENT "cas_count_read"
+#define IMC_WRITE_EVENT "cas_count_write"
+
+enum : uint64_t {
+  IMC_BYTES_PER_CAS = 64,
+  MEMBW_HISTORY = 1000000000  // ns of intervals kept behind the newest sample,
+                              // so a thread that hasn't run for longer only
+                              // gets the traffic of the last of its time off
+};
+
+/*
+ * Adds the memory controllers' read and write events to a preset, as
+ * memoryReads and memoryWrites. Nothing is added if there are no memory
+ * controller PMUs, eg. on non-Intel CPUs.
+ */
+void find_membw_events(std::map<std::string, std::vector<std::string>>* events);
+
+/*
+ * Opens the memory controller events system-wide, on one cpu of each socket as
+ * given by the PMU's cpumask. Uncore events can't be counted per thread, so
+ * these are opened by the collector rather than the subject, and need
+ * perf_event_paranoid to be 0 or less (or CAP_PERFMON). Returns false if none
+ * could be opened.
+ */
+bool open_membw_counters();
+
+/*
+ * Reads the counters and records the traffic since the previous reading as an
+ * interval ending at time, which should be a sample's time so intervals line up
+ * with timeslices. Readings that arrive out of order are added to the latest
+ * interval instead.
+ */
+void read_membw_counters(uint64_t time);
+
+/*
+ * Adds each socket's traffic between start and end to the timeslice, prorating
+ * the intervals that only partly overlap it.
+ */
+void add_membw(Timeslice* timeslice, uint64_t start, uint64_t end);
+
+/*
+ * Drops the intervals that end before time, once no timeslice can start before
+ * then.
+ */
+void trim_membw_intervals(uint64_t time);
+
+void close_membw_counters();
+
+/*
+ * Whether any of the memory controller events can be opened, by opening and
+ * closing them.
+ */
+bool membw_available();
+
+}  // namespace alex
+
+#endif
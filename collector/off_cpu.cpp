@@ -0,0 +1,39 @@
+#include <linux/perf_event.h>
+#include <linux/version.h>
+#include <perfmon/perf_event.h>
+#include <cerrno>
+#include <cstring>
+
+#include "const.hpp"
+#include "debug.hpp"
+#include "off_cpu.hpp"
+#include "shared.hpp"
+
+namespace alex {
+
+int open_off_cpu_sampler(pid_t target) {
+  perf_event_attr attr{};
+  memset(&attr, 0, sizeof(perf_event_attr));
+  attr.size = sizeof(perf_event_attr);
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+  attr.disabled = true;
+  // every switch, since each one starts a separate interval
+  attr.sample_period = 1;
+  attr.sample_type = SAMPLE_ID_ALL ? SAMPLE_TYPE_COMBINED : SAMPLE_TYPE;
+  attr.sample_id_all = SAMPLE_ID_ALL;
+  attr.use_clockid = true;
+  attr.clockid = SAMPLE_CLOCK;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+  attr.sample_max_stack = SAMPLE_MAX_STACK;
+#endif
+  attr.exclude_callchain_kernel = global->exclude_kernel_callchain;
+
+  int fd = perf_event_open(&attr, target, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  if (fd == -1) {
+    DEBUG("couldn't open off-CPU sampler: " << strerror(errno));
+  }
+  return fd;
+}
+
+}  // namespace alex
@@ -0,0 +1,34 @@
+#ifndef COLLECTOR_OFF_CPU
+#define COLLECTOR_OFF_CPU
+
+#include <sys/types.h>
+#include <cstdint>
+#include <vector>
+
+namespace alex {
+
+/*
+ * A stretch of time a thread spent switched out, between a PERF_RECORD_SWITCH
+ * out and the next one back in.
+ */
+struct off_cpu_interval {
+  uint64_t start_time;
+  uint64_t end_time;
+  // still runnable, as opposed to blocked on a lock, I/O, sleep, etc.
+  bool preempted;
+  // where the thread was switched out, from the off-CPU sampler
+  std::vector<uint64_t> callchain;
+};
+
+/*
+ * Opens the off-CPU sampler for target, a context switch event that samples
+ * the callchain of every switch out, ie. where the thread blocked. Its
+ * samples have the same layout as the cpu clock's, but the user part of the
+ * callchain always comes from frame pointers. Starts disabled, and returns -1
+ * with errno set on failure.
+ */
+int open_off_cpu_sampler(pid_t target);
+
+}  // namespace alex
+
+#endif
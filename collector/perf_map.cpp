@@ -0,0 +1,116 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "const.hpp"
+#include "debug.hpp"
+#include "perf_map.hpp"
+#include "util.hpp"
+
+namespace alex {
+
+perf_map create_perf_map(pid_t pid) {
+  perf_map map;
+  map.path = "/tmp/perf-" + std::to_string(pid) + ".map";
+  return map;
+}
+
+/*
+ * Parses a "<start> <size> <name>" line, with start and size in hex.
+ */
+static bool parse_perf_map_line(const char* line, const char* end,
+                                perf_map_sym* sym) {
+  char* end_ptr;
+  sym->start = strtoull(line, &end_ptr, 16);
+  const char* pos = end_ptr;
+  if (pos == line || pos >= end) {
+    return false;
+  }
+  const char* size_start = pos;
+  sym->size = strtoull(size_start, &end_ptr, 16);
+  pos = end_ptr;
+  if (pos == size_start || pos >= end || *pos != ' ') {
+    return false;
+  }
+  sym->name.assign(pos + 1, end);
+  return true;
+}
+
+bool update_perf_map(perf_map* map) {
+  map->last_read_ts = time_ms();
+
+  int fd = open(map->path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      DEBUG("couldn't open " << map->path << ": " << strerror(errno));
+    }
+    return false;
+  }
+
+  vector<char> buf;
+  size_t len = 0;
+  ssize_t count;
+  do {
+    buf.resize(len + PERF_MAP_READ_SIZE);
+    count = pread(fd, buf.data() + len, PERF_MAP_READ_SIZE, map->offset + len);
+    if (count > 0) {
+      len += count;
+    }
+  } while (count > 0 || (count == -1 && errno == EINTR));
+  close(fd);
+
+  // the runtime may be in the middle of writing a line, so leave anything
+  // after the last newline for next time
+  size_t old_size = map->syms.size();
+  const char *pos = buf.data(), *end = buf.data() + len;
+  for (const char* eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+       eol != nullptr;
+       eol = static_cast<const char*>(memchr(pos, '\n', end - pos))) {
+    perf_map_sym sym;
+    if (parse_perf_map_line(pos, eol, &sym)) {
+      map->syms.push_back(std::move(sym));
+    } else {
+      DEBUG("skipping malformed line in " << map->path);
+    }
+    pos = eol + 1;
+  }
+  map->offset += pos - buf.data();
+
+  if (map->syms.size() == old_size) {
+    return false;
+  }
+
+  // the old symbols are already sorted, so only the new ones need sorting
+  // before merging them in
+  auto by_start = [](const perf_map_sym& a, const perf_map_sym& b) {
+    return a.start < b.start;
+  };
+  auto new_syms = map->syms.begin() + old_size;
+  std::stable_sort(new_syms, map->syms.end(), by_start);
+  std::inplace_merge(map->syms.begin(), new_syms, map->syms.end(), by_start);
+
+  DEBUG("read " << map->syms.size() - old_size << " new symbols from "
+                << map->path);
+  return true;
+}
+
+const perf_map_sym* lookup_perf_map(const perf_map& map, uint64_t addr) {
+  auto next = std::upper_bound(
+      map.syms.begin(), map.syms.end(), addr,
+      [](uint64_t a, const perf_map_sym& sym) { return a < sym.start; });
+  // later symbols at the same address replace earlier ones, and code is
+  // rarely nested, so only check the closest few
+  for (size_t i = 0; i < PERF_MAP_MAX_OVERLAP && next != map.syms.begin();
+       i++) {
+    --next;
+    if (addr - next->start < next->size) {
+      return &*next;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace alex
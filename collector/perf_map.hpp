@@ -0,0 +1,56 @@
+#ifndef COLLECTOR_PERF_MAP
+#define COLLECTOR_PERF_MAP
+
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace alex {
+
+using std::string;
+using std::vector;
+
+/*
+ * A symbol for JIT compiled code, as written by the runtime to its perf map.
+ */
+struct perf_map_sym {
+  uint64_t start;
+  uint64_t size;
+  string name;
+};
+
+/*
+ * The symbols read so far from a /tmp/perf-<pid>.map file. Runtimes only ever
+ * append to these, so each update only reads the new lines.
+ */
+struct perf_map {
+  string path;
+  // bytes of complete lines read so far
+  off_t offset = 0;
+  // time_ms of the last update
+  size_t last_read_ts = 0;
+  // sorted by start, with later entries for the same address after earlier
+  // ones since the code may have been replaced
+  vector<perf_map_sym> syms;
+};
+
+/*
+ * The perf map for pid, not read yet.
+ */
+perf_map create_perf_map(pid_t pid);
+
+/*
+ * Reads the lines added to the perf map since the last update. Returns true
+ * if there were any.
+ */
+bool update_perf_map(perf_map* map);
+
+/*
+ * Finds the most recent symbol containing addr, or nullptr if there is none.
+ */
+const perf_map_sym* lookup_perf_map(const perf_map& map, uint64_t addr);
+
+}  // namespace alex
+
+#endif
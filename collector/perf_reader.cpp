@@ -1,10 +1,11 @@
-#include <cxxabi.h>
+#include <dirent.h>
 #include <dlfcn.h>
 #include <elf.h>
 #include <fcntl.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/message.h>
+#include <google/protobuf/repeated_field.h>
 #include <link.h>
 #include <linux/perf_event.h>
 #include <linux/version.h>
@@ -19,16 +20,21 @@
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cinttypes>
+#include <climits>
 #include <csignal>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -37,21 +43,34 @@
 #include "protos/warning.pb.h"
 
 #include "ancillary.hpp"
+#include "branch_stack.hpp"
 #include "const.hpp"
 #include "debug.hpp"
+#include "energy_sampler.hpp"
+#include "event_groups.hpp"
 #include "find_events.hpp"
+#include "hybrid.hpp"
 #include "inspect.hpp"
+#include "mem_samples.hpp"
+#include "membw.hpp"
+#include "off_cpu.hpp"
+#include "perf_map.hpp"
 #include "perf_reader.hpp"
 #include "rapl.hpp"
 #include "sockets.hpp"
+#include "topdown.hpp"
+#include "topology.hpp"
+#include "unwind.hpp"
 #include "util.hpp"
 #include "wattsup.hpp"
 
 namespace alex {
 
 using google::protobuf::Message;
+using google::protobuf::RepeatedPtrField;
 using google::protobuf::io::CodedOutputStream;
 using google::protobuf::io::OstreamOutputStream;
+using std::deque;
 using std::make_pair;
 // using std::make_tuple;
 using std::map;
@@ -64,7 +83,9 @@ using std::vector;
 // contents of buffer filled when PERF_RECORD_SAMPLE type is enabled plus
 // certain sample types
 /// the following record structs all have the perf_event_header shaved off,
-/// since it's removed by the get_next_record function
+/// since it's removed by the get_next_record function. Their fields follow the
+/// order the kernel writes them in (see perf_event_open(2)), not the order of
+/// the PERF_SAMPLE_* bits
 
 // the sample_id struct, if sample_id_all is enabled
 struct record_sample_id {
@@ -75,7 +96,9 @@ struct record_sample_id {
   uint64_t time;
   // PERF_SAMPLE_STREAM_ID
   uint64_t stream_id;
-  // PERF_SAMPLE_CPU is not enabled
+  // PERF_SAMPLE_CPU
+  uint32_t cpu;
+  uint32_t res;
   // PERF_STREAM_IDENTIFIER
   uint64_t id;  // actually the id for the group leader
 };
@@ -93,6 +116,9 @@ struct sample_record {
 #if SAMPLE_ID_ALL
   uint64_t stream_id;
 #endif
+  // PERF_SAMPLE_CPU
+  uint32_t cpu;
+  uint32_t res;
   // PERF_SAMPLE_GROUP
   // read_format v;
   // PERF_SAMPLE_CALLCHAIN
@@ -100,6 +126,51 @@ struct sample_record {
   uint64_t instruction_pointers[(SAMPLE_MAX_STACK + 2)];
 };
 
+// contents of PERF_RECORD_SAMPLE buffer from the memory sampler, see
+// MEMORY_SAMPLE_TYPE
+struct memory_sample_record {
+  // PERF_SAMPLE_IDENTIFIER
+  uint64_t sample_id;
+  // PERF_SAMPLE_IP
+  uint64_t ip;
+  // PERF_SAMPLE_TID
+  uint32_t pid;
+  uint32_t tid;
+  // PERF_SAMPLE_TIME
+  uint64_t time;
+  // PERF_SAMPLE_ADDR
+  uint64_t addr;
+  // PERF_SAMPLE_STREAM_ID
+  uint64_t stream_id;
+  // PERF_SAMPLE_CPU
+  uint32_t cpu;
+  uint32_t res;
+  // PERF_SAMPLE_WEIGHT
+  uint64_t weight;
+  // PERF_SAMPLE_DATA_SRC
+  uint64_t data_src;
+};
+
+// contents of PERF_RECORD_SAMPLE buffer from the branch sampler, see
+// BRANCH_SAMPLE_TYPE
+struct branch_sample_record {
+  // PERF_SAMPLE_IDENTIFIER
+  uint64_t sample_id;
+  // PERF_SAMPLE_TID
+  uint32_t pid;
+  uint32_t tid;
+  // PERF_SAMPLE_TIME
+  uint64_t time;
+  // PERF_SAMPLE_STREAM_ID
+  uint64_t stream_id;
+  // PERF_SAMPLE_CPU
+  uint32_t cpu;
+  uint32_t res;
+  // PERF_SAMPLE_BRANCH_STACK, most recent first
+  uint64_t num_branches;
+  perf_branch_entry branches[BRANCH_STACK_MAX_ENTRIES];
+};
+
 // contents of PERF_RECORD_THROTTLE or PERF_RECORD_UNTHROTTLE buffer
 struct throttle_record {
   // PERF_SAMPLE_TIME
@@ -122,6 +193,86 @@ struct lost_record {
 #endif
 };
 
+// contents of PERF_RECORD_FORK or PERF_RECORD_EXIT buffer, only enabled when
+// attached to a running process
+struct task_record {
+  uint32_t pid;
+  uint32_t ppid;
+  uint32_t tid;
+  uint32_t ptid;
+  uint64_t time;
+#ifdef SAMPLE_ID_ALL
+  record_sample_id sample_id;
+#endif
+};
+
+// contents of PERF_RECORD_MMAP2 buffer, only sent for executable mappings
+struct mmap2_record {
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t addr;
+  uint64_t len;
+  uint64_t pgoff;
+  uint32_t maj;
+  uint32_t min;
+  uint64_t ino;
+  uint64_t ino_generation;
+  uint32_t prot;
+  uint32_t flags;
+  // variable length, padded to 8 bytes and followed by the sample_id, which
+  // isn't needed here
+  char filename[PATH_MAX];
+};
+
+// contents of PERF_RECORD_SWITCH buffer, only enabled with the offcpu preset.
+// Whether it's a switch in or out is in the header's misc
+struct switch_record {
+#ifdef SAMPLE_ID_ALL
+  record_sample_id sample_id;
+#endif
+};
+
+// contents of an event's fd, with PERF_FORMAT_TOTAL_TIME_ENABLED and
+// PERF_FORMAT_TOTAL_TIME_RUNNING
+struct event_reading {
+  uint64_t value;
+  uint64_t time_enabled;
+  uint64_t time_running;
+};
+
+// an event's times as of its last reading, since they aren't reset with it
+struct event_times {
+  uint64_t enabled = 0;
+  uint64_t running = 0;
+};
+
+// which counter group a thread is counting, see rotate_event_group
+struct event_schedule {
+  size_t active_group = 0;
+  // timeslices since the group was swapped in
+  uint32_t timeslices = 0;
+  // by event fd
+  map<int, event_times> last_times;
+};
+
+// a timeslice whose counters have been read but whose callchain is waiting on
+// the symbol index to finish building
+struct pending_timeslice {
+  Timeslice timeslice;
+  vector<uint64_t> callchain;
+  // only filled in when unwinding with call frame information
+  user_stack stack;
+  vector<off_cpu_interval> off_cpu_intervals;
+};
+
+// where a thread was last switched out, waiting for it to be switched back in
+struct off_cpu_state {
+  // 0 if the thread is running
+  uint64_t switch_out_time = 0;
+  bool preempted = false;
+  vector<uint64_t> callchain;
+};
+
 // output file for data collection results
 ofstream *result_file;
 
@@ -132,6 +283,76 @@ map<int, perf_fd_info> perf_info_mappings;
 // a list of warnings (ie. throttle/unthrottle, lost)
 vector<Warning> warnings;
 
+// filled in by setup_collect_perf_data, but only written by serialize_header
+// once the symbol index is ready
+Header header_message;
+bool header_written = false;
+
+// timeslices sampled before the symbol index was ready, in sample order
+vector<pending_timeslice> pending_timeslices;
+
+// executable mappings made since the symbol index started building
+symbol_updates mapping_updates;
+
+// whether the symbol index update thread is currently building a new index
+bool symbol_update_running = false;
+
+// memory samples waiting to be added to their thread's next timeslice, by
+// cpu clock fd
+map<int, RepeatedPtrField<MemorySample>> pending_memory_samples;
+
+// likewise for branch stacks
+map<int, RepeatedPtrField<BranchStack>> pending_branch_stacks;
+
+// and off-CPU intervals, which are symbolized with the timeslice
+map<int, vector<off_cpu_interval>> pending_off_cpu_intervals;
+
+// the current off-CPU interval of each thread, by cpu clock fd
+map<int, off_cpu_state> off_cpu_states;
+
+// the counter group each thread is counting, by cpu clock fd
+map<int, event_schedule> event_schedules;
+
+// the NUMA node of each cpu, see read_cpu_nodes
+vector<int> cpu_nodes;
+
+// the physical package of each cpu, see read_cpu_packages
+vector<int> cpu_packages;
+
+// each thread's energy readings as of its previous timeslice, by cpu clock fd
+map<int, map<string, uint64_t>> last_energy_readings;
+
+// the core PMU of each cpu on hybrid CPUs, see read_cpu_core_types
+vector<int> cpu_core_types;
+
+// whether the memory controllers are being counted for the membw preset
+bool membw_counting = false;
+
+// whether energy is read from the power PMU for the rapl preset, rather than
+// from sysfs by the energy sampler
+bool rapl_counting = false;
+
+// whether the energy sampler is reading the sysfs zones
+bool energy_sampling_started = false;
+
+// when each thread's previous timeslice ended, by cpu clock fd, which is where
+// its memory bandwidth starts being attributed from
+map<int, uint64_t> last_sample_times;
+
+// the caller's fd of the WattsUp meter's device, polled along with the perf
+// fds, or nullptr. It's closed and set to -1 if the device goes away, so the
+// caller knows not to shut it down.
+int *wattsup_fd = nullptr;
+wu_parser wattsup_parser;
+// its readings, oldest first and at most WU_HISTORY of them
+deque<wu_reading> wattsup_readings;
+
+// the frequency MPERF counts at in kHz, only read with the frequency preset
+uint64_t base_frequency = 0;
+
+// JIT symbols written by the subject's runtime, by pid
+map<pid_t, perf_map> perf_maps;
+
 // the epoll fd used in the collector
 int sample_epfd = epoll_create1(0);
 // a count of the number of fds added to the epoll
@@ -146,6 +367,13 @@ int get_record_size(int record_type) {
       return sizeof(throttle_record);
     case PERF_RECORD_LOST:
       return sizeof(lost_record);
+    case PERF_RECORD_FORK:
+    case PERF_RECORD_EXIT:
+      return sizeof(task_record);
+    case PERF_RECORD_MMAP2:
+      return sizeof(mmap2_record);
+    case PERF_RECORD_SWITCH:
+      return sizeof(switch_record);
     default:
       return -1;
   }
@@ -207,12 +435,33 @@ void delete_fd_from_epoll(int fd) {
   sample_fd_count--;
 }
 
+/*
+ * Closes the perf fds opened so far for a thread that exited while they were
+ * being set up, and marks info as not monitoring anything.
+ */
+void abandon_perf_events(perf_fd_info *info) {
+  close(info->cpu_clock_fd);
+  for (int leader_fd : info->core_pmu_leader_fds) {
+    close(leader_fd);
+  }
+  for (auto &entry : info->event_fds) {
+    for (int event_fd : entry.second) {
+      close(event_fd);
+    }
+  }
+  for (auto &entry : info->sampler_fds) {
+    close(entry.second);
+  }
+  info->cpu_clock_fd = -1;
+}
+
 /*
  * Sets up all the perf events for the target process/thread
  * The current list of perf events is:
  *   all samples listed in record_type constant, on cpu cycles
  *   a count of instructions
  *   all events listed in COLLECTOR_EVENTS env var
+ *   the memory and branch samplers, if their presets are enabled
  * The cpu cycles event is set as the group leader and initially disabled, with
  * every other event as children in the group. Thus, when the cpu cycles event
  * is started all the others are as well simultaneously
@@ -232,21 +481,78 @@ perf_fd_info setup_perf_events(pid_t target) {
   cpu_clock_attr.sample_period = global->period;
   cpu_clock_attr.wakeup_events = 1;
   cpu_clock_attr.sample_id_all = SAMPLE_ID_ALL;
+  // events can only join a group on the same clock, so every one uses this
+  cpu_clock_attr.use_clockid = true;
+  cpu_clock_attr.clockid = SAMPLE_CLOCK;
+  // when attached, new threads aren't registered through the socket, so watch
+  // for them being created instead
+  cpu_clock_attr.task = global->attached;
+  // libraries loaded later (eg. through dlopen) need to be added to the symbol
+  // index, so watch for new executable mappings
+  cpu_clock_attr.mmap2 = true;
+  // the off-CPU sampler only says where threads were switched out, these say
+  // when they were switched back in
+  cpu_clock_attr.context_switch = preset_enabled("offcpu");
   // cpu_clock_attr.read_format = PERF_FORMAT_GROUP;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
-  cpu_clock_attr.(SAMPLE_MAX_STACK + 2) = (SAMPLE_MAX_STACK + 2);
+  cpu_clock_attr.sample_max_stack = SAMPLE_MAX_STACK;
 #endif
+  cpu_clock_attr.exclude_callchain_kernel = global->exclude_kernel_callchain;
+  if (global->dwarf_unwind) {
+    // the user part of the callchain is unwound later from a copy of the
+    // stack, since following frame pointers stops at the first function
+    // compiled without them
+    cpu_clock_attr.sample_type |= USER_STACK_SAMPLE_TYPE;
+    cpu_clock_attr.sample_regs_user = user_regs_mask();
+    cpu_clock_attr.sample_stack_user = global->stack_dump_size;
+    cpu_clock_attr.exclude_callchain_user = true;
+  }
+
+  perf_fd_info info;
+  info.tid = target;
 
   perf_buffer cpu_clock_perf{};
   if (setup_monitoring(&cpu_clock_perf, &cpu_clock_attr, target) !=
       SAMPLER_MONITOR_SUCCESS) {
+    if (global->attached && errno == ESRCH) {
+      DEBUG("thread " << target << " exited before it could be monitored");
+      info.cpu_clock_fd = -1;
+      return info;
+    }
     PARENT_SHUTDOWN_MSG(INTERNAL_ERROR, "error setting up the monitoring");
   }
 
-  perf_fd_info info;
   info.cpu_clock_fd = cpu_clock_perf.fd;
   info.sample_buf = cpu_clock_perf;
-  info.tid = target;
+
+  // on hybrid CPUs, a group can only count on one kind of core, and a group
+  // holding another kind's events isn't scheduled at all. So the core events
+  // of each kind get a group of their own, led by a dummy event that's always
+  // enabled, rather than joining the cpu clock's (which would then stop
+  // sampling whenever the thread moved to the other kind)
+  for (size_t i = 0; i < global->num_core_pmus; i++) {
+    perf_event_attr leader_attr{};
+    memset(&leader_attr, 0, sizeof(perf_event_attr));
+    leader_attr.size = sizeof(perf_event_attr);
+    leader_attr.type = PERF_TYPE_SOFTWARE;
+    leader_attr.config = PERF_COUNT_SW_DUMMY;
+    leader_attr.disabled = true;
+    leader_attr.use_clockid = true;
+    leader_attr.clockid = SAMPLE_CLOCK;
+    int leader_fd =
+        perf_event_open(&leader_attr, target, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (leader_fd == -1) {
+      if (global->attached && errno == ESRCH) {
+        DEBUG("thread " << target << " exited while setting up groups");
+        abandon_perf_events(&info);
+        return info;
+      }
+      PARENT_SHUTDOWN_PERROR(INTERNAL_ERROR,
+                             "couldn't open the group leader for "
+                                 << core_pmus()[i].name);
+    }
+    info.core_pmu_leader_fds.push_back(leader_fd);
+  }
 
   if (global->events_size != 0) {
     DEBUG("setting up events");
@@ -256,29 +562,89 @@ perf_fd_info setup_perf_events(pid_t target) {
     for (int i = 0; i < global->events_size; i++) {
       const char *event = global->events[i];
       DEBUG("setting up event: " << event);
-      perf_event_attr attr{};
-      memset(&attr, 0, sizeof(perf_event_attr));
-
-      // Parse out event name with PFM.  Must be done first.
-      DEBUG("parsing pfm event name");
-      int pfm_result = setup_pfm_os_event(&attr, const_cast<char *>(event));
-      if (pfm_result != PFM_SUCCESS) {
-        PARENT_SHUTDOWN_ERRMSG(EVENT_ERROR, "pfm encoding error",
-                               pfm_strerror(pfm_result));
+      // the core PMU each of the event's fds is for, or -1 for just the one
+      vector<int> pmus;
+      for (size_t j = 0; j < global->num_core_pmus; j++) {
+        if ((global->event_pmus[i] & (1u << j)) != 0) {
+          pmus.push_back(j);
+        }
+      }
+      if (pmus.empty()) {
+        pmus.push_back(-1);
       }
-      attr.disabled = false;
 
-      DEBUG("opening perf event");
-      // use cpu cycles event as group leader again
-      auto event_fd = perf_event_open(&attr, target, -1, cpu_clock_perf.fd,
-                                      PERF_FLAG_FD_CLOEXEC);
-      if (event_fd == -1) {
-        PARENT_SHUTDOWN_PERROR(INTERNAL_ERROR,
-                               "couldn't perf_event_open for event");
+      for (int pmu : pmus) {
+        perf_event_attr attr{};
+        memset(&attr, 0, sizeof(perf_event_attr));
+
+        // Parse out event name with PFM.  Must be done first.
+        DEBUG("parsing pfm event name");
+        int pfm_result =
+            pmu == -1
+                ? setup_pfm_os_event(&attr, const_cast<char *>(event))
+                : setup_core_pmu_event(&attr, event, core_pmus()[pmu]);
+        if (pfm_result != PFM_SUCCESS) {
+          PARENT_SHUTDOWN_ERRMSG(EVENT_ERROR, "pfm encoding error",
+                                 pfm_strerror(pfm_result));
+        }
+        // only the first group is counted to begin with, see
+        // rotate_event_group
+        attr.disabled = global->event_groups[i] != 0 &&
+                        global->event_groups[i] != ALL_EVENT_GROUPS;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.use_clockid = true;
+        attr.clockid = SAMPLE_CLOCK;
+
+        DEBUG("opening perf event");
+        // use cpu cycles event as group leader again, except for the topdown
+        // metrics, which have to be led by the slots counter (which comes
+        // before them in the sorted events), and core events on hybrid CPUs
+        int group_fd = cpu_clock_perf.fd;
+        if (pmu != -1) {
+          group_fd = info.core_pmu_leader_fds[pmu];
+        } else if (strcmp(event, TOPDOWN_SLOTS_EVENT) == 0) {
+          group_fd = -1;
+        } else if (is_topdown_event(event)) {
+          group_fd = info.event_fds.at(TOPDOWN_SLOTS_EVENT).front();
+        }
+        auto event_fd =
+            perf_event_open(&attr, target, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+        if (event_fd == -1) {
+          if (global->attached && errno == ESRCH) {
+            DEBUG("thread " << target << " exited while setting up events");
+            abandon_perf_events(&info);
+            return info;
+          }
+          PARENT_SHUTDOWN_PERROR(INTERNAL_ERROR,
+                                 "couldn't perf_event_open for event");
+        }
+
+        info.event_fds[event].push_back(event_fd);
       }
+    }
+  }
 
-      info.event_fds[event] = event_fd;
+  for (const auto &sampler : enabled_samplers()) {
+    DEBUG("setting up " << sampler << " sampler");
+    int sampler_fd;
+    if (sampler == "memory") {
+      sampler_fd = open_memory_sampler(target);
+    } else if (sampler == "lbr") {
+      sampler_fd = open_branch_sampler(target);
+    } else {
+      sampler_fd = open_off_cpu_sampler(target);
     }
+    if (sampler_fd == -1) {
+      if (global->attached && errno == ESRCH) {
+        DEBUG("thread " << target << " exited while setting up samplers");
+        abandon_perf_events(&info);
+        return info;
+      }
+      PARENT_SHUTDOWN_PERROR(EVENT_ERROR,
+                             "couldn't open the " << sampler << " sampler");
+    }
+    info.sampler_fds[sampler] = sampler_fd;
   }
 
   // all related events are ready, so time to start monitoring
@@ -286,6 +652,11 @@ perf_fd_info setup_perf_events(pid_t target) {
   if (start_monitoring(info.cpu_clock_fd) != SAMPLER_MONITOR_SUCCESS) {
     PARENT_SHUTDOWN_MSG(INTERNAL_ERROR, "failed to start monitoring");
   }
+  for (int leader_fd : info.core_pmu_leader_fds) {
+    if (start_monitoring(leader_fd) != SAMPLER_MONITOR_SUCCESS) {
+      PARENT_SHUTDOWN_MSG(INTERNAL_ERROR, "failed to start monitoring");
+    }
+  }
 
   DEBUG("finished setting up perf events (tid: " << target << ")");
   return info;
@@ -301,7 +672,31 @@ void handle_perf_register(perf_fd_info *info) {
   add_fd_to_epoll(info->cpu_clock_fd);
   DEBUG("inserting mapping for fd " << info->cpu_clock_fd);
   for (int i = 0; i < global->events_size; i++) {
-    DEBUG("event[" << i << "]: " << info->event_fds[global->events[i]]);
+    for (int event_fd : info->event_fds[global->events[i]]) {
+      DEBUG("event[" << i << "]: " << event_fd);
+    }
+  }
+  for (const auto &entry : info->sampler_fds) {
+    DEBUG("redirecting " << entry.first << " sampler fd " << entry.second);
+    // the sampler has no buffer of its own, its records are read from the cpu
+    // clock's alongside the timeslice samples and told apart by their id. The
+    // kernel refuses unless both are on the same clock, hence SAMPLE_CLOCK
+    if (ioctl(entry.second, PERF_EVENT_IOC_SET_OUTPUT, info->cpu_clock_fd) ==
+        -1) {
+      PARENT_SHUTDOWN_PERROR(INTERNAL_ERROR, "couldn't redirect "
+                                                 << entry.first
+                                                 << " sampler output");
+    }
+    uint64_t id;
+    if (ioctl(entry.second, PERF_EVENT_IOC_ID, &id) == -1) {
+      PARENT_SHUTDOWN_PERROR(INTERNAL_ERROR,
+                             "couldn't get " << entry.first << " sampler id");
+    }
+    info->sampler_ids[id] = entry.first;
+    if (start_monitoring(entry.second) != SAMPLER_MONITOR_SUCCESS) {
+      PARENT_SHUTDOWN_MSG(INTERNAL_ERROR,
+                          "failed to start " << entry.first << " sampler");
+    }
   }
   perf_info_mappings.emplace(make_pair(info->cpu_clock_fd, *info));
   DEBUG("successfully added fd " << info->cpu_clock_fd
@@ -309,23 +704,45 @@ void handle_perf_register(perf_fd_info *info) {
                                  << info->tid);
 }
 
+// defined with the rest of the timeslice writing below
+void write_pending_records(const perf_fd_info &info, const symbol_index *syms);
+
 /*
  * Performs bookkeeping deleting for saved perf fd data from thtread in subject
- * program.
+ * program. Whatever the thread had waiting for its next timeslice is written
+ * first, with syms if the symbol index is ready.
  */
-void handle_perf_unregister(perf_fd_info *info) {
+void handle_perf_unregister(perf_fd_info *info, const symbol_index *syms) {
   DEBUG("handling perf unregister request for thread "
         << info->tid << ", removing from epoll");
+  write_pending_records(*info, syms);
 
   stop_monitoring(info->cpu_clock_fd);
   delete_fd_from_epoll(info->cpu_clock_fd);
   DEBUG("closing all associated fds");
   close(info->cpu_clock_fd);
-  for (auto entry : info->event_fds) {
+  for (int leader_fd : info->core_pmu_leader_fds) {
+    stop_monitoring(leader_fd);
+    close(leader_fd);
+  }
+  for (const auto &entry : info->event_fds) {
+    for (int event_fd : entry.second) {
+      close(event_fd);
+    }
+  }
+  for (auto entry : info->sampler_fds) {
+    stop_monitoring(entry.second);
     close(entry.second);
   }
   DEBUG("removing mapping");
   perf_info_mappings.erase(info->cpu_clock_fd);
+  pending_memory_samples.erase(info->cpu_clock_fd);
+  pending_branch_stacks.erase(info->cpu_clock_fd);
+  pending_off_cpu_intervals.erase(info->cpu_clock_fd);
+  off_cpu_states.erase(info->cpu_clock_fd);
+  event_schedules.erase(info->cpu_clock_fd);
+  last_sample_times.erase(info->cpu_clock_fd);
+  last_energy_readings.erase(info->cpu_clock_fd);
 
   DEBUG("freeing malloced memory");
   munmap(info->sample_buf.info, BUFFER_SIZE);
@@ -336,12 +753,83 @@ void handle_perf_unregister(perf_fd_info *info) {
   delete info;
 }
 
+/*
+ * Returns whether the thread already has perf fds set up for it.
+ */
+bool thread_registered(pid_t tid) {
+  for (auto &p : perf_info_mappings) {
+    if (p.second.tid == tid) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Sets up the perf events and buffer for a thread of the subject from within
+ * the collector, rather than receiving them over the socket. Returns false if
+ * the thread exited before it could be monitored.
+ */
+bool register_thread(pid_t tid) {
+  perf_fd_info info = setup_perf_events(tid);
+  if (info.cpu_clock_fd == -1) {
+    return false;
+  }
+  DEBUG("thread " << tid << " registered with fd " << info.cpu_clock_fd);
+  if (setup_buffer(&info) != SAMPLER_MONITOR_SUCCESS) {
+    PARENT_SHUTDOWN_MSG(INTERNAL_ERROR, "cannot set up buffer for fd");
+  }
+  handle_perf_register(&info);
+  return true;
+}
+
+/*
+ * Registers every thread currently listed in /proc/<subject_pid>/task. Threads
+ * may be created while the directory is being read, so it's reread until no
+ * new threads turn up; any created after that are caught by their fork record.
+ */
+void register_attached_threads() {
+  string task_path = "/proc/" + std::to_string(global->subject_pid) + "/task";
+  bool found_new = true;
+  while (found_new) {
+    found_new = false;
+    DIR *task_dir = opendir(task_path.c_str());
+    if (task_dir == nullptr) {
+      PARENT_SHUTDOWN_PERROR(INTERNAL_ERROR, "couldn't open " << task_path);
+    }
+    for (dirent *entry = readdir(task_dir); entry != nullptr;
+         entry = readdir(task_dir)) {
+      if (entry->d_name[0] == '.') {
+        continue;
+      }
+      pid_t tid = atoi(entry->d_name);
+      if (!thread_registered(tid) && register_thread(tid)) {
+        found_new = true;
+      }
+    }
+    closedir(task_dir);
+  }
+  DEBUG_CRITICAL("attached to " << perf_info_mappings.size() << " threads");
+}
+
+/*
+ * Stops monitoring and closes the perf fds of every registered thread.
+ */
+void unregister_all_perf_fds() {
+  DEBUG("unregistering " << perf_info_mappings.size() << " threads");
+  // collect_perf_data has already written what the threads had waiting
+  while (!perf_info_mappings.empty()) {
+    handle_perf_unregister(new perf_fd_info(perf_info_mappings.begin()->second),
+                           nullptr);
+  }
+}
+
 /*
  * Checks for the presence of high priority file descriptors in the epoll.
  * Returns true if there were priority fds, false otherwise
  */
 bool check_priority_fds(epoll_event evlist[], int ready_fds, int sigt_fd,
-                        int socket, bool *done) {
+                        int socket, const symbol_index *syms, bool *done) {
   // check for high priority fds
   bool had_priority_fd = false;
   for (int i = 0; i < ready_fds; i++) {
@@ -368,7 +856,7 @@ bool check_priority_fds(epoll_event evlist[], int ready_fds, int sigt_fd,
           }
           handle_perf_register(info);
         } else if (cmd == SOCKET_CMD_UNREGISTER) {
-          handle_perf_unregister(info);
+          handle_perf_unregister(info, syms);
         } else {
           PARENT_SHUTDOWN_MSG(INTERNAL_ERROR, "unknown perf command");
         }
@@ -387,22 +875,6 @@ bool check_priority_fds(epoll_event evlist[], int ready_fds, int sigt_fd,
   return had_priority_fd;
 }
 
-/*
- * Looks up an address in the kernel sym map. Accounts for addresses that
- * may be in the middle of a kernel function.
- */
-uint64_t lookup_kernel_addr(map<uint64_t, kernel_sym> kernel_syms,
-                            uint64_t addr) {
-  auto prev = kernel_syms.begin()->first;
-  for (auto const &next : kernel_syms) {
-    if (prev < addr && addr < next.first) {
-      return prev;
-    }
-    prev = next.first;
-  }
-  return -1;
-}
-
 /*
  * reset the period of sampling to handle throttle/unthrottle events
  */
@@ -505,15 +977,391 @@ void process_throttle_record(const throttle_record &throttle, int record_type,
   warnings->emplace_back(warning_message);
 }
 
+/*
+ * Looks up addr in the pid's perf map, which the runtime keeps appending to as
+ * it compiles code. If it isn't there, the map is reread, at most once every
+ * PERF_MAP_REREAD_INTERVAL ms.
+ */
+const perf_map_sym *lookup_jit_sym(pid_t pid, uint64_t addr,
+                                   const string **map_path) {
+  auto it = perf_maps.find(pid);
+  if (it == perf_maps.end()) {
+    it = perf_maps.emplace(pid, create_perf_map(pid)).first;
+  }
+  perf_map &pid_map = it->second;
+  *map_path = &pid_map.path;
+
+  const perf_map_sym *sym = lookup_perf_map(pid_map, addr);
+  if (sym == nullptr &&
+      time_ms() - pid_map.last_read_ts >= PERF_MAP_REREAD_INTERVAL &&
+      update_perf_map(&pid_map)) {
+    sym = lookup_perf_map(pid_map, addr);
+  }
+  return sym;
+}
+
+/*
+ * Demangles the symbol name, if possible, and sets it as the frame's symbol.
+ */
+void set_frame_symbol(StackFrame *stack_frame, const string &sym_name_str) {
+  // https://gcc.gnu.org/onlinedocs/libstdc++/libstdc++-html-USERS-4.3/a01696.html
+  DEBUG("demangling symbol name");
+  int demangle_status;
+  stack_frame->set_symbol(demangle(sym_name_str, &demangle_status));
+  if (demangle_status != 0) {
+    if (demangle_status == -1) {
+      PARENT_SHUTDOWN_MSG(INTERNAL_ERROR,
+                          "demangling errored due to memory allocation");
+    } else if (demangle_status == -2) {
+      DEBUG("could not demangle name " << sym_name_str);
+    } else if (demangle_status == -3) {
+      PARENT_SHUTDOWN_MSG(INTERNAL_ERROR,
+                          "demangling errored due to invalid arguments");
+    }
+  }
+}
+
+/*
+ * Looks up the symbol and source location of each instruction pointer in a
+ * callchain of pid and adds them to stack_frames. User frames that are inside
+ * inlined calls are expanded into one frame per inlined function, innermost
+ * first, followed by the function they were all inlined into.
+ */
+void add_stack_frames(RepeatedPtrField<StackFrame> *stack_frames, pid_t pid,
+                      const uint64_t *instruction_pointers,
+                      uint64_t num_instruction_pointers,
+                      const symbol_index &syms) {
+  perf_callchain_context callchain_section = PERF_CONTEXT_KERNEL;
+  DEBUG("looking up " << num_instruction_pointers << " inst ptrs");
+  for (uint64_t i = 0; i < num_instruction_pointers; i++) {
+    auto inst_ptr =
+        static_cast<perf_callchain_context>(instruction_pointers[i]);
+    if (is_callchain_marker(inst_ptr)) {
+      callchain_section = inst_ptr;
+      continue;
+    }
+    DEBUG("on instruction pointer " << int_to_hex(inst_ptr) << " (" << (i + 1)
+                                    << "/" << num_instruction_pointers << ")");
+
+    StackFrame *stack_frame = stack_frames->Add();
+
+    stack_frame->set_section(callchain_enum(callchain_section));
+
+    string sym_name_str;
+    DEBUG("looking up symbol for inst ptr " << ptr_fmt((void *)inst_ptr));
+    if (callchain_section == PERF_CONTEXT_USER) {
+      DEBUG("looking up user stack frame");
+      bool found_file = false;
+      // the subject's mappings, including libraries it loaded after the fork
+      // (or the attach), which aren't mapped in the collector
+      auto mapping = syms.mappings.upper_bound(interval(inst_ptr, inst_ptr));
+      if (mapping != syms.mappings.begin() &&
+          (--mapping)->first.contains(inst_ptr)) {
+        stack_frame->set_file_name(mapping->second.path);
+        stack_frame->set_file_base(mapping->second.load_base);
+        found_file = true;
+      } else if (!global->attached) {
+        // when forked, whatever was mapped before the fork is mapped at the
+        // same place here, so dladdr still works for anything missed above
+        Dl_info info;
+        // Lookup the name of the function given the function
+        // pointer
+        if (dladdr(reinterpret_cast<void *>(inst_ptr), &info) != 0) {
+          stack_frame->set_file_name(info.dli_fname);
+          stack_frame->set_file_base(
+              reinterpret_cast<uint64_t>(info.dli_fbase));
+          found_file = true;
+        }
+      }
+
+      if (!found_file) {
+        // not in a file, so it may be in an anonymous mapping of JIT code
+        DEBUG("could not look up user stack frame, checking perf map");
+        const string *map_path;
+        const perf_map_sym *jit_sym =
+            lookup_jit_sym(pid, inst_ptr - 1, &map_path);
+        if (jit_sym != nullptr) {
+          sym_name_str = jit_sym->name;
+          stack_frame->set_file_name(*map_path);
+        }
+      }
+    } else if (callchain_section == PERF_CONTEXT_KERNEL) {
+      DEBUG("looking up kernel stack frame");
+      const kernel_syms &ksyms = get_kernel_syms();
+      const kernel_sym *ks = lookup_kernel_sym(ksyms, inst_ptr);
+      if (ks != nullptr) {
+        sym_name_str = ksyms.name_of(ks->name);
+        if (ks->module != 0) {
+          stack_frame->set_file_name(ksyms.name_of(ks->module));
+        }
+      }
+    }
+
+    // Need to subtract one. PC is the return address, but we're
+    // looking for the callsite.
+    ::dwarf::taddr pc = inst_ptr - 1;
+
+    // Get the sym name
+    if (sym_name_str.empty()) {
+      DEBUG("looking up function symbol");
+      const string *sym = syms.find_symbol(pc);
+      if (sym != nullptr) {
+        sym_name_str = *sym;
+      } else {
+        DEBUG("cannot find function symbol");
+      }
+    }
+
+    // 0 when unknown, like the line of a StackFrame
+    size_t line = 0;
+    const string *location = nullptr;
+
+    // Get the line full location
+    DEBUG("looking up line location");
+    const line_index *lines = syms.line_table_of(pc);
+    const packed_range *range = lines != nullptr ? lines->find(pc) : nullptr;
+    if (range != nullptr) {
+      const packed_line &l = lines->line_of(*range);
+      DEBUG("line is " << l.line);
+      line = l.line;
+      location = &lines->file_name_of(l);
+    } else {
+      DEBUG("cannot find line location");
+    }
+
+    if (callchain_section == PERF_CONTEXT_USER && lines != nullptr) {
+      // each inlined call finishes the current frame as the inlined function,
+      // and moves the location to its call site in the caller's frame
+      for (const packed_inline *inl = lines->find_inline(pc); inl != nullptr;
+           inl = lines->parent_of(*inl)) {
+        DEBUG("pc is inside inlined call to "
+              << lines->inline_names[inl->name]);
+        stack_frame->set_inlined(true);
+        set_frame_symbol(stack_frame, lines->inline_names[inl->name]);
+        if (location != nullptr) {
+          stack_frame->set_full_location(*location);
+        }
+        if (line != 0) {
+          stack_frame->set_line(line);
+        }
+
+        StackFrame *caller_frame = stack_frames->Add();
+        caller_frame->set_section(stack_frame->section());
+        caller_frame->set_file_name(stack_frame->file_name());
+        caller_frame->set_file_base(stack_frame->file_base());
+        stack_frame = caller_frame;
+        line = inl->call_line;
+        location = &lines->file_names[inl->call_file_id];
+      }
+    }
+
+    if (!sym_name_str.empty()) {
+      set_frame_symbol(stack_frame, sym_name_str);
+    }
+    if (location != nullptr) {
+      stack_frame->set_full_location(*location);
+    }
+    if (line != 0) {
+      stack_frame->set_line(line);
+    }
+  }
+}
+
+/*
+ * Adds the timeslice's own callchain as its stack frames.
+ */
+void add_stack_frames(Timeslice *timeslice_message,
+                      const uint64_t *instruction_pointers,
+                      uint64_t num_instruction_pointers,
+                      const symbol_index &syms) {
+  add_stack_frames(timeslice_message->mutable_stack_frames(),
+                   timeslice_message->pid(), instruction_pointers,
+                   num_instruction_pointers, syms);
+}
+
+/*
+ * Adds the off-CPU intervals to the timeslice, each with the stack frames of
+ * where its thread was switched out.
+ */
+void add_off_cpu_intervals(Timeslice *timeslice_message,
+                           const vector<off_cpu_interval> &intervals,
+                           const symbol_index &syms) {
+  for (const auto &interval : intervals) {
+    OffCpuInterval *interval_message =
+        timeslice_message->add_off_cpu_intervals();
+    interval_message->set_start_time(interval.start_time);
+    interval_message->set_end_time(interval.end_time);
+    interval_message->set_preempted(interval.preempted);
+    add_stack_frames(interval_message->mutable_stack_frames(),
+                     timeslice_message->pid(), interval.callchain.data(),
+                     interval.callchain.size(), syms);
+  }
+}
+
+/*
+ * Reads the user registers and stack that follow a cpu clock sample's
+ * callchain. They make the record too big for a fixed size struct, so the
+ * whole record is copied out of the ring buffer first.
+ */
+bool read_user_stack(void *perf_result, int data_size, uintptr_t data_start,
+                     uintptr_t data_end, user_stack *stack) {
+  // reused between samples, since it's as big as the stack dump
+  static vector<uint8_t> record;
+  record.resize(data_size);
+  copy_record_to_stack(perf_result, record.data(), data_size, data_start,
+                       data_end);
+
+  const uint8_t *pos = record.data(), *end = record.data() + record.size();
+  pos += offsetof(sample_record, num_instruction_pointers);
+  uint64_t num_instruction_pointers;
+  if (end - pos < static_cast<ptrdiff_t>(sizeof(uint64_t))) {
+    return false;
+  }
+  memcpy(&num_instruction_pointers, pos, sizeof(uint64_t));
+  pos += sizeof(uint64_t);
+  if (num_instruction_pointers > (end - pos) / sizeof(uint64_t)) {
+    return false;
+  }
+  pos += num_instruction_pointers * sizeof(uint64_t);
+  return parse_user_stack(pos, end, stack);
+}
+
+/*
+ * Scales an event's count up to the whole time it was enabled since its last
+ * reading, in case the kernel had to multiplex it with other events (eg. the
+ * samplers, or another process's).
+ */
+uint64_t scale_count(const event_reading &reading, event_times *last) {
+  uint64_t enabled = reading.time_enabled - last->enabled,
+           running = reading.time_running - last->running;
+  last->enabled = reading.time_enabled;
+  last->running = reading.time_running;
+  if (running == 0 || running >= enabled) {
+    return reading.value;
+  }
+  return static_cast<uint64_t>(static_cast<double>(reading.value) * enabled /
+                               running);
+}
+
+/*
+ * Swaps the thread's active counter group for the next one once it's been
+ * counted for mux_interval timeslices. Counting stops for the old group's
+ * events and starts for the new one's, so only one group holds the counters
+ * at a time.
+ */
+void rotate_event_group(const perf_fd_info &info, event_schedule *schedule) {
+  if (global->num_event_groups == 1 ||
+      ++schedule->timeslices < global->mux_interval) {
+    return;
+  }
+  size_t next_group = (schedule->active_group + 1) % global->num_event_groups;
+  DEBUG("swapping counter group " << schedule->active_group << " for "
+                                  << next_group << " in thread " << info.tid);
+  for (int i = 0; i < global->events_size; i++) {
+    for (int event_fd : info.event_fds.at(global->events[i])) {
+      if (global->event_groups[i] == schedule->active_group) {
+        if (stop_monitoring(event_fd) != SAMPLER_MONITOR_SUCCESS) {
+          DEBUG_CRITICAL("couldn't stop counting " << global->events[i]);
+        }
+      } else if (global->event_groups[i] == next_group) {
+        if (start_monitoring(event_fd) != SAMPLER_MONITOR_SUCCESS) {
+          DEBUG_CRITICAL("couldn't start counting " << global->events[i]);
+        }
+      }
+    }
+  }
+  schedule->active_group = next_group;
+  schedule->timeslices = 0;
+}
+
+/*
+ * Writes out every timeslice that was waiting on the symbol index, oldest
+ * first, so the result file stays in sample order.
+ */
+void flush_pending_timeslices(const symbol_index &syms) {
+  DEBUG_CRITICAL("symbol index ready, writing " << pending_timeslices.size()
+                                                << " pending timeslices");
+  for (auto &pending : pending_timeslices) {
+    if (global->dwarf_unwind) {
+      pending.callchain =
+          unwind_callchain(pending.callchain.data(), pending.callchain.size(),
+                           pending.stack, syms);
+    }
+    add_stack_frames(&pending.timeslice, pending.callchain.data(),
+                     pending.callchain.size(), syms);
+    add_off_cpu_intervals(&pending.timeslice, pending.off_cpu_intervals, syms);
+    classify_memory_samples(&pending.timeslice, syms);
+    add_branch_symbols(&pending.timeslice, syms);
+    serialize_delimited(pending.timeslice);
+  }
+  pending_timeslices.clear();
+  pending_timeslices.shrink_to_fit();
+}
+
+/*
+ * Writes the off-CPU intervals, memory samples and branch stacks a thread has
+ * waiting for its next timeslice in a timeslice of their own, with no ticks or
+ * stack frames. A thread that's mostly blocked may not get another timeslice
+ * for a long time, or ever, so this is done once too many are waiting and when
+ * the thread goes away.
+ */
+void write_pending_records(const perf_fd_info &info,
+                           const symbol_index *syms) {
+  Timeslice timeslice_message;
+  vector<off_cpu_interval> off_cpu_intervals;
+  // stamped with the newest record, so it's in order with the samples
+  uint64_t time = 0;
+  auto pending_intervals = pending_off_cpu_intervals.find(info.cpu_clock_fd);
+  if (pending_intervals != pending_off_cpu_intervals.end() &&
+      !pending_intervals->second.empty()) {
+    off_cpu_intervals.swap(pending_intervals->second);
+    time = off_cpu_intervals.back().end_time;
+  }
+  auto memory_samples = pending_memory_samples.find(info.cpu_clock_fd);
+  if (memory_samples != pending_memory_samples.end() &&
+      !memory_samples->second.empty()) {
+    timeslice_message.mutable_memory_samples()->Swap(&memory_samples->second);
+    time = std::max(time, timeslice_message.memory_samples().rbegin()->time());
+  }
+  auto branch_stacks = pending_branch_stacks.find(info.cpu_clock_fd);
+  if (branch_stacks != pending_branch_stacks.end() &&
+      !branch_stacks->second.empty()) {
+    timeslice_message.mutable_branch_stacks()->Swap(&branch_stacks->second);
+    time = std::max(time, timeslice_message.branch_stacks().rbegin()->time());
+  }
+  if (time == 0) {
+    return;
+  }
+  DEBUG("writing " << off_cpu_intervals.size() << " off-CPU intervals, "
+                   << timeslice_message.memory_samples_size()
+                   << " memory samples and "
+                   << timeslice_message.branch_stacks_size()
+                   << " branch stacks of thread " << info.tid
+                   << " without a timeslice");
+
+  timeslice_message.set_cpu_time(time);
+  timeslice_message.set_pid(global->subject_pid);
+  timeslice_message.set_tid(info.tid);
+  if (syms == nullptr) {
+    pending_timeslices.emplace_back();
+    pending_timeslice &pending = pending_timeslices.back();
+    pending.timeslice.Swap(&timeslice_message);
+    pending.off_cpu_intervals.swap(off_cpu_intervals);
+    return;
+  }
+  add_off_cpu_intervals(&timeslice_message, off_cpu_intervals, *syms);
+  classify_memory_samples(&timeslice_message, *syms);
+  add_branch_symbols(&timeslice_message, *syms);
+  serialize_delimited(timeslice_message);
+}
+
 bool process_sample_record(
     const sample_record &sample,  // const sample_record_callchain &callchain,
-    const perf_fd_info &info, bg_reading *rapl_reading,
-    bg_reading *wattsup_reading, const map<uint64_t, kernel_sym> &kernel_syms,
-    const map<interval, std::shared_ptr<line>, cmpByInterval> &ranges,
-    const map<interval, string, cmpByInterval> &sym_map) {
-  // note: kernel_syms needs to be passed by reference (a pointer would work
-  // too) because otherwise it's copied and can slow down the has_next_sample
-  // loop, causing it to never return to epoll
+    const perf_fd_info &info, const user_stack *stack,
+    const symbol_index *syms) {
+  // note: syms needs to be passed by pointer (a reference would work too)
+  // because otherwise it's copied and can slow down the has_next_sample loop,
+  // causing it to never return to epoll
   ssize_t count;
 
   uint64_t num_timer_ticks = 0;
@@ -537,180 +1385,337 @@ bool process_sample_record(
   timeslice_message.set_num_cpu_timer_ticks(num_timer_ticks);
   timeslice_message.set_pid(sample.pid);
   timeslice_message.set_tid(sample.tid);
+  timeslice_message.set_cpu(sample.cpu);
+  timeslice_message.set_numa_node(
+      sample.cpu < cpu_nodes.size() ? cpu_nodes[sample.cpu] : -1);
+  timeslice_message.set_package(
+      sample.cpu < cpu_packages.size() ? cpu_packages[sample.cpu] : -1);
+  if (sample.cpu < cpu_core_types.size() && cpu_core_types[sample.cpu] != -1) {
+    timeslice_message.set_core_type(
+        core_pmus()[cpu_core_types[sample.cpu]].name);
+  }
 
   DEBUG("reading from each fd");
 
+  event_schedule &schedule = event_schedules[info.cpu_clock_fd];
   auto event_map = timeslice_message.mutable_events();
   for (int i = 0; i < global->events_size; i++) {
     const char *event = global->events[i];
+    size_t group = global->event_groups[i];
+    if (group != ALL_EVENT_GROUPS && group != schedule.active_group) {
+      continue;
+    }
 
-    uint64_t result = 0;
-    DEBUG("reading from fd " << info.event_fds.at(event));
-    if ((count = read(info.event_fds.at(event), &result, sizeof(int64_t))) !=
-        sizeof(int64_t)) {
-      PARENT_SHUTDOWN_PERROR(
-          INTERNAL_ERROR,
-          "count bytes " << count << " != expected count " << sizeof(int64_t));
+    // on hybrid CPUs the thread only ran on one kind of core at a time, so
+    // the counts from each kind's fd add up, as do the times they ran. The
+    // times enabled are the same for each
+    const vector<int> &event_fds = info.event_fds.at(event);
+    event_reading merged{};
+    for (int event_fd : event_fds) {
+      event_reading result{};
+      DEBUG("reading from fd " << event_fd);
+      if ((count = read(event_fd, &result, sizeof(result))) !=
+          sizeof(result)) {
+        PARENT_SHUTDOWN_PERROR(INTERNAL_ERROR,
+                               "count bytes " << count << " != expected count "
+                                              << sizeof(result));
+      }
+      DEBUG("read in from fd " << event_fd << " result " << result.value);
+      merged.value += result.value;
+      merged.time_running += result.time_running;
+      merged.time_enabled = std::max(merged.time_enabled, result.time_enabled);
+    }
+
+    (*event_map)[event] =
+        scale_count(merged, &schedule.last_times[event_fds.front()]);
+  }
+  // only reset once everything's been read, since resetting the slots counter
+  // also resets the topdown metrics
+  for (const auto &entry : *event_map) {
+    for (int event_fd : info.event_fds.at(entry.first)) {
+      if (reset_monitoring(event_fd) != SAMPLER_MONITOR_SUCCESS) {
+        PARENT_SHUTDOWN_MSG(INTERNAL_ERROR,
+                            "couldn't reset monitoring for " << event_fd);
+      }
     }
-    DEBUG("read in from fd " << info.event_fds.at(event) << " result "
-                             << result);
-    if (reset_monitoring(info.event_fds.at(event)) != SAMPLER_MONITOR_SUCCESS) {
-      PARENT_SHUTDOWN_MSG(INTERNAL_ERROR, "couldn't reset monitoring for "
-                                              << info.event_fds.at(event));
+  }
+  timeslice_message.set_event_group(schedule.active_group);
+  if (preset_enabled("topdown")) {
+    add_topdown_metrics(&timeslice_message);
+  }
+  rotate_event_group(info, &schedule);
+
+  if (base_frequency != 0) {
+    auto aperf = event_map->find(APERF_EVENT),
+         mperf = event_map->find(MPERF_EVENT);
+    if (aperf != event_map->end() && mperf != event_map->end() &&
+        mperf->second != 0) {
+      timeslice_message.set_frequency(base_frequency * aperf->second /
+                                      mperf->second);
     }
+  }
 
-    (*event_map)[event] = result;
+  if (membw_counting) {
+    read_membw_counters(sample.time);
+    auto last_sample = last_sample_times.find(info.cpu_clock_fd);
+    if (last_sample != last_sample_times.end()) {
+      add_membw(&timeslice_message, last_sample->second, sample.time);
+    }
+    last_sample_times[info.cpu_clock_fd] = sample.time;
+    // keep the intervals that any thread's next timeslice could overlap, but
+    // not further back than MEMBW_HISTORY, or one thread that stays blocked
+    // would keep every interval for the rest of the run
+    uint64_t oldest = sample.time;
+    for (const auto &entry : last_sample_times) {
+      oldest = std::min(oldest, entry.second);
+    }
+    if (sample.time - oldest > MEMBW_HISTORY) {
+      oldest = sample.time - MEMBW_HISTORY;
+    }
+    trim_membw_intervals(oldest);
   }
 
   // rapl
-  if (rapl_reading->running) {
-    DEBUG("checking for RAPL energy results");
-    if (has_result(rapl_reading)) {
-      DEBUG("RAPL result found, writing out");
-      void *raw_result = get_result(rapl_reading);
-      if (raw_result == nullptr) {
-        DEBUG_CRITICAL("RAPL result was null");
-      } else {
-        map<string, uint64_t> *nrg =
-            (static_cast<map<string, uint64_t> *>(raw_result));
-        for (auto &p : *nrg) {
-          (*event_map)[p.first] = p.second;
-        }
-        delete nrg;
-        DEBUG("restarting RAPL energy readings");
-        restart_reading(rapl_reading);
-      }
-    } else {
-      DEBUG_CRITICAL("no RAPL result available");
+  map<string, uint64_t> energy;
+  if (rapl_counting) {
+    read_rapl_counters(&energy);
+  } else if (energy_sampling_started && !energy_at(sample.time, &energy)) {
+    DEBUG_CRITICAL("no RAPL energy readings yet");
+  }
+
+  if (!energy.empty()) {
+    for (const auto &p : energy) {
+      (*event_map)[p.first] = p.second;
     }
+    // every package's energy is in the events, but only the one the sample
+    // was taken on is attributed to the timeslice
+    add_package_energy(&timeslice_message, energy, timeslice_message.package(),
+                       &last_energy_readings[info.cpu_clock_fd]);
   }
 
-  // wattsup
-  if (wattsup_reading->running) {
-    DEBUG("checking for wattsup energy results");
-    if (has_result(wattsup_reading)) {
-      DEBUG("wattsup result found, writing out");
-      void *raw_result = get_result(wattsup_reading);
-      if (raw_result == nullptr) {
-        DEBUG_CRITICAL("wattsup result was null");
-      } else {
-        double *ret = (static_cast<double *>(raw_result));
-        (*event_map)["wattsup"] = *ret;
-        delete ret;
-        DEBUG_CRITICAL("restarting wattsup energy readings");
-        restart_reading(wattsup_reading);
-      }
-    } else {
-      DEBUG_CRITICAL("no wattsup result available");
+  // wattsup, the latest reading as of the sample
+  for (auto it = wattsup_readings.rbegin(); it != wattsup_readings.rend();
+       ++it) {
+    if (it->time <= sample.time) {
+      (*event_map)["wattsup"] = it->watts;
+      break;
     }
   }
 
-  perf_callchain_context callchain_section = PERF_CONTEXT_KERNEL;
-  DEBUG("looking up " << sample.num_instruction_pointers << " inst ptrs");
-  for (uint64_t i = 0; i < sample.num_instruction_pointers; i++) {
-    auto inst_ptr =
-        static_cast<perf_callchain_context>(sample.instruction_pointers[i]);
-    if (is_callchain_marker(inst_ptr)) {
-      callchain_section = inst_ptr;
-      continue;
+  auto memory_samples = pending_memory_samples.find(info.cpu_clock_fd);
+  if (memory_samples != pending_memory_samples.end()) {
+    DEBUG("adding " << memory_samples->second.size() << " memory samples");
+    timeslice_message.mutable_memory_samples()->Swap(&memory_samples->second);
+  }
+  auto branch_stacks = pending_branch_stacks.find(info.cpu_clock_fd);
+  if (branch_stacks != pending_branch_stacks.end()) {
+    DEBUG("adding " << branch_stacks->second.size() << " branch stacks");
+    timeslice_message.mutable_branch_stacks()->Swap(&branch_stacks->second);
+  }
+  vector<off_cpu_interval> off_cpu_intervals;
+  auto pending_intervals = pending_off_cpu_intervals.find(info.cpu_clock_fd);
+  if (pending_intervals != pending_off_cpu_intervals.end()) {
+    DEBUG("adding " << pending_intervals->second.size()
+                    << " off-CPU intervals");
+    off_cpu_intervals.swap(pending_intervals->second);
+  }
+
+  uint64_t num_instruction_pointers =
+      std::min<uint64_t>(sample.num_instruction_pointers,
+                         sizeof(sample.instruction_pointers) / sizeof(uint64_t));
+  if (syms == nullptr) {
+    DEBUG("symbol index not ready, deferring stack frames");
+    pending_timeslices.emplace_back();
+    pending_timeslice &pending = pending_timeslices.back();
+    pending.timeslice.Swap(&timeslice_message);
+    pending.callchain.assign(
+        sample.instruction_pointers,
+        sample.instruction_pointers + num_instruction_pointers);
+    if (stack != nullptr) {
+      pending.stack = *stack;
     }
-    DEBUG("on instruction pointer " << int_to_hex(inst_ptr) << " (" << (i + 1)
-                                    << "/" << sample.num_instruction_pointers
-                                    << ")");
+    pending.off_cpu_intervals.swap(off_cpu_intervals);
+    return false;
+  }
 
-    StackFrame *stack_frame = timeslice_message.add_stack_frames();
+  if (stack != nullptr) {
+    vector<uint64_t> callchain =
+        unwind_callchain(sample.instruction_pointers, num_instruction_pointers,
+                         *stack, *syms);
+    add_stack_frames(&timeslice_message, callchain.data(), callchain.size(),
+                     *syms);
+  } else {
+    add_stack_frames(&timeslice_message, sample.instruction_pointers,
+                     num_instruction_pointers, *syms);
+  }
+  add_off_cpu_intervals(&timeslice_message, off_cpu_intervals, *syms);
+  classify_memory_samples(&timeslice_message, *syms);
+  add_branch_symbols(&timeslice_message, *syms);
 
-    stack_frame->set_section(callchain_enum(callchain_section));
+  serialize_delimited(timeslice_message);
 
-    string sym_name_str;
-    DEBUG("looking up symbol for inst ptr " << ptr_fmt((void *)inst_ptr));
-    if (callchain_section == PERF_CONTEXT_USER) {
-      DEBUG("looking up user stack frame");
-      Dl_info info;
-      // Lookup the name of the function given the function
-      // pointer
-      if (dladdr(reinterpret_cast<void *>(inst_ptr), &info) != 0) {
-        stack_frame->set_file_name(info.dli_fname);
-        stack_frame->set_file_base(reinterpret_cast<uint64_t>(info.dli_fbase));
-      } else {
-        DEBUG("could not look up user stack frame");
-      }
-    } else if (callchain_section == PERF_CONTEXT_KERNEL) {
-      DEBUG("looking up kernel stack frame");
-      uint64_t addr = lookup_kernel_addr(kernel_syms, inst_ptr);
-      if (addr != -1) {
-        const auto &ks = kernel_syms.at(addr);
-        sym_name_str = ks.sym;
-      }
-    }
+  return false;
+}
 
-    // Need to subtract one. PC is the return address, but we're
-    // looking for the callsite.
-    ::dwarf::taddr pc = inst_ptr - 1;
+/*
+ * Holds on to a memory sample until its thread's next timeslice is written, or
+ * until too many are waiting for it. Unlike the cpu clock's samples, every one
+ * of these is kept, since each is a different load.
+ */
+void process_memory_sample_record(const memory_sample_record &sample,
+                                  const perf_fd_info &info,
+                                  const symbol_index *syms) {
+  RepeatedPtrField<MemorySample> &samples =
+      pending_memory_samples[info.cpu_clock_fd];
+  MemorySample *sample_message = samples.Add();
+  sample_message->set_time(sample.time);
+  sample_message->set_ip(sample.ip);
+  sample_message->set_addr(sample.addr);
+  sample_message->set_latency(sample.weight);
+  sample_message->set_data_src(sample.data_src);
+  decode_data_src(sample_message);
+  if (static_cast<size_t>(samples.size()) >= MEMORY_SAMPLE_MAX_PENDING) {
+    write_pending_records(info, syms);
+  }
+}
 
-    // Get the sym name
-    if (sym_name_str.empty()) {
-      DEBUG("looking up function symbol");
-      auto upper_sym = sym_map.upper_bound(interval(pc, pc));
-      if (upper_sym != sym_map.begin()) {
-        --upper_sym;
-        if (upper_sym->first.contains(pc)) {
-          sym_name_str = upper_sym->second;
-        } else {
-          DEBUG("cannot find function symbol");
-        }
-      }
-    }
+/*
+ * Holds on to a branch stack until its thread's next timeslice is written.
+ */
+void process_branch_sample_record(const branch_sample_record &sample,
+                                  const perf_fd_info &info) {
+  BranchStack *stack_message = pending_branch_stacks[info.cpu_clock_fd].Add();
+  stack_message->set_time(sample.time);
+  uint64_t num_branches =
+      std::min<uint64_t>(sample.num_branches, BRANCH_STACK_MAX_ENTRIES);
+  for (uint64_t i = 0; i < num_branches; i++) {
+    const perf_branch_entry &entry = sample.branches[i];
+    Branch *branch_message = stack_message->add_branches();
+    branch_message->set_from_ip(entry.from);
+    branch_message->set_to_ip(entry.to);
+    branch_message->set_mispredicted(entry.mispred);
+    branch_message->set_cycles(entry.cycles);
+  }
+}
 
-    size_t line = -1;
+/*
+ * Remembers where the thread was switched out, for the off-CPU interval that
+ * ends when it's switched back in.
+ */
+void process_off_cpu_sample_record(const sample_record &sample,
+                                   const perf_fd_info &info) {
+  uint64_t num_instruction_pointers =
+      std::min<uint64_t>(sample.num_instruction_pointers,
+                         sizeof(sample.instruction_pointers) / sizeof(uint64_t));
+  off_cpu_states[info.cpu_clock_fd].callchain.assign(
+      sample.instruction_pointers,
+      sample.instruction_pointers + num_instruction_pointers);
+}
 
-    // Get the line full location
-    DEBUG("looking up line location");
-    auto upper_range = ranges.upper_bound(interval(pc, pc));
-    if (upper_range != ranges.begin()) {
-      --upper_range;
-      if (upper_range->first.contains(pc)) {
-        DEBUG("line is " << upper_range->second);
-        line = upper_range->second.get()->get_line();
-        stack_frame->set_full_location(
-            upper_range->second.get()->get_file()->get_name().c_str());
-      } else {
-        DEBUG("cannot find line location");
-      }
+/*
+ * Starts an off-CPU interval when the thread is switched out, and holds on to
+ * it until the thread's next timeslice once it's switched back in.
+ */
+void process_switch_record(const switch_record &record, int misc,
+                           const perf_fd_info &info,
+                           const symbol_index *syms) {
+  off_cpu_state &state = off_cpu_states[info.cpu_clock_fd];
+  if ((misc & PERF_RECORD_MISC_SWITCH_OUT) != 0) {
+    state.switch_out_time = record.sample_id.time;
+#ifdef PERF_RECORD_MISC_SWITCH_OUT_PREEMPT
+    state.preempted = (misc & PERF_RECORD_MISC_SWITCH_OUT_PREEMPT) != 0;
+#endif
+  } else if (state.switch_out_time != 0) {
+    vector<off_cpu_interval> &intervals =
+        pending_off_cpu_intervals[info.cpu_clock_fd];
+    intervals.push_back({state.switch_out_time, record.sample_id.time,
+                         state.preempted, std::move(state.callchain)});
+    state = off_cpu_state();
+    // a thread that's mostly blocked may not run long enough for the cpu
+    // clock to fire for a long time
+    if (intervals.size() >= OFF_CPU_MAX_PENDING) {
+      write_pending_records(info, syms);
     }
+  } else {
+    DEBUG("thread " << info.tid << " switched in without switching out");
+  }
+}
 
-    // https://gcc.gnu.org/onlinedocs/libstdc++/libstdc++-html-USERS-4.3/a01696.html
-    if (!sym_name_str.empty()) {
-      DEBUG("demangling symbol name");
-      int demangle_status;
-      char *demangled_name = abi::__cxa_demangle(sym_name_str.c_str(), nullptr,
-                                                 nullptr, &demangle_status);
-      if (demangle_status == 0) {
-        stack_frame->set_symbol(demangled_name);
-        free(demangled_name);  // NOLINT
-      } else {
-        stack_frame->set_symbol(sym_name_str);
-
-        if (demangle_status == -1) {
-          PARENT_SHUTDOWN_MSG(INTERNAL_ERROR,
-                              "demangling errored due to memory allocation");
-        } else if (demangle_status == -2) {
-          DEBUG("could not demangle name " << sym_name_str);
-        } else if (demangle_status == -3) {
-          PARENT_SHUTDOWN_MSG(INTERNAL_ERROR,
-                              "demangling errored due to invalid arguments");
-        }
-      }
-    }
+/*
+ * Copies a sample from one of the samplers out of the buffer and processes it
+ * according to which sampler it's from.
+ */
+void process_sampler_record(const string &sampler, void *perf_result,
+                            int data_size, uintptr_t data_start,
+                            uintptr_t data_end, const perf_fd_info &info,
+                            const symbol_index *syms) {
+  if (sampler == "memory") {
+    memory_sample_record local_sample{};
+    copy_record_to_stack(perf_result, reinterpret_cast<void *>(&local_sample),
+                         std::min<int>(sizeof(local_sample), data_size),
+                         data_start, data_end);
+    process_memory_sample_record(local_sample, info, syms);
+  } else if (sampler == "lbr") {
+    branch_sample_record local_sample{};
+    // the branch stack makes this record variable length
+    copy_record_to_stack(perf_result, reinterpret_cast<void *>(&local_sample),
+                         std::min<int>(sizeof(local_sample), data_size),
+                         data_start, data_end);
+    process_branch_sample_record(local_sample, info);
+  } else if (sampler == "offcpu") {
+    sample_record local_sample{};
+    // the callchain makes this record variable length
+    copy_record_to_stack(perf_result, reinterpret_cast<void *>(&local_sample),
+                         std::min<int>(sizeof(local_sample), data_size),
+                         data_start, data_end);
+    process_off_cpu_sample_record(local_sample, info);
+  }
+}
 
-    if (line != -1) {
-      stack_frame->set_line(line);
-    }
+/*
+ * Queues a new executable mapping to be added to the symbol index.
+ */
+void process_mmap_record(const mmap2_record &mmap) {
+  if ((mmap.prot & PROT_EXEC) == 0 || mmap.filename[0] != '/') {
+    DEBUG("ignoring mapping of " << mmap.filename);
+    return;
   }
+  DEBUG("new executable mapping of " << mmap.filename << " at "
+                                     << ptr_fmt(mmap.addr));
+  std::lock_guard<std::mutex> lock(mapping_updates.mtx);
+  mapping_updates.queued.emplace_back(
+      interval(mmap.addr, mmap.addr + mmap.len),
+      mapped_file{mmap.filename, mmap.addr - mmap.pgoff});
+}
 
-  serialize_delimited(timeslice_message);
+/*
+ * Swaps in the symbol index built by the update thread, if it's finished, and
+ * starts another update if new mappings have been queued since. Returns the
+ * index to use from now on.
+ */
+symbol_index *publish_symbol_updates(symbol_index *syms,
+                                     bg_reading *update_reading) {
+  if (symbol_update_running && has_result(update_reading)) {
+    auto *updated = static_cast<symbol_index *>(get_result(update_reading));
+    symbol_update_running = false;
+    if (updated != nullptr) {
+      DEBUG("publishing updated symbol index");
+      // this thread is the only reader, so nothing else can still be using
+      // the old index
+      delete syms;
+      syms = updated;
+    }
+  }
 
-  return false;
+  if (!symbol_update_running) {
+    std::lock_guard<std::mutex> lock(mapping_updates.mtx);
+    if (!mapping_updates.queued.empty()) {
+      DEBUG("starting symbol index update");
+      symbol_update_running = true;
+      restart_reading(update_reading);
+    }
+  }
+  return syms;
 }
 
 void process_lost_record(const lost_record &lost, vector<Warning> *warnings) {
@@ -729,7 +1734,26 @@ void process_lost_record(const lost_record &lost, vector<Warning> *warnings) {
   warnings->emplace_back(warning_message);
 }
 
+/*
+ * Writes the header if it hasn't been already. It waits for the symbol index
+ * so it can say how big the line tables are, which doesn't hold anything up
+ * since timeslices aren't written before then either. syms is nullptr if the
+ * collector stops before the index is built.
+ */
+void serialize_header(const symbol_index *syms) {
+  if (header_written) {
+    return;
+  }
+  if (syms != nullptr) {
+    header_message.set_line_table_bytes(syms->line_table_bytes());
+  }
+  DEBUG("writing result header");
+  serialize_delimited(header_message);
+  header_written = true;
+}
+
 void serialize_footer() {
+  serialize_header(nullptr);
   DEBUG("serializing footer");
   OstreamOutputStream ostream(result_file);
   CodedOutputStream coded(&ostream);
@@ -760,28 +1784,31 @@ void set_preset_events(Map<string, PresetEvents> *preset_map) {
   }
 }
 
-void setup_collect_perf_data(int sigt_fd, int socket, const int &wu_fd,
+void setup_collect_perf_data(int sigt_fd, int socket, int *wu_fd,
                              ofstream *res_file, int argc, char **argv,
-                             const string &program_input,
-                             bg_reading *rapl_reading,
-                             bg_reading *wattsup_reading) {
+                             const string &program_input) {
   result_file = res_file;
 
   DEBUG("registering " << sigt_fd << " as sigterm fd");
   add_fd_to_epoll(sigt_fd);
 
-  DEBUG("registering socket " << socket);
-  add_fd_to_epoll(socket);
+  if (socket != -1) {
+    DEBUG("registering socket " << socket);
+    add_fd_to_epoll(socket);
+  }
 
-  DEBUG("setting up perf events for main thread in subject");
-  perf_fd_info subject_info = setup_perf_events(global->subject_pid);
-  DEBUG("main thread registered with fd " << subject_info.cpu_clock_fd);
-  setup_buffer(&subject_info);
-  handle_perf_register(&subject_info);
+  if (global->attached) {
+    DEBUG("setting up perf events for every thread in subject");
+    register_attached_threads();
+    if (perf_info_mappings.empty()) {
+      PARENT_SHUTDOWN_MSG(INTERNAL_ERROR, "subject exited before attaching");
+    }
+  } else {
+    DEBUG("setting up perf events for main thread in subject");
+    register_thread(global->subject_pid);
+  }
 
-  // write the header
-  DEBUG("writing result header");
-  Header header_message;
+  // the header is written by serialize_header
   header_message.set_program_name(argv[0]);
   header_message.set_program_version(VERSION);
   header_message.set_program_input(program_input);
@@ -797,41 +1824,85 @@ void setup_collect_perf_data(int sigt_fd, int socket, const int &wu_fd,
 
   set_preset_events(header_message.mutable_presets());
 
-  serialize_delimited(header_message);
+  for (size_t group = 0; group < global->num_event_groups; group++) {
+    EventList *group_message = header_message.add_event_groups();
+    for (int i = 0; i < global->events_size; i++) {
+      if (global->event_groups[i] == group) {
+        group_message->add_events(global->events[i]);
+      }
+    }
+  }
+
+  cpu_nodes = read_cpu_nodes();
+  cpu_packages = read_cpu_packages();
+  cpu_core_types = read_cpu_core_types();
+  for (const auto &pmu : core_pmus()) {
+    header_message.add_core_types(pmu.name);
+  }
+  if (preset_enabled("frequency")) {
+    base_frequency = read_base_frequency();
+    header_message.set_base_frequency(base_frequency);
+  }
 
-  // setting up RAPL energy reading
+  if (preset_enabled("membw")) {
+    membw_counting = open_membw_counters();
+    if (!membw_counting) {
+      DEBUG_CRITICAL("couldn't open any memory controller events, is "
+                     "perf_event_paranoid above 0?");
+    }
+  }
+
+  // setting up RAPL energy reading, through the power PMU if possible since
+  // reading it is cheap enough to do with every sample. Otherwise the sysfs
+  // zones are read at a fixed rate and interpolated at each sample's time
   if (preset_enabled("rapl")) {
-    setup_reading(rapl_reading,
-                  [](void *_) -> void * {
-                    auto m = new map<string, uint64_t>;
-                    measure_energy_into_map(m);
-                    return m;
-                  },
-                  nullptr);
-    DEBUG("rapl reading in tid " << rapl_reading->thread);
+    rapl_counting = open_rapl_counters();
+  }
+  if (rapl_counting) {
+    DEBUG("reading RAPL energy from the " POWER_PMU " PMU");
+  } else if (preset_enabled("rapl") && open_energy_zones()) {
+    energy_sampling_started = start_energy_sampler(global->energy_interval);
+    if (!energy_sampling_started) {
+      DEBUG_CRITICAL("couldn't start the energy sampler, RAPL energy won't be "
+                     "recorded");
+    }
+  } else if (preset_enabled("rapl")) {
+    DEBUG_CRITICAL("couldn't read RAPL energy from the " POWER_PMU
+                   " PMU or sysfs");
   } else {
     DEBUG_CRITICAL("RAPL preset not enabled");
   }
 
-  // setting up wattsup energy reading
-  if (wu_fd != -1) {
-    setup_reading(wattsup_reading,
-                  [](void *raw_args) -> void * {
-                    int wu_fd_fn = (static_cast<int *>(raw_args))[0];
-                    // NOLINTNEXTLINE(misc-lambda-function-name)
-                    DEBUG("wu fd inside function is " << wu_fd_fn);
-                    auto d = new double;
-                    *d = wu_read(wu_fd_fn);
-                    return d;
-                  },
-                  const_cast<int *>(&wu_fd));
-    DEBUG("wattsup reading in tid " << wattsup_reading->thread);
-    DEBUG("wattsup fd is " << wu_fd);
+  // setting up wattsup energy reading, the meter's frames are read as they
+  // arrive along with the samples
+  if (*wu_fd != -1) {
+    DEBUG("wattsup fd is " << *wu_fd);
+    wattsup_fd = wu_fd;
+    add_fd_to_epoll(*wattsup_fd);
+  } else if (preset_enabled("wattsup")) {
+    DEBUG_CRITICAL("wattsup couldn't open device, skipping setup");
   } else {
-    if (preset_enabled("wattsup")) {
-      DEBUG_CRITICAL("wattsup preset not enabled");
-    } else {
-      DEBUG_CRITICAL("wattsup couldn't open device, skipping setup");
+    DEBUG_CRITICAL("wattsup preset not enabled");
+  }
+}
+
+/*
+ * Reads the frames the WattsUp meter has sent since it was last ready.
+ */
+void handle_wattsup_ready() {
+  vector<wu_reading> readings;
+  if (!wu_read(*wattsup_fd, &wattsup_parser, &readings)) {
+    DEBUG_CRITICAL("lost the wattsup device, no more power readings");
+    delete_fd_from_epoll(*wattsup_fd);
+    // there's nothing left to send the stop command to
+    close(*wattsup_fd);
+    *wattsup_fd = -1;
+    wattsup_fd = nullptr;
+  }
+  for (const auto &reading : readings) {
+    wattsup_readings.push_back(reading);
+    if (wattsup_readings.size() > WU_HISTORY) {
+      wattsup_readings.pop_front();
     }
   }
 }
@@ -840,19 +1911,18 @@ void setup_collect_perf_data(int sigt_fd, int socket, const int &wu_fd,
  * Sets up the required events and records performance of subject process into
  * result file.
  */
-int collect_perf_data(
-    const map<uint64_t, kernel_sym> &kernel_syms, int sigt_fd, int socket,
-    bg_reading *rapl_reading, bg_reading *wattsup_reading,
-    const std::map<interval, string, cmpByInterval> &sym_map,
-    const std::map<interval, std::shared_ptr<line>, cmpByInterval> &ranges) {
+int collect_perf_data(int sigt_fd, int socket, bg_reading *symbol_reading) {
   bool done = false;
   int sample_period_skips = 0;
+  // null until the background thread finishes building it
+  symbol_index *syms = nullptr;
+  bg_reading update_reading{nullptr};
+  if (!setup_reading(&update_reading, update_symbol_index, &mapping_updates)) {
+    PARENT_SHUTDOWN_MSG(INTERNAL_ERROR, "couldn't start symbol update thread");
+  }
 
   size_t last_ts = time_ms(), finish_ts = last_ts, curr_ts = 0;
 
-  restart_reading(rapl_reading);
-  restart_reading(wattsup_reading);
-
   DEBUG_CRITICAL("entering epoll ready loop");
   while (!done) {
     auto evlist = new epoll_event[sample_fd_count];
@@ -873,15 +1943,29 @@ int collect_perf_data(
     }
     last_ts = curr_ts;
 
+    if (syms == nullptr && has_result(symbol_reading)) {
+      syms = static_cast<symbol_index *>(get_result(symbol_reading));
+      serialize_header(syms);
+      flush_pending_timeslices(*syms);
+    }
+    if (syms != nullptr) {
+      syms = publish_symbol_updates(syms, &update_reading);
+    }
+
     if (ready_fds == 0) {
       DEBUG_CRITICAL("no sample fds were ready within the timeout ("
                      << SAMPLE_EPOLL_TIMEOUT << ")");
     } else {
       DEBUG("" << ready_fds << " sample fds were ready");
 
-      if (!check_priority_fds(evlist, ready_fds, sigt_fd, socket, &done)) {
+      if (!check_priority_fds(evlist, ready_fds, sigt_fd, socket, syms,
+                              &done)) {
         for (int i = 0; i < ready_fds; i++) {
           const auto fd = evlist[i].data.fd;
+          if (wattsup_fd != nullptr && fd == *wattsup_fd) {
+            handle_wattsup_ready();
+            continue;
+          }
           DEBUG("perf fd " << fd << " is ready");
 
           perf_fd_info info;
@@ -906,6 +1990,7 @@ int collect_perf_data(
             sample_period_skips = 0;
 
             bool is_first_sample = true;
+            bool thread_exited = false;
             uintptr_t data_start =
                           reinterpret_cast<uintptr_t>(info.sample_buf.data),
                       data_end = data_start + info.sample_buf.info->data_size;
@@ -917,12 +2002,14 @@ int collect_perf_data(
                  has_next_record(&info.sample_buf) && i < MAX_RECORD_READS;
                  i++) {
               DEBUG("getting next record");
-              int record_type, record_size;
-              void *perf_result = (get_next_record(&info.sample_buf,
-                                                   &record_type, &record_size));
+              int record_type, record_size, record_misc;
+              void *perf_result =
+                  (get_next_record(&info.sample_buf, &record_type,
+                                   &record_size, &record_misc));
 
               // record_size is not entirely accurate, since our version of the
               // structs generally have different contents
+              int data_size = record_size - sizeof(perf_event_header);
               record_size = get_record_size(record_type);
               if (record_size == -1) {
                 DEBUG_CRITICAL("record type is not supported ("
@@ -940,18 +2027,44 @@ int collect_perf_data(
                                        reinterpret_cast<void *>(&local_result),
                                        record_size, data_start, data_end);
 
-                  process_throttle_record(local_result, record_type, &warnings);
+                  if (info.sampler_ids.count(local_result.id) != 0) {
+                    // the period only applies to the cpu clock
+                    DEBUG_CRITICAL(info.sampler_ids.at(local_result.id)
+                                   << " sampler was throttled");
+                  } else {
+                    process_throttle_record(local_result, record_type,
+                                            &warnings);
+                  }
                 } else if (record_type == PERF_RECORD_SAMPLE) {
-                  if (is_first_sample) {
+                  // samplers write into the same buffer, so check whose
+                  // sample this is by its leading identifier
+                  uint64_t sample_id = 0;
+                  if (!info.sampler_ids.empty()) {
+                    copy_record_to_stack(perf_result, &sample_id,
+                                         sizeof(sample_id), data_start,
+                                         data_end);
+                  }
+                  if (info.sampler_ids.count(sample_id) != 0) {
+                    process_sampler_record(info.sampler_ids.at(sample_id),
+                                           perf_result, data_size, data_start,
+                                           data_end, info, syms);
+                  } else if (is_first_sample) {
                     sample_record local_sample{};
                     copy_record_to_stack(
                         perf_result, reinterpret_cast<void *>(&local_sample),
                         record_size, data_start, data_end);
 
+                    user_stack stack;
+                    if (global->dwarf_unwind &&
+                        !read_user_stack(perf_result, data_size, data_start,
+                                         data_end, &stack)) {
+                      DEBUG_CRITICAL("sample was too short for its user stack");
+                    }
+
                     // is reset to true if the timeslice was skipped, else false
                     is_first_sample = process_sample_record(
-                        local_sample, info, rapl_reading, wattsup_reading,
-                        kernel_syms, ranges, sym_map);
+                        local_sample, info,
+                        global->dwarf_unwind ? &stack : nullptr, syms);
                   } else {
                     DEBUG("not first sample, skipping");
                   }
@@ -961,6 +2074,42 @@ int collect_perf_data(
                                        reinterpret_cast<void *>(&local_result),
                                        record_size, data_start, data_end);
                   process_lost_record(local_result, &warnings);
+                } else if (record_type == PERF_RECORD_MMAP2) {
+                  mmap2_record local_result{};
+                  // the filename makes this record variable length
+                  copy_record_to_stack(
+                      perf_result, reinterpret_cast<void *>(&local_result),
+                      std::min<int>(record_size, data_size), data_start,
+                      data_end);
+                  local_result.filename[sizeof(local_result.filename) - 1] =
+                      '\0';
+                  process_mmap_record(local_result);
+                } else if (record_type == PERF_RECORD_SWITCH) {
+                  switch_record local_result{};
+                  copy_record_to_stack(perf_result,
+                                       reinterpret_cast<void *>(&local_result),
+                                       record_size, data_start, data_end);
+                  process_switch_record(local_result, record_misc, info,
+                                        syms);
+                } else if (record_type == PERF_RECORD_FORK ||
+                           record_type == PERF_RECORD_EXIT) {
+                  task_record local_result{};
+                  copy_record_to_stack(perf_result,
+                                       reinterpret_cast<void *>(&local_result),
+                                       record_size, data_start, data_end);
+                  if (record_type == PERF_RECORD_FORK) {
+                    // only follow new threads, not child processes
+                    if (static_cast<pid_t>(local_result.pid) ==
+                            global->subject_pid &&
+                        !thread_registered(local_result.tid)) {
+                      DEBUG("thread " << local_result.tid << " created");
+                      register_thread(local_result.tid);
+                    }
+                  } else if (static_cast<pid_t>(local_result.tid) ==
+                             info.tid) {
+                    DEBUG("thread " << local_result.tid << " exited");
+                    thread_exited = true;
+                  }
                 } else {
                   DEBUG_CRITICAL("record type was not recognized ("
                                  << record_type_str(record_type) << " "
@@ -974,17 +2123,55 @@ int collect_perf_data(
             } else {
               DEBUG("read through all records");
             }
+            if (thread_exited) {
+              // unregistering unmaps the buffer, so wait until it's been read
+              handle_perf_unregister(new perf_fd_info(info), syms);
+            }
           }
         }
       }
     }
+    if (global->attached && perf_info_mappings.empty()) {
+      DEBUG_CRITICAL("every thread in the attached subject has exited");
+      done = true;
+    }
     finish_ts = time_ms();
     delete[] evlist;
   }
-  DEBUG("stopping RAPL reading thread");
-  stop_reading(rapl_reading);
-  DEBUG("stopping wattsup reading thread");
-  stop_reading(wattsup_reading);
+  if (energy_sampling_started) {
+    DEBUG("stopping energy sampler");
+    stop_energy_sampler();
+  }
+  if (membw_counting) {
+    close_membw_counters();
+  }
+  if (rapl_counting) {
+    close_rapl_counters();
+  } else {
+    close_energy_zones();
+  }
+
+  if (syms == nullptr) {
+    DEBUG_CRITICAL("subject finished before the symbol index was ready");
+    syms = static_cast<symbol_index *>(wait_for_result(symbol_reading));
+    if (syms == nullptr) {
+      PARENT_SHUTDOWN_MSG(INTERNAL_ERROR, "failed to build symbol index");
+    }
+    serialize_header(syms);
+    flush_pending_timeslices(*syms);
+  }
+  // the threads still running won't have another timeslice
+  for (const auto &entry : perf_info_mappings) {
+    write_pending_records(entry.second, syms);
+  }
+  DEBUG("stopping symbol index threads");
+  stop_reading(symbol_reading);
+  stop_reading(&update_reading);
+  if (symbol_update_running) {
+    // the update thread may have finished right before being stopped
+    delete static_cast<symbol_index *>(update_reading.result);
+  }
+  delete syms;
 
   DEBUG("writing warnings");
   serialize_footer();
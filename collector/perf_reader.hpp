@@ -17,6 +17,7 @@
 #include "inspect.hpp"
 #include "perf_sampler.hpp"
 #include "shared.hpp"
+#include "symbols.hpp"
 
 namespace alex {
 
@@ -24,12 +25,6 @@ using std::map;
 using std::ofstream;
 using std::unordered_map;
 
-struct kernel_sym {
-  char type{};
-  string sym;
-  string cat;
-};
-
 struct addr_sym {
   uint64_t high_pc;
   uint64_t low_pc;
@@ -46,17 +41,16 @@ ofstream* get_result_file();
   SHUTDOWN_PERROR(global->subject_pid, *get_result_file(), code, title)
 
 perf_fd_info setup_perf_events(pid_t target);
-void setup_collect_perf_data(int sigt_fd, int socket, const int& wu_fd,
+void setup_collect_perf_data(int sigt_fd, int socket, int* wu_fd,
                              ofstream* res_file, int argc, char** argv,
-                             const string& program_input,
-                             bg_reading* rapl_reading,
-                             bg_reading* wattsup_reading);
-int collect_perf_data(
-    const map<uint64_t, kernel_sym>& kernel_syms, int sigt_fd, int socket,
-    bg_reading* rapl_reading, bg_reading* wattsup_reading,
-    const std::map<interval, string, cmpByInterval>& sym_map,
-    const std::map<interval, std::shared_ptr<line>, cmpByInterval>& ranges);
+                             const string& program_input);
+int collect_perf_data(int sigt_fd, int socket, bg_reading* symbol_reading);
 void serialize_footer();
+/*
+ * Stops and closes the perf events of every thread, used to detach from an
+ * attached subject without disturbing it.
+ */
+void unregister_all_perf_fds();
 
 }  // namespace alex
 
@@ -1,10 +1,15 @@
 #include "perf_sampler.hpp"
+#include <fstream>
+#include <string>
 #include "debug.hpp"
 #include "perf_reader.hpp"
 #include "util.hpp"
 
 namespace alex {
 
+using std::ifstream;
+using std::string;
+
 sampler_result setup_monitoring(perf_buffer *result, perf_event_attr *attr,
                                 int pid = 0) {
   DEBUG("setting up monitoring for pid " << pid);
@@ -35,7 +40,7 @@ sampler_result setup_buffer(perf_fd_info *info) {
   return SAMPLER_MONITOR_SUCCESS;
 }
 
-void *get_next_record(perf_buffer *perf, int *type, int *size) {
+void *get_next_record(perf_buffer *perf, int *type, int *size, int *misc) {
   auto *event_header = reinterpret_cast<perf_event_header *>(
       (static_cast<char *>(perf->data) +
        (perf->info->data_tail % perf->info->data_size)));
@@ -44,6 +49,7 @@ void *get_next_record(perf_buffer *perf, int *type, int *size) {
   perf->info->data_tail += event_header->size;
   *type = event_header->type;
   *size = event_header->size;
+  *misc = event_header->misc;
 
   return event_data;
 }
@@ -95,7 +101,67 @@ sampler_result reset_monitoring(int fd) {
   return SAMPLER_MONITOR_SUCCESS;
 }
 
+/*
+ * Encodes an event named pmu/event/ from the PMU's sysfs directory: its type,
+ * and the terms of the event (eg. "event=0x04,umask=0x03"), each placed in
+ * config, config1, or config2 at the bits given by the PMU's format files.
+ */
+static bool setup_sysfs_event(perf_event_attr *attr, const string &name) {
+  size_t pmu_end = name.find('/');
+  size_t event_end = name.find('/', pmu_end + 1);
+  string pmu_dir = PMU_ROOT + name.substr(0, pmu_end) + "/";
+  string event = name.substr(pmu_end + 1, event_end - pmu_end - 1);
+
+  ifstream type_file(pmu_dir + "type");
+  ifstream event_file(pmu_dir + "events/" + event);
+  string terms;
+  if (!(type_file >> attr->type) || !getline(event_file, terms)) {
+    DEBUG("no event " << event << " in " << pmu_dir);
+    return false;
+  }
+
+  for (const auto &term : str_split_vec(terms, ",")) {
+    size_t eq = term.find('=');
+    string key = term.substr(0, eq);
+    uint64_t value =
+        eq == string::npos ? 1 : stoull(term.substr(eq + 1), nullptr, 0);
+
+    // eg. config:0-7, or config1:8 for a single bit
+    ifstream format_file(pmu_dir + "format/" + key);
+    string format;
+    unsigned int low_bit;
+    if (!getline(format_file, format) ||
+        sscanf(format.c_str() + format.find(':') + 1, "%u", &low_bit) != 1) {
+      DEBUG("unknown format " << key << " for " << name);
+      return false;
+    }
+    string field = format.substr(0, format.find(':'));
+    if (field == "config") {
+      attr->config |= value << low_bit;
+    } else if (field == "config1") {
+      attr->config1 |= value << low_bit;
+    } else if (field == "config2") {
+      attr->config2 |= value << low_bit;
+    } else {
+      DEBUG("unknown format field " << field << " for " << name);
+      return false;
+    }
+  }
+  return true;
+}
+
 int setup_pfm_os_event(perf_event_attr *attr, char *event_name) {
+  if (strchr(event_name, '/') != nullptr) {
+    // libpfm doesn't know about non-core PMUs like msr, so these come straight
+    // from the kernel. Such PMUs generally can't filter by privilege level,
+    // so exclude_kernel is left unset
+    DEBUG("setting up sysfs event " << event_name);
+    attr->size = sizeof(perf_event_attr);
+    attr->disabled = true;
+    return setup_sysfs_event(attr, event_name) ? PFM_SUCCESS
+                                               : PFM_ERR_NOTFOUND;
+  }
+
   DEBUG("setting up pfm os event");
   pfm_perf_encode_arg_t pfm;
   pfm.attr = attr;
@@ -13,6 +13,7 @@
 #include <cstring>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "const.hpp"
 
@@ -28,9 +29,22 @@ struct perf_fd_info {
   int cpu_clock_fd{};
   pid_t tid{};
   perf_buffer sample_buf{};
-  std::map<std::string, int> event_fds;
+  // each event's fds, one for each of its core PMUs on hybrid CPUs (see
+  // event_pmus), otherwise just the one
+  std::map<std::string, std::vector<int>> event_fds;
+  // on hybrid CPUs, the group leader of each core PMU's events, by index in
+  // core_pmus
+  std::vector<int> core_pmu_leader_fds;
+  // events that are sampled on their own, by sampler name, whose records are
+  // redirected into sample_buf
+  std::map<std::string, int> sampler_fds;
+  // the sample ids of the sampler fds, only set once registered in the
+  // collector
+  std::map<uint64_t, std::string> sampler_ids;
 };
 
+#define PMU_ROOT "/sys/bus/event_source/devices/"
+
 enum : size_t { BUFFER_SIZE = ((1 + NUM_DATA_PAGES) * PAGE_SIZE) };
 
 enum sampler_result { SAMPLER_MONITOR_SUCCESS = 0, SAMPLER_MONITOR_ERROR = 1 };
@@ -51,12 +65,16 @@ sampler_result resume_monitoring(int fd);
 /* does the perf_event buffer have any new records? */
 bool has_next_record(perf_buffer *perf);
 
-/* get the next record */
-void *get_next_record(perf_buffer *perf, int *type, int *size);
+/* get the next record, misc is set to the header's misc flags */
+void *get_next_record(perf_buffer *perf, int *type, int *size, int *misc);
 
 /* remove remaining samples */
 void clear_records(perf_buffer *perf);
 
+/*
+ * Encodes event_name into attr with libpfm, or from sysfs for events named
+ * pmu/event/. Returns a PFM_* result either way.
+ */
 int setup_pfm_os_event(perf_event_attr *attr, char *event_name);
 
 }  // namespace alex
@@ -1,7 +1,9 @@
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <algorithm>
 #include <csignal>
 #include <cstdint>
 #include <cstdlib>
@@ -13,7 +15,10 @@
 #include <vector>
 
 #include "debug.hpp"
+#include "perf_sampler.hpp"
 #include "rapl.hpp"
+#include "topology.hpp"
+#include "util.hpp"
 
 namespace alex {
 
@@ -21,43 +26,141 @@ using std::ifstream;
 using std::istringstream;
 using std::pair;
 
-map<string, uint64_t> measure_energy() {
-  map<string, uint64_t> m;
-  measure_energy_into_map(&m);
-  return m;
+// one of the power PMU's energy events counting on one socket
+struct rapl_counter {
+  int fd;
+  // the name of the matching sysfs zone
+  string name;
+  // joules per count, from the event's .scale file
+  double scale;
+  uint64_t last_count;
+  double joules;
+};
+
+vector<rapl_counter> rapl_counters;
+
+// the sysfs zones being read, in the order their readings are written
+vector<energy_zone> energy_zones;
+
+string energy_root() {
+  string root = getenv_safe("COLLECTOR_ENERGY_ROOT", ENERGY_ROOT);
+  if (!root.empty() && root.back() != '/') {
+    root += '/';
+  }
+  return root;
 }
 
-void measure_energy_into_map(map<string, uint64_t> *m) {
-  DEBUG("Measuring energy");
-  vector<string> powerzones = find_in_dir(ENERGY_ROOT, "intel-rapl:");
-  DEBUG("Found " << powerzones.size() << " zones");
+/*
+ * The directories of the packages' zones and their subzones, and each one's
+ * name. The tree doesn't change while the subject runs, so it's only walked
+ * once.
+ */
+static const vector<pair<string, string>> &find_energy_zones() {
+  static vector<pair<string, string>> zones;
+  static bool found = false;
+  if (found) {
+    return zones;
+  }
+  found = true;
+
+  string root = energy_root();
+  vector<string> powerzones = find_in_dir(root, ENERGY_PREFIX ":");
+  std::sort(powerzones.begin(), powerzones.end());
+  DEBUG("Found " << powerzones.size() << " zones in " << root);
   for (auto &zone : powerzones) {
-    DEBUG("Trying zone " << zone);
-    string zonedir = string(ENERGY_ROOT) + "/" + zone + "/";
-    push_energy_info(m, zonedir);
+    string zonedir = root + zone + "/";
+    string name = file_readline(zonedir + ENERGY_NAME);
+    zones.emplace_back(zonedir, name);
     vector<string> subzones = find_in_dir(zonedir, zone);
-    DEBUG("Found " << subzones.size() << " subzones");
+    std::sort(subzones.begin(), subzones.end());
+    DEBUG("Found " << subzones.size() << " subzones of " << zone);
     for (auto &sub : subzones) {
-      DEBUG("Trying subzone " << sub);
-      push_energy_info(m, zonedir + sub + "/");
+      string subdir = zonedir + sub + "/";
+      zones.emplace_back(subdir,
+                         name + "/" + file_readline(subdir + ENERGY_NAME));
+    }
+  }
+  return zones;
+}
+
+/*
+ * Reads a counter file that's kept open from its start, returning false if it
+ * doesn't hold a number.
+ */
+static bool pread_counter(int fd, uint64_t *value) {
+  char buf[32];
+  ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (n <= 0) {
+    return false;
+  }
+  buf[n] = '\0';
+  char *end;
+  *value = strtoull(buf, &end, 10);
+  return end != buf;
+}
+
+bool open_energy_zones() {
+  for (const auto &zone : find_energy_zones()) {
+    string path = zone.first + ENERGY_FILE;
+    energy_zone z{};
+    z.name = zone.second;
+    z.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (z.fd == -1 || !pread_counter(z.fd, &z.last_reading)) {
+      // newer kernels only let root read energy_uj
+      DEBUG_CRITICAL("can't read " << path << ": " << strerror(errno));
+      if (z.fd != -1) {
+        close(z.fd);
+      }
+      continue;
     }
+    istringstream(file_readline(zone.first + ENERGY_RANGE_FILE)) >>
+        z.max_range;
+    // start from the raw reading, so the values are energy_uj's until it first
+    // wraps
+    z.energy = z.last_reading;
+    DEBUG("opened " << path << " (" << z.name << ") as fd " << z.fd);
+    energy_zones.push_back(z);
   }
+  return !energy_zones.empty();
+}
 
-  DEBUG("Finished measuring energy");
+void read_energy_zones(uint64_t *readings) {
+  for (size_t i = 0; i < energy_zones.size(); i++) {
+    energy_zone &z = energy_zones[i];
+    uint64_t value;
+    if (pread_counter(z.fd, &value)) {
+      // the counter goes back to 0 after max_energy_range_uj
+      z.energy += value >= z.last_reading
+                      ? value - z.last_reading
+                      : z.max_range - z.last_reading + value;
+      z.last_reading = value;
+    } else {
+      DEBUG_CRITICAL("couldn't read energy of " << z.name);
+    }
+    readings[i] = z.energy;
+  }
+}
+
+void close_energy_zones() {
+  for (const auto &z : energy_zones) {
+    close(z.fd);
+  }
+  energy_zones.clear();
 }
 
-void push_energy_info(map<string, uint64_t> *readings, const string &dir) {
-  DEBUG("Pushing energy info for " << dir);
-  string name = file_readline(dir + ENERGY_NAME);
-  uint64_t energy;
-  istringstream(file_readline(dir + ENERGY_FILE)) >> energy;
-  DEBUG("Reading for " << name << ": " << energy);
-  readings->insert(make_pair(name, energy));
+bool energy_zones_available() {
+  bool available = open_energy_zones();
+  close_energy_zones();
+  return available;
 }
 
 vector<string> find_in_dir(const string &dir, const string &substr) {
   vector<string> res;
   DIR *dirp = opendir(dir.c_str());
+  if (dirp == nullptr) {
+    DEBUG("couldn't open " << dir);
+    return res;
+  }
   struct dirent *dp;
   while ((dp = readdir(dirp)) != nullptr) {
     string path = string(dp->d_name);
@@ -76,26 +179,142 @@ string file_readline(const string &path) {
   return str;
 }
 
-// not suitable for multipackages at present
 void find_rapl_events(map<string, vector<string>> *events) {
   DEBUG("Finding rapl events");
-  vector<string> powerzones = find_in_dir(ENERGY_ROOT, "intel-rapl:");
-  DEBUG("Found " << powerzones.size() << " zones");
-  for (auto &zone : powerzones) {
-    DEBUG("Trying zone " << zone);
-    string zonedir = string(ENERGY_ROOT) + "/" + zone + "/";
-    string name = file_readline(zonedir + ENERGY_NAME);
-    DEBUG("found event: " << name);
-    events->insert(pair<string, vector<string>>("package", {name}));
-    vector<string> subzones = find_in_dir(zonedir, zone);
-    DEBUG("Found " << subzones.size() << " subzones");
-    for (auto &sub : subzones) {
-      DEBUG("Trying subzone " << sub);
-      name = file_readline(zonedir + sub + "/" + ENERGY_NAME);
-      events->insert(pair<string, vector<string>>(name, {name}));
-      DEBUG("found event: " << name);
+  for (const auto &zone : find_energy_zones()) {
+    DEBUG("found event: " << zone.second);
+    events->insert(pair<string, vector<string>>(zone.second, {zone.second}));
+  }
+}
+
+void add_package_energy(Timeslice *timeslice,
+                        const map<string, uint64_t> &readings, int package,
+                        map<string, uint64_t> *last_readings) {
+  if (package < 0) {
+    // the readings are still the thread's latest, so its next timeslice
+    // doesn't get this one's energy as well
+    DEBUG("package of the sample is unknown, not attributing its energy");
+    for (const auto &reading : readings) {
+      (*last_readings)[reading.first] = reading.second;
+    }
+    return;
+  }
+  string prefix = ENERGY_PACKAGE_PREFIX + std::to_string(package);
+  auto energy = timeslice->mutable_energy();
+  for (const auto &reading : readings) {
+    auto last = last_readings->find(reading.first);
+    if (last != last_readings->end() &&
+        reading.first.compare(0, prefix.size(), prefix) == 0 &&
+        reading.second >= last->second) {
+      // package-1 for the package itself, package-1/dram for its dram
+      if (reading.first.size() == prefix.size()) {
+        (*energy)["package"] = reading.second - last->second;
+      } else if (reading.first[prefix.size()] == '/') {
+        (*energy)[reading.first.substr(prefix.size() + 1)] =
+            reading.second - last->second;
+      }
+    }
+    (*last_readings)[reading.first] = reading.second;
+  }
+}
+
+/*
+ * The name of the sysfs zone that a power PMU event counts, eg. package-0 for
+ * energy-pkg on the first socket, or package-1/dram for energy-ram on the
+ * second.
+ */
+static string rapl_zone_name(const string &event, int package) {
+  static const map<string, string> zone_names = {{"energy-cores", "core"},
+                                                 {"energy-gpu", "uncore"},
+                                                 {"energy-ram", "dram"}};
+  string package_name = ENERGY_PACKAGE_PREFIX + std::to_string(package);
+  if (event == "energy-pkg") {
+    return package_name;
+  }
+  if (event == "energy-psys") {
+    // the whole platform rather than one package
+    return "psys";
+  }
+  auto name = zone_names.find(event);
+  return package_name + "/" +
+         (name == zone_names.end() ? event : name->second);
+}
+
+bool open_rapl_counters() {
+  string pmu_dir = string(PMU_ROOT) + POWER_PMU + "/";
+  ifstream cpumask_file(pmu_dir + "cpumask");
+  string cpumask;
+  if (!getline(cpumask_file, cpumask)) {
+    DEBUG("no " POWER_PMU " PMU");
+    return false;
+  }
+
+  for (const char *event :
+       {"energy-pkg", "energy-cores", "energy-ram", "energy-gpu",
+        "energy-psys"}) {
+    double scale;
+    if (!(ifstream(pmu_dir + "events/" + event + ".scale") >> scale)) {
+      DEBUG("no " << event << " event");
+      continue;
+    }
+    string name = string(POWER_PMU) + "/" + event + "/";
+    perf_event_attr attr{};
+    memset(&attr, 0, sizeof(perf_event_attr));
+    if (setup_pfm_os_event(&attr, const_cast<char *>(name.c_str())) !=
+        PFM_SUCCESS) {
+      DEBUG_CRITICAL("can't encode energy event " << name);
+      continue;
+    }
+    attr.disabled = false;
+
+    for (int cpu : parse_cpu_list(cpumask)) {
+      int fd = perf_event_open(&attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+      if (fd == -1) {
+        DEBUG_CRITICAL("can't open " << name << " on cpu " << cpu << ": "
+                                     << strerror(errno));
+        continue;
+      }
+      uint64_t count = 0;
+      if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        DEBUG_CRITICAL("couldn't read " << name << " on cpu " << cpu);
+        close(fd);
+        continue;
+      }
+      DEBUG("opened " << name << " on cpu " << cpu << " as fd " << fd);
+      rapl_counters.push_back(
+          {fd, rapl_zone_name(event, read_cpu_package(cpu)), scale, count, 0});
     }
   }
+  return !rapl_counters.empty();
+}
+
+void read_rapl_counters(map<string, uint64_t> *m) {
+  for (auto &counter : rapl_counters) {
+    uint64_t count;
+    if (read(counter.fd, &count, sizeof(count)) != sizeof(count)) {
+      DEBUG_CRITICAL("couldn't read energy fd " << counter.fd);
+      continue;
+    }
+    // the kernel widens the 32 bit energy status registers to 64 bits, and
+    // the unsigned difference is still right if that ever wraps too
+    counter.joules += (count - counter.last_count) * counter.scale;
+    counter.last_count = count;
+    // psys is counted on every socket, but it's the same counter
+    (*m)[counter.name] = static_cast<uint64_t>(counter.joules * 1e6);
+  }
+}
+
+void close_rapl_counters() {
+  for (const auto &counter : rapl_counters) {
+    close(counter.fd);
+  }
+  rapl_counters.clear();
+}
+
+bool rapl_counters_available() {
+  bool available = open_rapl_counters();
+  close_rapl_counters();
+  return available;
 }
 
 }  // namespace alex
\ No newline at end of file
@@ -5,22 +5,70 @@
 #include <vector>
 
 #include "debug.hpp"
+#include "protos/timeslice.pb.h"
 
 namespace alex {
 
+// overridden by COLLECTOR_ENERGY_ROOT, eg. to read from a fake tree
 #define ENERGY_ROOT "/sys/class/powercap/intel-rapl/"
 #define ENERGY_PREFIX "intel-rapl"
 #define ENERGY_NAME "name"
 #define ENERGY_FILE "energy_uj"
+#define ENERGY_RANGE_FILE "max_energy_range_uj"
+
+// the name of each package's zone is this followed by its number. The names of
+// its subzones (eg. core, dram) are prefixed with the package's and a slash,
+// since every package has them
+#define ENERGY_PACKAGE_PREFIX "package-"
+
+// the perf PMU that counts the same RAPL domains, on one cpu of each socket
+#define POWER_PMU "power"
 
 using std::map;
 using std::string;
 using std::vector;
 
-map<string, uint64_t> measure_energy();
-void measure_energy_into_map(map<string, uint64_t>* m);
+/*
+ * A powercap zone's energy_uj, kept open between readings.
+ */
+struct energy_zone {
+  string name;
+  int fd;
+  // where energy_uj wraps back to 0
+  uint64_t max_range;
+  uint64_t last_reading;
+  // energy_uj with its wraps undone
+  uint64_t energy;
+};
+
+// the sysfs zones being read, in the order read_energy_zones fills readings
+extern vector<energy_zone> energy_zones;
+
+/*
+ * The powercap tree's root, COLLECTOR_ENERGY_ROOT or else ENERGY_ROOT, ending
+ * in a slash.
+ */
+string energy_root();
+
+/*
+ * Opens the energy_uj of every zone and subzone under energy_root. Returns
+ * false if none could be read.
+ */
+bool open_energy_zones();
+
+/*
+ * Reads each zone's energy in microjoules into readings, which has room for
+ * every one of energy_zones. The values only go up, with energy_uj's wraps at
+ * max_energy_range_uj undone.
+ */
+void read_energy_zones(uint64_t* readings);
 
-void push_energy_info(map<string, uint64_t>* readings, const string& dir);
+void close_energy_zones();
+
+/*
+ * Whether any zone's energy can be read, by opening and closing them.
+ */
+bool energy_zones_available();
 
 vector<string> find_in_dir(const string& dir, const string& substr);
 
@@ -28,6 +76,42 @@ string file_readline(const string& path);
 
 void find_rapl_events(map<string, vector<string>>* events);
 
+/*
+ * Adds the energy that the sample's package used since the thread's previous
+ * timeslice to the timeslice, by domain (package, core, dram, ...). readings
+ * are the energy readings of every package, and last_readings the thread's
+ * readings as of its previous timeslice, which are updated. Nothing is added
+ * if package is -1 (unknown), since it's unclear which package's energy
+ * applies.
+ */
+void add_package_energy(Timeslice* timeslice,
+                        const map<string, uint64_t>& readings, int package,
+                        map<string, uint64_t>* last_readings);
+
+/*
+ * Opens the power PMU's energy events system-wide on one cpu of each socket,
+ * which like other uncore events needs perf_event_paranoid to be 0 or less (or
+ * CAP_PERFMON). Returns false if none could be opened, in which case energy is
+ * read from sysfs instead.
+ */
+bool open_rapl_counters();
+
+/*
+ * Reads the energy used by each domain of each package since the counters were
+ * opened, in microjoules and under the same names as the sysfs zones, into m.
+ * This is only a read of each counter, so it's done in line with each sample,
+ * and the readings share the sample's time on the perf clock.
+ */
+void read_rapl_counters(map<string, uint64_t>* m);
+
+void close_rapl_counters();
+
+/*
+ * Whether any of the power PMU's energy events can be opened, by opening and
+ * closing them.
+ */
+bool rapl_counters_available();
+
 }  // namespace alex
 
 #endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+#include <fcntl.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <iostream>
+#include <string>
+
+#include "result_reader.hpp"
+
+namespace alex {
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::FileInputStream;
+using std::cerr;
+using std::endl;
+using std::function;
+using std::string;
+
+int read_result_file(
+    const char *path, Header *header,
+    const function<void(const Timeslice &)> &handle_timeslice) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    cerr << "failed to open " << path << endl;
+    return RESULT_OPEN_ERROR;
+  }
+
+  FileInputStream finput(fd);
+  finput.SetCloseOnDelete(true);
+  CodedInputStream input(&finput);
+  // same limit as protobuf-print
+  input.SetTotalBytesLimit(268435456, 0);
+
+  uint32_t size;
+  if (!input.ReadLittleEndian32(&size)) {
+    cerr << "failed to parse header, couldn't read delimiter" << endl;
+    return RESULT_HEADER_ERROR;
+  }
+  CodedInputStream::Limit limit = input.PushLimit(size);
+  if (!header->MergeFromCodedStream(&input)) {
+    cerr << "failed to parse header" << endl;
+    return RESULT_HEADER_ERROR;
+  }
+  input.PopLimit(limit);
+
+  Timeslice timeslice;
+  // timeslices end with a 0 size delimiter, before the warnings
+  while (input.ReadLittleEndian32(&size) && size != 0) {
+    limit = input.PushLimit(size);
+    if (!timeslice.ParseFromCodedStream(&input)) {
+      cerr << "failed to parse timeslice" << endl;
+      return RESULT_TIMESLICE_ERROR;
+    }
+    input.PopLimit(limit);
+    handle_timeslice(timeslice);
+  }
+  return 0;
+}
+
+}  // namespace alex
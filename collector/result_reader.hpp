@@ -0,0 +1,34 @@
+#ifndef COLLECTOR_RESULT_READER
+#define COLLECTOR_RESULT_READER
+
+#include <functional>
+#include <string>
+
+#include "protos/header.pb.h"
+#include "protos/timeslice.pb.h"
+
+namespace alex {
+
+/*
+ * Exit codes of the tools reading result files, the same ones protobuf-print
+ * uses for each part of the file it failed on.
+ */
+enum : int {
+  RESULT_OPEN_ERROR = 1,
+  RESULT_HEADER_ERROR = 2,
+  RESULT_TIMESLICE_ERROR = 3
+};
+
+/*
+ * Reads the header of the result file at path into header, then parses its
+ * timeslices one at a time and passes each to handle_timeslice, stopping at
+ * the end of them (the warnings after aren't read). Failures are reported on
+ * stderr. Returns 0, or one of the exit codes above if it failed.
+ */
+int read_result_file(
+    const char* path, Header* header,
+    const std::function<void(const Timeslice&)>& handle_timeslice);
+
+}  // namespace alex
+
+#endif
@@ -1,31 +1,242 @@
 #include "shared.hpp"
 
 #include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
 #include <csignal>
 #include <cstring>
+#include <map>
+#include <stdexcept>
 
+#include "branch_stack.hpp"
 #include "debug.hpp"
+#include "event_groups.hpp"
+#include "find_events.hpp"
+#include "hybrid.hpp"
 #include "perf_reader.hpp"
+#include "topdown.hpp"
+#include "unwind.hpp"
+#include "util.hpp"
 
 namespace alex {
 
+using std::map;
+
 const global_vars *global;
 
+// write end of the startup handshake, -1 once the subject has been started
+int startup_fd = -1;
+
 void *malloc_shared(size_t size) {
   return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED,
               0, 0);
 }
 
+void setup_global_vars() {
+  DEBUG("setting up globals");
+  // set up period
+  uint64_t period = -1;
+
+  if (period == -1) {
+    try {
+      period = stoull(getenv_safe("COLLECTOR_PERIOD", "10000000"));
+      // catch stoll exceptions
+    } catch (std::invalid_argument &e) {
+      DEBUG("failed to get period: invalid argument");
+      exit(ENV_ERROR);
+    } catch (std::out_of_range &e) {
+      DEBUG("failed to get period: out of range");
+      exit(ENV_ERROR);
+    }
+  }
+  DEBUG("period is " << period);
+
+  if (period < MIN_PERIOD) {
+    DEBUG_CRITICAL("period is smaller than " << MIN_PERIOD);
+    exit(PARAM_ERROR);
+  }
+
+  // set up events array, will be a set later though
+  DEBUG("getting events from env var");
+  auto events = str_split_set(getenv_safe("COLLECTOR_EVENTS"), ",");
+  auto presets = str_split_set(getenv_safe("COLLECTOR_PRESETS"), ",");
+
+  // without a PMU (eg. in most VMs and containers) the counted presets would
+  // fail to open on every thread, so fall back to what the kernel can count
+  bool degraded = false;
+  for (const char *preset : {"cpu", "cache", "branches", "frequency",
+                             "topdown"}) {
+    if (presets.find(preset) != presets.end() &&
+        !preset_is_available(preset)) {
+      DEBUG_CRITICAL("the " << preset << " preset can't be counted here, "
+                            << "using the software preset instead");
+      presets.erase(preset);
+      degraded = true;
+    }
+  }
+  if (degraded) {
+    presets.insert("software");
+  }
+  // each counted preset's events are kept in the same group where they fit,
+  // and events given on their own can go anywhere
+  vector<vector<string>> event_units;
+  for (const auto &event : events) {
+    event_units.push_back({event});
+  }
+  for (const char *preset :
+       {"cpu", "cache", "branches", "frequency", "software"}) {
+    if (presets.find(preset) == presets.end()) {
+      continue;
+    }
+    vector<string> unit;
+    for (auto &it : build_preset(preset)) {
+      for (const auto &event : it.second) {
+        events.insert(event);
+        unit.push_back(event);
+      }
+    }
+    event_units.insert(event_units.begin(), unit);
+  }
+  // level 1 of the breakdown can only be worked out when all of its events are
+  // counted together, so it's a unit on its own
+  if (presets.find("topdown") != presets.end()) {
+    for (const auto &level : topdown_levels()) {
+      events.insert(level.begin(), level.end());
+      event_units.insert(event_units.begin(), level);
+    }
+  }
+
+  // the LBR is often missing in VMs even when the host CPU has one, so check
+  // it can actually be used rather than failing on every thread
+  if (presets.find("lbr") != presets.end() && !branch_stack_available()) {
+    DEBUG_CRITICAL("no last branch record on this CPU, not sampling branches");
+    presets.erase("lbr");
+  }
+
+  bool exclude_kernel_callchain =
+      getenv_safe("COLLECTOR_EXCLUDE_KERNEL_CALLCHAIN") == "yes";
+  if (exclude_kernel_callchain) {
+    DEBUG("excluding kernel callchains");
+  }
+
+  bool dwarf_unwind = getenv_safe("COLLECTOR_UNWIND", "fp") == "dwarf";
+  if (dwarf_unwind && !dwarf_unwind_supported()) {
+    DEBUG_CRITICAL("can't unwind user stacks on this architecture, "
+                   "using frame pointers");
+    dwarf_unwind = false;
+  }
+
+  uint64_t stack_dump_size;
+  try {
+    stack_dump_size =
+        stoull(getenv_safe("COLLECTOR_STACK_DUMP_SIZE",
+                           std::to_string(DEFAULT_STACK_DUMP_SIZE).c_str()));
+  } catch (std::invalid_argument &e) {
+    DEBUG("failed to get stack dump size: invalid argument");
+    exit(ENV_ERROR);
+  } catch (std::out_of_range &e) {
+    DEBUG("failed to get stack dump size: out of range");
+    exit(ENV_ERROR);
+  }
+  // the kernel wants whole words
+  stack_dump_size -= stack_dump_size % sizeof(uint64_t);
+  if (dwarf_unwind) {
+    if (stack_dump_size < sizeof(uint64_t) ||
+        stack_dump_size > MAX_STACK_DUMP_SIZE) {
+      DEBUG_CRITICAL("stack dump size must be between "
+                     << sizeof(uint64_t) << " and " << MAX_STACK_DUMP_SIZE);
+      exit(PARAM_ERROR);
+    }
+    DEBUG("unwinding with call frame information, copying "
+          << stack_dump_size << " bytes of stack per sample");
+  }
+
+  // the memory and branch samplers each need a counter of their own
+  size_t counters = available_counters();
+  for (const char *sampler : {"memory", "lbr"}) {
+    if (presets.find(sampler) != presets.end() && counters > 1) {
+      counters--;
+    }
+  }
+  map<string, size_t> event_groups =
+      schedule_event_groups(event_units, counters);
+
+  uint64_t mux_interval;
+  try {
+    mux_interval = stoull(getenv_safe("COLLECTOR_MUX_INTERVAL", "1"));
+  } catch (std::invalid_argument &e) {
+    DEBUG("failed to get mux interval: invalid argument");
+    exit(ENV_ERROR);
+  } catch (std::out_of_range &e) {
+    DEBUG("failed to get mux interval: out of range");
+    exit(ENV_ERROR);
+  }
+  if (mux_interval == 0 || mux_interval > UINT32_MAX) {
+    DEBUG_CRITICAL("mux interval must be between 1 and " << UINT32_MAX);
+    exit(PARAM_ERROR);
+  }
+
+  uint64_t energy_interval;
+  try {
+    energy_interval = stoull(getenv_safe("COLLECTOR_ENERGY_INTERVAL", "1000"));
+  } catch (std::invalid_argument &e) {
+    DEBUG("failed to get energy interval: invalid argument");
+    exit(ENV_ERROR);
+  } catch (std::out_of_range &e) {
+    DEBUG("failed to get energy interval: out of range");
+    exit(ENV_ERROR);
+  }
+  if (energy_interval == 0 || energy_interval > UINT32_MAX) {
+    DEBUG_CRITICAL("energy interval must be between 1 and " << UINT32_MAX
+                                                            << "us");
+    exit(PARAM_ERROR);
+  }
+
+  // each core event is opened on every kind of core of a hybrid CPU that has
+  // it, since one opened for the other kind doesn't count there
+  map<string, uint32_t> event_pmus;
+  for (const auto &event : events) {
+    event_pmus[event] = find_event_pmus(event);
+  }
+
+  auto collector_pid = getpid();
+
+  init_global_vars(period, collector_pid, events, presets,
+                   exclude_kernel_callchain, dwarf_unwind, stack_dump_size,
+                   event_groups, mux_interval, event_pmus,
+                   core_pmus().size(), energy_interval);
+}
+
 void init_global_vars(uint64_t period, pid_t collector_pid,
-                      const set<string> &events, const set<string> &presets) {
+                      const set<string> &events, const set<string> &presets,
+                      bool exclude_kernel_callchain, bool dwarf_unwind,
+                      uint32_t stack_dump_size,
+                      const map<string, size_t> &event_groups,
+                      uint32_t mux_interval,
+                      const map<string, uint32_t> &event_pmus,
+                      size_t num_core_pmus, uint32_t energy_interval) {
   char **events_tmp =
       static_cast<char **>(malloc_shared(sizeof(char *) * events.size()));
+  auto *event_groups_tmp =
+      static_cast<size_t *>(malloc_shared(sizeof(size_t) * events.size()));
+  auto *event_pmus_tmp =
+      static_cast<uint32_t *>(malloc_shared(sizeof(uint32_t) * events.size()));
+  size_t num_event_groups = 1;
   {
     size_t i = 0;
     for (const auto &event : events) {
       events_tmp[i] =
           static_cast<char *>(malloc_shared(sizeof(char) * event.size()));
       memcpy(static_cast<void *>(events_tmp[i]), event.c_str(), event.size());
+      auto group = event_groups.find(event);
+      event_groups_tmp[i] =
+          group == event_groups.end() ? ALL_EVENT_GROUPS : group->second;
+      auto pmus = event_pmus.find(event);
+      event_pmus_tmp[i] = pmus == event_pmus.end() ? 0 : pmus->second;
+      if (event_groups_tmp[i] != ALL_EVENT_GROUPS) {
+        num_event_groups =
+            std::max(num_event_groups, event_groups_tmp[i] + 1);
+      }
       i++;
     }
   }
@@ -48,7 +259,18 @@ void init_global_vars(uint64_t period, pid_t collector_pid,
                             .presets = presets_tmp,
                             .presets_size = presets.size(),
                             .subject_pid = 0,
-                            .collector_pid = collector_pid};
+                            .collector_pid = collector_pid,
+                            .attached = false,
+                            .exclude_kernel_callchain =
+                                exclude_kernel_callchain,
+                            .dwarf_unwind = dwarf_unwind,
+                            .stack_dump_size = stack_dump_size,
+                            .event_groups = event_groups_tmp,
+                            .num_event_groups = num_event_groups,
+                            .mux_interval = mux_interval,
+                            .event_pmus = event_pmus_tmp,
+                            .num_core_pmus = num_core_pmus,
+                            .energy_interval = energy_interval};
 
   global = static_cast<global_vars *>(malloc_shared(sizeof(global_vars)));
   memcpy(const_cast<global_vars *>(global), &global_tmp, sizeof(global_vars));
@@ -58,11 +280,37 @@ void set_subject_pid(pid_t subject_pid) {
   const_cast<global_vars *>(global)->subject_pid = subject_pid;
 }
 
+void set_attached() { const_cast<global_vars *>(global)->attached = true; }
+
 void set_period(uint64_t period) {
   const_cast<global_vars *>(global)->period = period;
 }
 
-size_t num_perf_fds() { return 1 + global->events_size; }
+size_t num_perf_fds() {
+  size_t n = 1 + global->num_core_pmus + enabled_samplers().size();
+  for (int i = 0; i < global->events_size; i++) {
+    n += num_event_fds(i);
+  }
+  return n;
+}
+
+size_t num_event_fds(int i) {
+  return std::max(1, __builtin_popcount(global->event_pmus[i]));
+}
+
+vector<string> enabled_samplers() {
+  vector<string> samplers;
+  if (preset_enabled("memory")) {
+    samplers.emplace_back("memory");
+  }
+  if (preset_enabled("lbr")) {
+    samplers.emplace_back("lbr");
+  }
+  if (preset_enabled("offcpu")) {
+    samplers.emplace_back("offcpu");
+  }
+  return samplers;
+}
 
 void debug_global_var() {
   string events, presets;
@@ -95,9 +343,17 @@ void shutdown(pid_t pid, ofstream *result_file, error code, const string &msg) {
   shutdown(pid, code, msg);
 }
 
+void set_startup_fd(int fd) { startup_fd = fd; }
+
 void shutdown(pid_t pid, error code, const string &msg) {
   DEBUG_CRITICAL("error: " << msg);
-  kill(pid, SIGKILL);
+  int status = code;
+  if (global != nullptr && global->attached) {
+    // never kill a process we only attached to
+  } else if (startup_fd == -1 ||
+             write(startup_fd, &status, sizeof(status)) != sizeof(status)) {
+    kill(pid, SIGKILL);
+  }
   std::clog.flush();
   exit(code);
 }
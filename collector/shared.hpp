@@ -3,6 +3,7 @@
 
 #include <cinttypes>
 #include <iostream>
+#include <map>
 #include <set>
 #include <string>
 #include <vector>
@@ -11,6 +12,7 @@
 
 namespace alex {
 
+using std::map;
 using std::ofstream;
 using std::set;
 using std::string;
@@ -27,6 +29,35 @@ struct global_vars {
   // modified after fork
   pid_t subject_pid;
   const pid_t collector_pid;
+  // whether the collector attached to an already running subject rather than
+  // forking it, see attach.cpp
+  bool attached;
+  // set by COLLECTOR_EXCLUDE_KERNEL_CALLCHAIN, drops the kernel part of every
+  // callchain
+  const bool exclude_kernel_callchain;
+  // set by COLLECTOR_UNWIND=dwarf, unwinds user stacks from a copy of the top
+  // of the stack rather than following frame pointers, see unwind.cpp
+  const bool dwarf_unwind;
+  // bytes of user stack copied with each sample when dwarf_unwind is set
+  const uint32_t stack_dump_size;
+  // the counter group of each event, in the same order as events, or
+  // ALL_EVENT_GROUPS if it doesn't use a counter. Only one group is counted at
+  // a time, see event_groups.hpp
+  const size_t *event_groups;
+  const size_t num_event_groups;
+  // set by COLLECTOR_MUX_INTERVAL, the timeslices each group is counted for
+  // before moving on to the next
+  const uint32_t mux_interval;
+  // on hybrid CPUs, the core PMUs each event is opened on, in the same order as
+  // events, one bit per index in core_pmus. 0 if the event is opened once as
+  // usual, see hybrid.hpp
+  const uint32_t *event_pmus;
+  // the number of core PMUs, which each get a group leader, or 0 if the CPU
+  // isn't hybrid
+  const size_t num_core_pmus;
+  // set by COLLECTOR_ENERGY_INTERVAL, the microseconds between the energy
+  // sampler's readings of the sysfs RAPL zones
+  const uint32_t energy_interval;
 };
 
 extern const global_vars *global;
@@ -34,22 +65,61 @@ extern const global_vars *global;
 extern vector<int> fds;
 
 void init_global_vars(uint64_t period, pid_t collector_pid,
-                      const set<string> &events, const set<string> &presets);
+                      const set<string> &events, const set<string> &presets,
+                      bool exclude_kernel_callchain, bool dwarf_unwind,
+                      uint32_t stack_dump_size,
+                      const map<string, size_t> &event_groups,
+                      uint32_t mux_interval,
+                      const map<string, uint32_t> &event_pmus,
+                      size_t num_core_pmus, uint32_t energy_interval);
+
+/*
+ * Reads the period, events, and presets from the COLLECTOR_* environment
+ * variables and initializes the globals with them. Exits on invalid values.
+ */
+void setup_global_vars();
 
 /*
  * Not known until after the fork. Should only be called once.
  */
 void set_subject_pid(pid_t subject_pid);
 
+/*
+ * Marks the subject as attached to rather than forked. Should only be called
+ * once, right after set_subject_pid.
+ */
+void set_attached();
+
 void set_period(uint64_t period);
 
+/*
+ * While fd is not -1, shutdown sends its error code to the subject through
+ * this end of the startup handshake rather than killing it, so the subject
+ * can exit cleanly before it ever runs.
+ */
+void set_startup_fd(int fd);
+
 /*
  * Calculates the number of perf file descriptors per thread
  * #0 cpu cycles and samples
- * #1-? each event
+ * #1-? the group leader of each core PMU, on hybrid CPUs
+ * #?-? each event, num_event_fds of them
+ * #?-? each sampler, in the order of enabled_samplers
  */
 size_t num_perf_fds();
 
+/*
+ * The number of fds the i'th event is opened as, one for each of its core
+ * PMUs, or one if it has none.
+ */
+size_t num_event_fds(int i);
+
+/*
+ * The names of the enabled presets that are sampled on their own rather than
+ * counted alongside the cpu clock, "memory", "lbr", and "offcpu"
+ */
+vector<string> enabled_samplers();
+
 void debug_global_var();
 
 bool preset_enabled(const char *name);
@@ -57,7 +127,8 @@ bool preset_enabled(const char *name);
 // kills pid, writes warnings and closes result_file, prints msg to stderr, and
 // exits with code
 void shutdown(pid_t pid, ofstream *result_file, error code, const string &msg);
-// kills pid, prints msg to stderr, and exits with code
+// kills pid (or hands it the error code during startup), prints msg to
+// stderr, and exits with code
 void shutdown(pid_t pid, error code, const string &msg);
 
 #define SHUTDOWN_MSG(pid, result_file, code, msg) \
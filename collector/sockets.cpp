@@ -45,8 +45,18 @@ int recv_perf_fds(int socket, perf_fd_info *info,
       }
       // copy perf fd info
       info->cpu_clock_fd = ancil_fds[0];
+      int fd_idx = 1;
+      for (size_t i = 0; i < global->num_core_pmus; i++) {
+        info->core_pmu_leader_fds.push_back(ancil_fds[fd_idx++]);
+      }
       for (int i = 0; i < global->events_size; i++) {
-        info->event_fds[global->events[i]] = ancil_fds[i + 1];
+        vector<int> &event_fds = info->event_fds[global->events[i]];
+        for (size_t j = 0; j < num_event_fds(i); j++) {
+          event_fds.push_back(ancil_fds[fd_idx++]);
+        }
+      }
+      for (const auto &sampler : enabled_samplers()) {
+        info->sampler_fds[sampler] = ancil_fds[fd_idx++];
       }
       info->tid = tid;
       return cmd;
@@ -84,9 +94,23 @@ bool register_perf_fds(int socket, perf_fd_info *info) {
   // copy the locally used file descriptors
   ancil_fds[0] = info->cpu_clock_fd;
   DEBUG("send ancil_fds[0] = " << info->cpu_clock_fd);
+  int fd_idx = 1;
+  for (int leader_fd : info->core_pmu_leader_fds) {
+    ancil_fds[fd_idx] = leader_fd;
+    DEBUG("send ancil_fds[" << fd_idx << "] = " << ancil_fds[fd_idx]);
+    fd_idx++;
+  }
   for (int i = 0; i < global->events_size; i++) {
-    ancil_fds[i + 1] = info->event_fds[global->events[i]];
-    DEBUG("send ancil_fds[" << (i + 1) << "] = " << ancil_fds[i + 1]);
+    for (int event_fd : info->event_fds[global->events[i]]) {
+      ancil_fds[fd_idx] = event_fd;
+      DEBUG("send ancil_fds[" << fd_idx << "] = " << ancil_fds[fd_idx]);
+      fd_idx++;
+    }
+  }
+  for (const auto &sampler : enabled_samplers()) {
+    ancil_fds[fd_idx] = info->sampler_fds[sampler];
+    DEBUG("send ancil_fds[" << fd_idx << "] = " << ancil_fds[fd_idx]);
+    fd_idx++;
   }
   pid_t tid = gettid();
   socket_cmd cmd = SOCKET_CMD_REGISTER;
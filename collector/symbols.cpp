@@ -0,0 +1,291 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "debug.hpp"
+#include "inspect.hpp"
+#include "shared.hpp"
+#include "symbols.hpp"
+#include "util.hpp"
+
+namespace alex {
+
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+
+/*
+ * Fills in module_ends from a /proc/modules file, whose lines are
+ * "<name> <size> <refcount> <dependencies> <state> <hex addr>[ <taints>]".
+ */
+static void read_module_ends(const char *path,
+                             const unordered_map<string, uint32_t> &modules,
+                             kernel_syms *ksyms) {
+  std::ifstream modules_file(path);
+  string name, refcount, dependencies, state;
+  uint64_t size, addr;
+  string line;
+  while (std::getline(modules_file, line)) {
+    std::istringstream fields(line);
+    if (!(fields >> name >> size >> refcount >> dependencies >> state >>
+          std::hex >> addr) ||
+        addr == 0) {
+      continue;
+    }
+    auto module = modules.find(name);
+    if (module != modules.end()) {
+      ksyms->module_ends[module->second] = addr + size;
+    }
+  }
+}
+
+kernel_syms read_kernel_syms(const char *path, const char *modules_path) {
+  size_t start_ts = time_ms();
+  kernel_syms ksyms;
+  ksyms.names.push_back('\0');
+
+  // procfs reports a size of 0, so read until EOF instead of using it
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    DEBUG_CRITICAL("couldn't open " << path << ": " << strerror(errno));
+    return ksyms;
+  }
+  vector<char> buf;
+  size_t len = 0;
+  ssize_t count;
+  do {
+    buf.resize(len + KALLSYMS_READ_SIZE);
+    count = read(fd, buf.data() + len, KALLSYMS_READ_SIZE);
+    if (count > 0) {
+      len += count;
+    }
+  } while (count > 0 || (count == -1 && errno == EINTR));
+  close(fd);
+
+  // module names repeat for every symbol in the module, so only store each
+  // one once
+  unordered_map<string, uint32_t> modules;
+
+  // each line is "<hex addr> <type> <name>[\t[<module>]]"
+  const char *pos = buf.data(), *end = buf.data() + len;
+  while (pos < end) {
+    const char *eol = static_cast<const char *>(memchr(pos, '\n', end - pos));
+    if (eol == nullptr) {
+      eol = end;
+    }
+
+    kernel_sym sym{};
+    const char *c = pos;
+    for (; c < eol && isxdigit(*c); c++) {
+      sym.addr = (sym.addr << 4) |
+                 (isdigit(*c) ? *c - '0' : (tolower(*c) - 'a' + 10));
+    }
+    // skip the space, type, and another space
+    if (sym.addr != 0 && c + 3 < eol) {
+      sym.type = c[1];
+      const char *name = c + 3;
+      const char *name_end =
+          static_cast<const char *>(memchr(name, '\t', eol - name));
+      if (name_end == nullptr) {
+        name_end = eol;
+      }
+
+      sym.name = ksyms.names.size();
+      ksyms.names.insert(ksyms.names.end(), name, name_end);
+      ksyms.names.push_back('\0');
+
+      if (name_end != eol) {
+        // strip the brackets around the module name
+        const char *module = name_end + 1, *module_end = eol;
+        if (module < module_end && *module == '[') {
+          module++;
+        }
+        if (module < module_end && module_end[-1] == ']') {
+          module_end--;
+        }
+        auto inserted = modules.emplace(string(module, module_end),
+                                        ksyms.names.size());
+        if (inserted.second) {
+          ksyms.names.insert(ksyms.names.end(), module, module_end);
+          ksyms.names.push_back('\0');
+        }
+        sym.module = inserted.first->second;
+      }
+
+      if (sym.module == 0 && strcmp(ksyms.name_of(sym.name), "_etext") == 0) {
+        ksyms.text_end = sym.addr;
+      }
+      ksyms.syms.push_back(sym);
+    }
+
+    pos = eol + 1;
+  }
+
+  // kallsyms is mostly sorted already, but modules can be out of order
+  std::stable_sort(
+      ksyms.syms.begin(), ksyms.syms.end(),
+      [](const kernel_sym &a, const kernel_sym &b) { return a.addr < b.addr; });
+  ksyms.syms.shrink_to_fit();
+  ksyms.names.shrink_to_fit();
+  read_module_ends(modules_path, modules, &ksyms);
+
+  DEBUG_CRITICAL("read " << ksyms.syms.size() << " kernel symbols ("
+                         << ksyms.syms.size() * sizeof(kernel_sym) +
+                                ksyms.names.size()
+                         << " bytes) in " << time_ms() - start_ts << "ms");
+  return ksyms;
+}
+
+const kernel_syms &get_kernel_syms() {
+  static kernel_syms ksyms = read_kernel_syms();
+  return ksyms;
+}
+
+const kernel_sym *lookup_kernel_sym(const kernel_syms &ksyms, uint64_t addr) {
+  auto next = std::upper_bound(
+      ksyms.syms.begin(), ksyms.syms.end(), addr,
+      [](uint64_t a, const kernel_sym &sym) { return a < sym.addr; });
+  if (next == ksyms.syms.begin()) {
+    return nullptr;
+  }
+  const kernel_sym *sym = &*(next - 1);
+
+  // the next symbol bounds this one, but there are gaps with no symbols at the
+  // end of the kernel's text and of each module, and nothing after the last
+  uint64_t end = next == ksyms.syms.end() ? 0 : next->addr;
+  uint64_t region_end = 0;
+  if (sym->module == 0) {
+    if (sym->addr < ksyms.text_end) {
+      region_end = ksyms.text_end;
+    }
+  } else {
+    auto module_end = ksyms.module_ends.find(sym->module);
+    if (module_end != ksyms.module_ends.end()) {
+      region_end = module_end->second;
+    }
+  }
+  if (region_end != 0 && (end == 0 || region_end < end)) {
+    end = region_end;
+  }
+  if (end == 0 || addr >= end) {
+    return nullptr;
+  }
+  return sym;
+}
+
+/*
+ * Finds the entry containing addr in a map of address ranges.
+ */
+static const string *find_range(const map<interval, string, cmpByInterval> &m,
+                                uintptr_t addr) {
+  auto entry = m.upper_bound(interval(addr, addr));
+  if (entry != m.begin() && (--entry)->first.contains(addr)) {
+    return &entry->second;
+  }
+  return nullptr;
+}
+
+const string *symbol_index::find_symbol(uintptr_t addr) const {
+  for (const auto &segment : segments) {
+    const string *sym = find_range(segment->symbols, addr);
+    if (sym != nullptr) {
+      return sym;
+    }
+  }
+  return nullptr;
+}
+
+const string *symbol_index::find_variable(uintptr_t addr) const {
+  for (const auto &segment : segments) {
+    const string *var = find_range(segment->variables, addr);
+    if (var != nullptr) {
+      return var;
+    }
+  }
+  return nullptr;
+}
+
+const line_index *symbol_index::line_table_of(uintptr_t addr) const {
+  for (const auto &segment : segments) {
+    const line_index &table = segment->lines;
+    if (table.find(addr) != nullptr || table.find_inline(addr) != nullptr) {
+      return &table;
+    }
+  }
+  return nullptr;
+}
+
+size_t symbol_index::line_table_bytes() const {
+  size_t bytes = 0;
+  for (const auto &segment : segments) {
+    bytes += segment->lines.memory_usage();
+  }
+  return bytes;
+}
+
+unordered_set<string> source_scope() {
+  vector<string> source_scope_v = {"%%"};
+  return unordered_set<string>(source_scope_v.begin(), source_scope_v.end());
+}
+
+void *build_symbol_index(void *args) {
+  auto *program = static_cast<char *>(args);
+  size_t start_ts = time_ms();
+  DEBUG("building symbol index for " << program);
+
+  string maps_path = "/proc/self/maps";
+  if (global->attached) {
+    maps_path = "/proc/" + std::to_string(global->subject_pid) + "/maps";
+  }
+
+  auto *index = new symbol_index;
+  memory_map::get_instance().build(source_scope(), program, maps_path);
+  index->segments = memory_map::get_instance().segments();
+  index->mappings = memory_map::get_instance().mappings();
+
+  DEBUG_CRITICAL("built symbol index in " << time_ms() - start_ts << "ms");
+  DEBUG_CRITICAL("line tables use " << index->line_table_bytes() << " bytes");
+  return index;
+}
+
+void *update_symbol_index(void *args) {
+  auto *updates = static_cast<symbol_updates *>(args);
+  size_t start_ts = time_ms();
+
+  vector<std::pair<interval, mapped_file>> queued;
+  {
+    std::lock_guard<std::mutex> lock(updates->mtx);
+    queued.swap(updates->queued);
+  }
+  DEBUG("updating symbol index with " << queued.size() << " new mappings");
+
+  // readers may still be using the current index, so a new one is built.
+  // Each added file gets a segment of its own and the older segments are
+  // shared, so only the list of segments and the mappings are copied.
+  auto &mem_map = memory_map::get_instance();
+  size_t added = 0;
+  for (const auto &mapping : queued) {
+    if (mem_map.add_file(mapping.second, mapping.first, source_scope())) {
+      added++;
+    }
+  }
+  auto *index = new symbol_index;
+  index->segments = mem_map.segments();
+  index->mappings = mem_map.mappings();
+
+  DEBUG_CRITICAL("added " << added << " files to symbol index in "
+                          << time_ms() - start_ts << "ms");
+  return index;
+}
+
+}  // namespace alex
@@ -0,0 +1,125 @@
+#ifndef COLLECTOR_SYMBOLS
+#define COLLECTOR_SYMBOLS
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "inspect.hpp"
+
+namespace alex {
+
+using std::map;
+using std::string;
+
+/*
+ * A single /proc/kallsyms entry. The names are offsets into the owning
+ * kernel_syms' string table to keep entries small, since there are usually
+ * hundreds of thousands of them.
+ */
+struct kernel_sym {
+  uint64_t addr;
+  uint32_t name;
+  // 0 (the empty string) for symbols in the core kernel image
+  uint32_t module;
+  char type;
+};
+
+struct kernel_syms {
+  // sorted by address
+  std::vector<kernel_sym> syms;
+  // null separated names, starting with an empty string
+  std::vector<char> names;
+  // end of the core kernel's text (_etext), 0 if it isn't known
+  uint64_t text_end = 0;
+  // end of each module's memory by the offset of its name, from /proc/modules
+  std::unordered_map<uint32_t, uint64_t> module_ends;
+
+  inline const char* name_of(uint32_t offset) const {
+    return names.data() + offset;
+  }
+};
+
+/*
+ * Everything needed to turn a raw callchain into stack frames. Built once on
+ * a background thread so the subject can start running (and be sampled) while
+ * the debug information is still being loaded.
+ */
+struct symbol_index {
+  // shared with the memory_map and with the indexes before and after this
+  // one, see memory_map::segments
+  std::vector<std::shared_ptr<const debug_segment>> segments;
+  // executable mappings of the subject, including ones made after the fork or
+  // the attach, so it's looked up before dladdr
+  map<interval, mapped_file, cmpByInterval> mappings;
+
+  // the function containing addr, or nullptr if it isn't in one
+  const string* find_symbol(uintptr_t addr) const;
+  // the global variable containing addr, used to say which one a memory
+  // sample loaded from, or nullptr if it isn't in one
+  const string* find_variable(uintptr_t addr) const;
+  /*
+   * The line table with a range or an inlined call containing addr, or
+   * nullptr if none has either.
+   */
+  const line_index* line_table_of(uintptr_t addr) const;
+  // approximate number of bytes used by the line tables
+  size_t line_table_bytes() const;
+};
+
+/*
+ * Executable mappings seen in mmap records, waiting to be added to the symbol
+ * index by update_symbol_index. New indexes are published RCU-style: the
+ * update thread reads the new files into segments of their own and hands back
+ * an index sharing those and every older segment as its result. The collector
+ * thread is the only reader, so it swaps in the new index and frees the old
+ * one between samples.
+ */
+struct symbol_updates {
+  std::mutex mtx;
+  std::vector<std::pair<interval, mapped_file>> queued;
+};
+
+/*
+ * Parses a kallsyms file in a single pass over one buffer. Entries without an
+ * address (kptr_restrict hides them all) are left out. The modules file gives
+ * where each module ends, since kallsyms only has where its symbols start.
+ */
+kernel_syms read_kernel_syms(const char* path = "/proc/kallsyms",
+                             const char* modules_path = "/proc/modules");
+
+/*
+ * The kernel symbols, read the first time they're needed since many profiles
+ * never look at a kernel frame.
+ */
+const kernel_syms& get_kernel_syms();
+
+/*
+ * Finds the kernel symbol containing addr, ie. the one with the greatest
+ * address not after it. Returns nullptr if there is none, or if addr is past
+ * the end of the kernel's text or of the symbol's module (eg. BPF programs, or
+ * modules loaded after kallsyms was read), or past the last symbol with
+ * nothing to bound it.
+ */
+const kernel_sym* lookup_kernel_sym(const kernel_syms& ksyms, uint64_t addr);
+
+/*
+ * Background reading function (see bg_readings.hpp) that builds a new
+ * symbol_index. args is the name of the main executable, as passed in argv[0].
+ */
+void* build_symbol_index(void* args);
+
+/*
+ * Background reading function that builds a new symbol index with every
+ * mapping queued in args (a symbol_updates) added.
+ */
+void* update_symbol_index(void* args);
+
+}  // namespace alex
+
+#endif
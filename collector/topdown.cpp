@@ -0,0 +1,228 @@
+#include <linux/perf_event.h>
+#include <perfmon/pfmlib.h>
+#include <unistd.h>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "debug.hpp"
+#include "perf_sampler.hpp"
+#include "topdown.hpp"
+
+namespace alex {
+
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+// the pipeline width of the cores without PERF_METRICS
+enum : uint64_t { TOPDOWN_ISSUE_WIDTH = 4 };
+
+// event name in the core PMU's sysfs directory, and what it's called in the
+// preset, for each level
+static const pair<const char *, const char *> perf_metrics_level1[] = {
+    {"slots", "slots"},
+    {"topdown-retiring", "retiring"},
+    {"topdown-bad-spec", "badSpeculation"},
+    {"topdown-fe-bound", "frontendBound"},
+    {"topdown-be-bound", "backendBound"}};
+static const pair<const char *, const char *> perf_metrics_level2[] = {
+    {"topdown-heavy-ops", "heavyOperations"},
+    {"topdown-br-mispredict", "branchMispredicts"},
+    {"topdown-fetch-lat", "fetchLatency"},
+    {"topdown-mem-bound", "memoryBound"}};
+
+// libpfm name and preset name of the events the breakdown is calculated from
+// on older cores (Sandy Bridge through Skylake), see Yasin's "A Top-Down
+// Method for Performance Analysis and Counters Architecture"
+static const pair<const char *, const char *> formula_level1[] = {
+    {"cpu-cycles", "clockticks"},
+    {"IDQ_UOPS_NOT_DELIVERED:CORE", "uopsNotDelivered"},
+    {"UOPS_ISSUED:ANY", "uopsIssued"},
+    {"UOPS_RETIRED:RETIRE_SLOTS", "retireSlots"},
+    {"INT_MISC:RECOVERY_CYCLES", "recoveryCycles"}};
+static const pair<const char *, const char *> formula_level2[] = {
+    {"IDQ_UOPS_NOT_DELIVERED:CYCLES_0_UOPS_DELIV_CORE", "fetchLatencyCycles"},
+    {"BR_MISP_RETIRED:ALL_BRANCHES", "branchMispredicts"},
+    {"MACHINE_CLEARS:COUNT", "machineClears"},
+    {"CYCLE_ACTIVITY:STALLS_MEM_ANY", "memoryStalls"},
+    {"CYCLE_ACTIVITY:STALLS_TOTAL", "totalStalls"}};
+
+bool is_topdown_event(const string &event) {
+  return event == TOPDOWN_SLOTS_EVENT ||
+         event.compare(0, strlen(TOPDOWN_METRIC_PREFIX),
+                       TOPDOWN_METRIC_PREFIX) == 0;
+}
+
+static bool has_perf_metrics() {
+  return access(PMU_ROOT "cpu/events/topdown-retiring", F_OK) == 0;
+}
+
+static bool event_encodes(const char *event) {
+  perf_event_attr attr{};
+  memset(&attr, 0, sizeof(perf_event_attr));
+  return setup_pfm_os_event(&attr, const_cast<char *>(event)) == PFM_SUCCESS;
+}
+
+/*
+ * The topdown events of each level, as (preset name, event name) pairs.
+ */
+static vector<vector<pair<string, string>>> find_levels() {
+  vector<vector<pair<string, string>>> levels(2);
+  if (has_perf_metrics()) {
+    DEBUG("using PERF_METRICS for topdown");
+    for (const auto &event : perf_metrics_level1) {
+      levels[0].emplace_back(event.second,
+                             string("cpu/") + event.first + "/");
+    }
+    for (const auto &event : perf_metrics_level2) {
+      // only Sapphire Rapids and later have the second level
+      if (access((string(PMU_ROOT "cpu/events/") + event.first).c_str(),
+                 F_OK) == 0) {
+        levels[1].emplace_back(event.second,
+                               string("cpu/") + event.first + "/");
+      }
+    }
+    return levels;
+  }
+
+  pfm_initialize();
+  for (const auto &event : formula_level1) {
+    if (!event_encodes(event.first)) {
+      DEBUG("no topdown event " << event.first << " on this CPU");
+      levels[0].clear();
+      levels[1].clear();
+      return levels;
+    }
+    levels[0].emplace_back(event.second, event.first);
+  }
+  for (const auto &event : formula_level2) {
+    if (event_encodes(event.first)) {
+      levels[1].emplace_back(event.second, event.first);
+    }
+  }
+  return levels;
+}
+
+void find_topdown_events(map<string, vector<string>> *events) {
+  for (const auto &level : find_levels()) {
+    for (const auto &event : level) {
+      events->insert(pair<string, vector<string>>(event.first, {event.second}));
+    }
+  }
+}
+
+vector<vector<string>> topdown_levels() {
+  vector<vector<string>> levels;
+  for (const auto &level : find_levels()) {
+    levels.emplace_back();
+    for (const auto &event : level) {
+      levels.back().push_back(event.second);
+    }
+  }
+  return levels;
+}
+
+void add_topdown_metrics(Timeslice *timeslice) {
+  // preset name to event name, which doesn't change over a run
+  static map<string, string> names;
+  if (names.empty()) {
+    for (const auto &level : find_levels()) {
+      names.insert(level.begin(), level.end());
+    }
+  }
+
+  const auto &events = timeslice->events();
+  auto counted = [&](const char *name, double *value) {
+    auto event_name = names.find(name);
+    if (event_name == names.end()) {
+      return false;
+    }
+    auto event = events.find(event_name->second);
+    if (event == events.end()) {
+      return false;
+    }
+    *value = event->second;
+    return true;
+  };
+  auto *metrics = timeslice->mutable_topdown();
+
+  double slots, retiring, bad_speculation, frontend_bound, backend_bound;
+  double part, other;
+  if (names.count("slots") != 0) {
+    // the PERF_METRICS events read as their share of slots
+    if (!counted("slots", &slots) || slots == 0 ||
+        !counted("retiring", &retiring) ||
+        !counted("badSpeculation", &bad_speculation) ||
+        !counted("frontendBound", &frontend_bound) ||
+        !counted("backendBound", &backend_bound)) {
+      return;
+    }
+    retiring /= slots;
+    bad_speculation /= slots;
+    frontend_bound /= slots;
+    backend_bound /= slots;
+  } else {
+    double clockticks, not_delivered, issued, retire_slots, recovery;
+    if (!counted("clockticks", &clockticks) || clockticks == 0 ||
+        !counted("uopsNotDelivered", &not_delivered) ||
+        !counted("uopsIssued", &issued) ||
+        !counted("retireSlots", &retire_slots) ||
+        !counted("recoveryCycles", &recovery)) {
+      return;
+    }
+    slots = TOPDOWN_ISSUE_WIDTH * clockticks;
+    frontend_bound = not_delivered / slots;
+    bad_speculation =
+        (issued - retire_slots + TOPDOWN_ISSUE_WIDTH * recovery) / slots;
+    retiring = retire_slots / slots;
+    backend_bound = 1 - (frontend_bound + bad_speculation + retiring);
+  }
+  (*metrics)["frontendBound"] = frontend_bound;
+  (*metrics)["badSpeculation"] = bad_speculation;
+  (*metrics)["backendBound"] = backend_bound;
+  (*metrics)["retiring"] = retiring;
+
+  // each part of level 2 splits its level 1 parent in two
+  auto split = [&](const char *name, const char *rest, double parent,
+                   double value) {
+    (*metrics)[name] = value;
+    (*metrics)[rest] = parent - value;
+  };
+  if (names.count("slots") != 0) {
+    if (counted("heavyOperations", &part)) {
+      split("heavyOperations", "lightOperations", retiring, part / slots);
+    }
+    if (counted("branchMispredicts", &part)) {
+      split("branchMispredicts", "machineClears", bad_speculation,
+            part / slots);
+    }
+    if (counted("fetchLatency", &part)) {
+      split("fetchLatency", "fetchBandwidth", frontend_bound, part / slots);
+    }
+    if (counted("memoryBound", &part)) {
+      split("memoryBound", "coreBound", backend_bound, part / slots);
+    }
+    return;
+  }
+
+  if (counted("fetchLatencyCycles", &part)) {
+    split("fetchLatency", "fetchBandwidth", frontend_bound,
+          TOPDOWN_ISSUE_WIDTH * part / slots);
+  }
+  if (counted("branchMispredicts", &part) &&
+      counted("machineClears", &other) && part + other != 0) {
+    split("branchMispredicts", "machineClears", bad_speculation,
+          bad_speculation * part / (part + other));
+  }
+  if (counted("memoryStalls", &part) && counted("totalStalls", &other) &&
+      other != 0) {
+    split("memoryBound", "coreBound", backend_bound,
+          backend_bound * part / other);
+  }
+}
+
+}  // namespace alex
@@ -0,0 +1,47 @@
+#ifndef COLLECTOR_TOPDOWN
+#define COLLECTOR_TOPDOWN
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "protos/timeslice.pb.h"
+
+namespace alex {
+
+// with PERF_METRICS (Ice Lake and later), the kernel exposes the level 1 and 2
+// breakdowns directly as events of the core PMU. They have to be in a group led
+// by the slots counter, and neither takes up a generic counter
+#define TOPDOWN_SLOTS_EVENT "cpu/slots/"
+#define TOPDOWN_METRIC_PREFIX "cpu/topdown-"
+
+/*
+ * Whether the event is the slots counter or one of the PERF_METRICS events.
+ */
+bool is_topdown_event(const std::string& event);
+
+/*
+ * Adds the events that the topdown breakdown is calculated from on this CPU,
+ * by name, to events: the PERF_METRICS events if the kernel has them, or else
+ * whichever of the older cores' events libpfm can encode.
+ */
+void find_topdown_events(
+    std::map<std::string, std::vector<std::string>>* events);
+
+/*
+ * The topdown events split into level 1 and level 2, so the events each
+ * level's breakdown needs can be kept in the same counter group.
+ */
+std::vector<std::vector<std::string>> topdown_levels();
+
+/*
+ * Calculates the topdown breakdown from the timeslice's events, as fractions
+ * of the pipeline's issue slots. Level 1 is only added when all of its events
+ * were counted in this timeslice, and each part of level 2 when both it and
+ * its level 1 parent were.
+ */
+void add_topdown_metrics(Timeslice* timeslice);
+
+}  // namespace alex
+
+#endif
@@ -0,0 +1,107 @@
+#include <dirent.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "debug.hpp"
+#include "topology.hpp"
+#include "util.hpp"
+
+namespace alex {
+
+using std::ifstream;
+using std::string;
+using std::vector;
+
+vector<int> parse_cpu_list(const string &list) {
+  vector<int> cpus;
+  for (const auto &range : str_split_vec(list, ",")) {
+    char *end;
+    long first = strtol(range.c_str(), &end, 10);
+    long last = *end == '-' ? strtol(end + 1, nullptr, 10) : first;
+    for (long cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+vector<int> read_cpu_nodes() {
+  vector<int> nodes;
+  DIR *dirp = opendir(NODE_ROOT);
+  if (dirp == nullptr) {
+    DEBUG("no NUMA nodes in " NODE_ROOT);
+    return nodes;
+  }
+  struct dirent *dp;
+  while ((dp = readdir(dirp)) != nullptr) {
+    int node;
+    if (sscanf(dp->d_name, "node%d", &node) != 1) {
+      continue;
+    }
+    ifstream cpulist(string(NODE_ROOT) + dp->d_name + "/cpulist");
+    string list;
+    getline(cpulist, list);
+    for (int cpu : parse_cpu_list(list)) {
+      if (static_cast<size_t>(cpu) >= nodes.size()) {
+        nodes.resize(cpu + 1, -1);
+      }
+      nodes[cpu] = node;
+    }
+  }
+  closedir(dirp);
+  DEBUG("found NUMA nodes for " << nodes.size() << " cpus");
+  return nodes;
+}
+
+int read_cpu_package(int cpu) {
+  ifstream in(CPU_ROOT "cpu" + std::to_string(cpu) +
+              "/topology/physical_package_id");
+  int package;
+  if (!(in >> package)) {
+    DEBUG("couldn't find package of cpu " << cpu);
+    return -1;
+  }
+  return package;
+}
+
+vector<int> read_cpu_packages() {
+  vector<int> packages;
+  DIR *dirp = opendir(CPU_ROOT);
+  if (dirp == nullptr) {
+    DEBUG("no cpus in " CPU_ROOT);
+    return packages;
+  }
+  struct dirent *dp;
+  while ((dp = readdir(dirp)) != nullptr) {
+    int cpu;
+    char rest;
+    // skips cpufreq, cpuidle, and the like
+    if (sscanf(dp->d_name, "cpu%d%c", &cpu, &rest) != 1) {
+      continue;
+    }
+    if (static_cast<size_t>(cpu) >= packages.size()) {
+      packages.resize(cpu + 1, -1);
+    }
+    packages[cpu] = read_cpu_package(cpu);
+  }
+  closedir(dirp);
+  return packages;
+}
+
+uint64_t read_base_frequency() {
+  // only reported by intel_pstate, other drivers' max frequency includes turbo
+  ifstream in(CPU_ROOT "cpu0/cpufreq/base_frequency");
+  uint64_t khz;
+  if (!(in >> khz)) {
+    DEBUG("couldn't find base frequency");
+    return 0;
+  }
+  DEBUG("base frequency is " << khz << " kHz");
+  return khz;
+}
+
+}  // namespace alex
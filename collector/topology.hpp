@@ -0,0 +1,47 @@
+#ifndef COLLECTOR_TOPOLOGY
+#define COLLECTOR_TOPOLOGY
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace alex {
+
+#define NODE_ROOT "/sys/devices/system/node/"
+#define CPU_ROOT "/sys/devices/system/cpu/"
+
+// the frequency preset's events, counted through the msr PMU
+#define APERF_EVENT "msr/aperf/"
+#define MPERF_EVENT "msr/mperf/"
+
+/*
+ * Parses a list of cpus in the kernel's cpulist format, eg. "0-3,8,10-11".
+ */
+std::vector<int> parse_cpu_list(const std::string& list);
+
+/*
+ * The NUMA node of each cpu, indexed by cpu number, -1 for cpus that aren't in
+ * any node. Empty if the kernel wasn't built with NUMA support.
+ */
+std::vector<int> read_cpu_nodes();
+
+/*
+ * The physical package (socket) that cpu is in, or -1 if it's unknown.
+ */
+int read_cpu_package(int cpu);
+
+/*
+ * The physical package of each cpu, indexed by cpu number, -1 where it's
+ * unknown.
+ */
+std::vector<int> read_cpu_packages();
+
+/*
+ * The frequency in kHz that MPERF counts at (the nominal frequency), or 0 if
+ * the cpufreq driver doesn't say.
+ */
+uint64_t read_base_frequency();
+
+}  // namespace alex
+
+#endif
@@ -0,0 +1,830 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <asm/perf_regs.h>
+#endif
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <libelfin/elf/elf++.hh>
+
+#include "const.hpp"
+#include "debug.hpp"
+#include "debug_loader.hpp"
+#include "unwind.hpp"
+#include "util.hpp"
+
+namespace alex {
+
+using std::map;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+// pointer encodings used in .eh_frame, from the LSB
+enum : uint8_t {
+  DW_EH_PE_absptr = 0x00,
+  DW_EH_PE_uleb128 = 0x01,
+  DW_EH_PE_udata2 = 0x02,
+  DW_EH_PE_udata4 = 0x03,
+  DW_EH_PE_udata8 = 0x04,
+  DW_EH_PE_sleb128 = 0x09,
+  DW_EH_PE_sdata2 = 0x0a,
+  DW_EH_PE_sdata4 = 0x0b,
+  DW_EH_PE_sdata8 = 0x0c,
+  DW_EH_PE_pcrel = 0x10,
+  DW_EH_PE_omit = 0xff
+};
+
+// call frame instructions, the first three are packed with their operand
+enum : uint8_t {
+  DW_CFA_advance_loc = 0x40,
+  DW_CFA_offset = 0x80,
+  DW_CFA_restore = 0xc0,
+  DW_CFA_nop = 0x00,
+  DW_CFA_set_loc = 0x01,
+  DW_CFA_advance_loc1 = 0x02,
+  DW_CFA_advance_loc2 = 0x03,
+  DW_CFA_advance_loc4 = 0x04,
+  DW_CFA_offset_extended = 0x05,
+  DW_CFA_restore_extended = 0x06,
+  DW_CFA_undefined = 0x07,
+  DW_CFA_same_value = 0x08,
+  DW_CFA_register = 0x09,
+  DW_CFA_remember_state = 0x0a,
+  DW_CFA_restore_state = 0x0b,
+  DW_CFA_def_cfa = 0x0c,
+  DW_CFA_def_cfa_register = 0x0d,
+  DW_CFA_def_cfa_offset = 0x0e,
+  DW_CFA_def_cfa_expression = 0x0f,
+  DW_CFA_expression = 0x10,
+  DW_CFA_offset_extended_sf = 0x11,
+  DW_CFA_def_cfa_sf = 0x12,
+  DW_CFA_def_cfa_offset_sf = 0x13,
+  DW_CFA_val_offset = 0x14,
+  DW_CFA_val_offset_sf = 0x15,
+  DW_CFA_val_expression = 0x16,
+  DW_CFA_GNU_args_size = 0x2e,
+  DW_CFA_GNU_negative_offset_extended = 0x2f
+};
+
+enum class reg_rule : uint8_t {
+  SAME,
+  UNDEFINED,
+  // saved at CFA + offset
+  OFFSET,
+  // is CFA + offset
+  VAL_OFFSET,
+  // saved in another register
+  REGISTER,
+  // needs a DWARF expression, which isn't supported
+  UNSUPPORTED
+};
+
+struct reg_state {
+  reg_rule rule;
+  int64_t value;
+};
+
+/*
+ * How to find the caller's registers at a particular instruction.
+ */
+struct cfa_state {
+  uint64_t cfa_reg;
+  int64_t cfa_offset;
+  // false if the CFA is given by an expression
+  bool cfa_valid;
+  reg_state regs[UNWIND_NUM_REGS];
+};
+
+/*
+ * A common information entry, shared by the FDEs of (usually) a whole object
+ */
+struct cfi_cie {
+  uint64_t code_align;
+  int64_t data_align;
+  uint64_t ra_reg;
+  uint8_t fde_encoding;
+  // whether FDEs have augmentation data to skip
+  bool has_augmentation;
+  const uint8_t *instructions;
+  const uint8_t *instructions_end;
+  // the state after the CIE's instructions, which every FDE using it starts
+  // from. Worked out once when the table is loaded.
+  cfa_state initial;
+  // false if the CIE's instructions couldn't be run
+  bool initial_valid;
+};
+
+/*
+ * A frame description entry, covering a single function
+ */
+struct cfi_fde {
+  // addresses as in the file, before it's loaded
+  uint64_t pc_begin;
+  uint64_t pc_end;
+  // index into cfi_table::cies
+  uint32_t cie;
+  const uint8_t *instructions;
+  const uint8_t *instructions_end;
+};
+
+/*
+ * The call frame information of an object. Entries point into the file's
+ * sections, so the file is kept mapped for as long as the table lives.
+ */
+struct cfi_table {
+  elf::elf file;
+  // holds a compressed .debug_frame once it's been inflated, nullptr if there
+  // wasn't one
+  std::shared_ptr<::dwarf::loader> debug;
+  vector<cfi_cie> cies;
+  // sorted by pc_begin
+  vector<cfi_fde> fdes;
+  // shared objects and PIEs, whose addresses are relative to the load base
+  bool relocatable;
+};
+
+// call frame information by the path of the object, or nullptr if it had
+// none. Only used from the collector thread.
+map<string, unique_ptr<cfi_table>> cfi_tables;
+
+#if defined(__x86_64__)
+// the DWARF number of each sampled register, in the order the kernel writes
+// them (increasing perf register number)
+static const uint32_t sampled_regs[][2] = {
+    {PERF_REG_X86_AX, 0},  {PERF_REG_X86_BX, 3},  {PERF_REG_X86_CX, 2},
+    {PERF_REG_X86_DX, 1},  {PERF_REG_X86_SI, 4},  {PERF_REG_X86_DI, 5},
+    {PERF_REG_X86_BP, 6},  {PERF_REG_X86_SP, 7},  {PERF_REG_X86_IP, 16},
+    {PERF_REG_X86_R8, 8},  {PERF_REG_X86_R9, 9},  {PERF_REG_X86_R10, 10},
+    {PERF_REG_X86_R11, 11}, {PERF_REG_X86_R12, 12}, {PERF_REG_X86_R13, 13},
+    {PERF_REG_X86_R14, 14}, {PERF_REG_X86_R15, 15}};
+
+bool dwarf_unwind_supported() { return true; }
+
+uint64_t user_regs_mask() {
+  uint64_t mask = 0;
+  for (const auto &reg : sampled_regs) {
+    mask |= 1ULL << reg[0];
+  }
+  return mask;
+}
+#else
+static const uint32_t sampled_regs[0][2] = {};
+
+bool dwarf_unwind_supported() { return false; }
+
+uint64_t user_regs_mask() { return 0; }
+#endif
+
+template <class T>
+static T read_value(const uint8_t **pos, const uint8_t *end) {
+  T value{};
+  if (end - *pos < static_cast<ptrdiff_t>(sizeof(T))) {
+    *pos = end;
+    return value;
+  }
+  memcpy(&value, *pos, sizeof(T));
+  *pos += sizeof(T);
+  return value;
+}
+
+static uint64_t read_uleb128(const uint8_t **pos, const uint8_t *end) {
+  uint64_t value = 0;
+  unsigned shift = 0;
+  while (*pos < end) {
+    uint8_t byte = *(*pos)++;
+    if (shift < 64) {
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    }
+    shift += 7;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  return value;
+}
+
+static int64_t read_sleb128(const uint8_t **pos, const uint8_t *end) {
+  int64_t value = 0;
+  unsigned shift = 0;
+  uint8_t byte = 0;
+  while (*pos < end) {
+    byte = *(*pos)++;
+    if (shift < 64) {
+      value |= static_cast<int64_t>(byte & 0x7f) << shift;
+    }
+    shift += 7;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  if (shift < 64 && (byte & 0x40) != 0) {
+    value |= -(static_cast<int64_t>(1) << shift);
+  }
+  return value;
+}
+
+/*
+ * Reads a pointer in the given encoding. section_addr is the address of
+ * section_start once loaded, which pc-relative pointers are relative to.
+ */
+static uint64_t read_encoded(const uint8_t **pos, const uint8_t *end,
+                             uint8_t encoding, const uint8_t *section_start,
+                             uint64_t section_addr) {
+  if (encoding == DW_EH_PE_omit) {
+    return 0;
+  }
+  uint64_t field_addr = section_addr + (*pos - section_start);
+  uint64_t value;
+  switch (encoding & 0x0f) {
+    case DW_EH_PE_absptr:
+    case DW_EH_PE_udata8:
+    case DW_EH_PE_sdata8:
+      value = read_value<uint64_t>(pos, end);
+      break;
+    case DW_EH_PE_uleb128:
+      value = read_uleb128(pos, end);
+      break;
+    case DW_EH_PE_udata2:
+      value = read_value<uint16_t>(pos, end);
+      break;
+    case DW_EH_PE_udata4:
+      value = read_value<uint32_t>(pos, end);
+      break;
+    case DW_EH_PE_sleb128:
+      value = read_sleb128(pos, end);
+      break;
+    case DW_EH_PE_sdata2:
+      value = read_value<int16_t>(pos, end);
+      break;
+    case DW_EH_PE_sdata4:
+      value = read_value<int32_t>(pos, end);
+      break;
+    default:
+      *pos = end;
+      return 0;
+  }
+  switch (encoding & 0x70) {
+    case DW_EH_PE_absptr:
+      break;
+    case DW_EH_PE_pcrel:
+      value += field_addr;
+      break;
+    default:
+      // data and text relative pointers aren't used for FDEs on x86_64
+      *pos = end;
+      return 0;
+  }
+  return value;
+}
+
+static bool parse_cie(const uint8_t *pos, const uint8_t *end, bool eh_frame,
+                      const uint8_t *section_start, uint64_t section_addr,
+                      cfi_cie *cie) {
+  uint8_t version = read_value<uint8_t>(&pos, end);
+  const char *augmentation = reinterpret_cast<const char *>(pos);
+  size_t augmentation_len = strnlen(augmentation, end - pos);
+  pos += augmentation_len + 1;
+  if (pos > end) {
+    return false;
+  }
+  if (version >= 4) {
+    // address and segment selector sizes, only in .debug_frame
+    pos += 2;
+  }
+  cie->code_align = read_uleb128(&pos, end);
+  cie->data_align = read_sleb128(&pos, end);
+  cie->ra_reg =
+      version == 1 ? read_value<uint8_t>(&pos, end) : read_uleb128(&pos, end);
+  cie->fde_encoding = DW_EH_PE_absptr;
+  cie->has_augmentation = augmentation[0] == 'z';
+
+  if (cie->has_augmentation) {
+    uint64_t data_len = read_uleb128(&pos, end);
+    const uint8_t *data_end = pos + data_len;
+    if (data_end > end) {
+      return false;
+    }
+    for (const char *c = augmentation + 1; *c != '\0'; c++) {
+      if (*c == 'R') {
+        cie->fde_encoding = read_value<uint8_t>(&pos, data_end);
+      } else if (*c == 'P') {
+        uint8_t personality_encoding = read_value<uint8_t>(&pos, data_end);
+        read_encoded(&pos, data_end, personality_encoding, section_start,
+                     section_addr);
+      } else if (*c == 'L') {
+        read_value<uint8_t>(&pos, data_end);
+      } else if (*c != 'S') {
+        // the rest of the data can be skipped using its length
+        break;
+      }
+    }
+    pos = data_end;
+  } else if (augmentation[0] != '\0') {
+    // without a length, there's no way to find the instructions
+    return false;
+  }
+  if (!eh_frame) {
+    cie->fde_encoding = DW_EH_PE_absptr;
+  }
+
+  cie->instructions = pos;
+  cie->instructions_end = end;
+  return pos <= end;
+}
+
+/*
+ * Adds every CIE and FDE in an .eh_frame or .debug_frame section to the table.
+ * The two only differ in how CIEs are told apart from FDEs and referred to.
+ */
+static void parse_cfi_section(const void *data, size_t size,
+                              uint64_t section_addr, bool eh_frame,
+                              cfi_table *table) {
+  auto *start = static_cast<const uint8_t *>(data);
+  const uint8_t *end = start + size;
+  // section offset of each CIE to its index in the table
+  map<uint64_t, uint32_t> cie_offsets;
+
+  const uint8_t *pos = start;
+  while (end - pos >= 4) {
+    const uint8_t *entry = pos;
+    uint64_t length = read_value<uint32_t>(&pos, end);
+    bool is_64 = length == 0xffffffff;
+    if (is_64) {
+      length = read_value<uint64_t>(&pos, end);
+    }
+    if (length == 0) {
+      // the terminator in .eh_frame
+      if (eh_frame) {
+        break;
+      }
+      continue;
+    }
+    if (length > static_cast<uint64_t>(end - pos)) {
+      break;
+    }
+    const uint8_t *entry_end = pos + length;
+
+    const uint8_t *id_pos = pos;
+    uint64_t id = is_64 ? read_value<uint64_t>(&pos, entry_end)
+                        : read_value<uint32_t>(&pos, entry_end);
+    bool is_cie =
+        eh_frame ? id == 0 : id == (is_64 ? UINT64_MAX : UINT32_MAX);
+
+    if (is_cie) {
+      cfi_cie cie{};
+      if (parse_cie(pos, entry_end, eh_frame, start, section_addr, &cie)) {
+        cie_offsets[entry - start] = table->cies.size();
+        table->cies.push_back(cie);
+      }
+    } else {
+      // .eh_frame refers to the CIE relative to the reference itself
+      uint64_t cie_offset = eh_frame ? (id_pos - start) - id : id;
+      auto cie_idx = cie_offsets.find(cie_offset);
+      if (cie_idx != cie_offsets.end()) {
+        const cfi_cie &cie = table->cies[cie_idx->second];
+        cfi_fde fde{};
+        fde.cie = cie_idx->second;
+        fde.pc_begin = read_encoded(&pos, entry_end, cie.fde_encoding, start,
+                                    section_addr);
+        // the range is a length, so it's never pc-relative
+        fde.pc_end = fde.pc_begin + read_encoded(&pos, entry_end,
+                                                 cie.fde_encoding & 0x0f,
+                                                 start, section_addr);
+        if (cie.has_augmentation) {
+          uint64_t data_len = read_uleb128(&pos, entry_end);
+          pos = data_len > static_cast<uint64_t>(entry_end - pos)
+                    ? entry_end
+                    : pos + data_len;
+        }
+        fde.instructions = pos;
+        fde.instructions_end = entry_end;
+        if (pos < entry_end && fde.pc_end > fde.pc_begin) {
+          table->fdes.push_back(fde);
+        }
+      }
+    }
+    pos = entry_end;
+  }
+}
+
+// defined with the rest of the call frame instruction handling below
+static bool run_cfa_program(const uint8_t *pos, const uint8_t *end,
+                            const cfi_cie &cie, uint64_t loc, uint64_t target,
+                            const cfa_state &initial, cfa_state *state);
+
+/*
+ * Reads the call frame information of the object at path, or returns nullptr
+ * if it has none.
+ */
+static unique_ptr<cfi_table> load_cfi_table(const string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    DEBUG("couldn't open " << path << " for call frame information");
+    return nullptr;
+  }
+
+  unique_ptr<cfi_table> table(new cfi_table);
+  try {
+    table->file = elf::elf(elf::create_mmap_loader(fd));
+    table->relocatable = table->file.get_hdr().type == elf::et::dyn;
+    for (const auto &sec : table->file.sections()) {
+      bool compressed =
+          (static_cast<uint64_t>(sec.get_hdr().flags) & SHF_COMPRESSED) != 0;
+      if (sec.get_name() == ".eh_frame") {
+        parse_cfi_section(sec.data(), sec.size(), sec.get_hdr().addr, true,
+                          table.get());
+      } else if (sec.get_name() == ".debug_frame" && !compressed) {
+        parse_cfi_section(sec.data(), sec.size(), sec.get_hdr().addr, false,
+                          table.get());
+      } else if (sec.get_name() == ".debug_frame") {
+        // inflated by the same loader as the rest of the debug sections, which
+        // keeps the data for as long as the table holds on to it
+        table->debug = create_debug_loader(table->file);
+        size_t size;
+        const void *data =
+            table->debug->load(::dwarf::section_type::frame, &size);
+        if (data != nullptr) {
+          parse_cfi_section(data, size, sec.get_hdr().addr, false,
+                            table.get());
+        }
+      }
+    }
+  } catch (std::exception &e) {
+    DEBUG_CRITICAL("couldn't read call frame information from "
+                   << path << ": " << e.what());
+    return nullptr;
+  }
+
+  if (table->fdes.empty()) {
+    DEBUG("no call frame information in " << path);
+    return nullptr;
+  }
+  for (auto &cie : table->cies) {
+    for (auto &reg : cie.initial.regs) {
+      reg = {reg_rule::SAME, 0};
+    }
+    cie.initial_valid =
+        run_cfa_program(cie.instructions, cie.instructions_end, cie, 0,
+                        UINT64_MAX, cie.initial, &cie.initial);
+  }
+  std::sort(table->fdes.begin(), table->fdes.end(),
+            [](const cfi_fde &a, const cfi_fde &b) {
+              return a.pc_begin < b.pc_begin;
+            });
+  DEBUG("read " << table->fdes.size() << " FDEs from " << path);
+  return table;
+}
+
+static const cfi_table *get_cfi_table(const string &path) {
+  auto it = cfi_tables.find(path);
+  if (it == cfi_tables.end()) {
+    it = cfi_tables.emplace(path, load_cfi_table(path)).first;
+  }
+  return it->second.get();
+}
+
+static void set_reg_rule(cfa_state *state, uint64_t reg, reg_rule rule,
+                         int64_t value) {
+  // vector registers and the like can't hold return addresses or stack
+  // pointers, so they aren't tracked
+  if (reg < UNWIND_NUM_REGS) {
+    state->regs[reg] = {rule, value};
+  }
+}
+
+/*
+ * Runs call frame instructions on state until the location passes target.
+ * initial is the state after the CIE's instructions, which DW_CFA_restore
+ * goes back to. Returns false on an unsupported instruction.
+ */
+static bool run_cfa_program(const uint8_t *pos, const uint8_t *end,
+                            const cfi_cie &cie, uint64_t loc, uint64_t target,
+                            const cfa_state &initial, cfa_state *state) {
+  vector<cfa_state> remembered;
+  while (pos < end) {
+    uint8_t op = *pos++;
+    uint8_t operand = op & 0x3f;
+    uint64_t reg, reg2;
+    switch (op & 0xc0) {
+      case DW_CFA_advance_loc:
+        loc += operand * cie.code_align;
+        if (loc > target) {
+          return true;
+        }
+        continue;
+      case DW_CFA_offset:
+        set_reg_rule(state, operand, reg_rule::OFFSET,
+                     read_uleb128(&pos, end) * cie.data_align);
+        continue;
+      case DW_CFA_restore:
+        if (operand < UNWIND_NUM_REGS) {
+          state->regs[operand] = initial.regs[operand];
+        }
+        continue;
+      default:
+        break;
+    }
+
+    switch (op) {
+      case DW_CFA_nop:
+        break;
+      case DW_CFA_advance_loc1:
+        loc += read_value<uint8_t>(&pos, end) * cie.code_align;
+        if (loc > target) {
+          return true;
+        }
+        break;
+      case DW_CFA_advance_loc2:
+        loc += read_value<uint16_t>(&pos, end) * cie.code_align;
+        if (loc > target) {
+          return true;
+        }
+        break;
+      case DW_CFA_advance_loc4:
+        loc += read_value<uint32_t>(&pos, end) * cie.code_align;
+        if (loc > target) {
+          return true;
+        }
+        break;
+      case DW_CFA_offset_extended:
+        reg = read_uleb128(&pos, end);
+        set_reg_rule(state, reg, reg_rule::OFFSET,
+                     read_uleb128(&pos, end) * cie.data_align);
+        break;
+      case DW_CFA_offset_extended_sf:
+        reg = read_uleb128(&pos, end);
+        set_reg_rule(state, reg, reg_rule::OFFSET,
+                     read_sleb128(&pos, end) * cie.data_align);
+        break;
+      case DW_CFA_GNU_negative_offset_extended:
+        reg = read_uleb128(&pos, end);
+        set_reg_rule(state, reg, reg_rule::OFFSET,
+                     -static_cast<int64_t>(read_uleb128(&pos, end)) *
+                         cie.data_align);
+        break;
+      case DW_CFA_val_offset:
+        reg = read_uleb128(&pos, end);
+        set_reg_rule(state, reg, reg_rule::VAL_OFFSET,
+                     read_uleb128(&pos, end) * cie.data_align);
+        break;
+      case DW_CFA_val_offset_sf:
+        reg = read_uleb128(&pos, end);
+        set_reg_rule(state, reg, reg_rule::VAL_OFFSET,
+                     read_sleb128(&pos, end) * cie.data_align);
+        break;
+      case DW_CFA_restore_extended:
+        reg = read_uleb128(&pos, end);
+        if (reg < UNWIND_NUM_REGS) {
+          state->regs[reg] = initial.regs[reg];
+        }
+        break;
+      case DW_CFA_undefined:
+        set_reg_rule(state, read_uleb128(&pos, end), reg_rule::UNDEFINED, 0);
+        break;
+      case DW_CFA_same_value:
+        set_reg_rule(state, read_uleb128(&pos, end), reg_rule::SAME, 0);
+        break;
+      case DW_CFA_register:
+        reg = read_uleb128(&pos, end);
+        reg2 = read_uleb128(&pos, end);
+        set_reg_rule(state, reg, reg_rule::REGISTER, reg2);
+        break;
+      case DW_CFA_remember_state:
+        remembered.push_back(*state);
+        break;
+      case DW_CFA_restore_state:
+        if (remembered.empty()) {
+          return false;
+        }
+        *state = remembered.back();
+        remembered.pop_back();
+        break;
+      case DW_CFA_def_cfa:
+        state->cfa_reg = read_uleb128(&pos, end);
+        state->cfa_offset = read_uleb128(&pos, end);
+        state->cfa_valid = true;
+        break;
+      case DW_CFA_def_cfa_sf:
+        state->cfa_reg = read_uleb128(&pos, end);
+        state->cfa_offset = read_sleb128(&pos, end) * cie.data_align;
+        state->cfa_valid = true;
+        break;
+      case DW_CFA_def_cfa_register:
+        state->cfa_reg = read_uleb128(&pos, end);
+        break;
+      case DW_CFA_def_cfa_offset:
+        state->cfa_offset = read_uleb128(&pos, end);
+        break;
+      case DW_CFA_def_cfa_offset_sf:
+        state->cfa_offset = read_sleb128(&pos, end) * cie.data_align;
+        break;
+      case DW_CFA_def_cfa_expression:
+        // eg. in PLT entries
+        pos += std::min<uint64_t>(read_uleb128(&pos, end), end - pos);
+        state->cfa_valid = false;
+        break;
+      case DW_CFA_expression:
+      case DW_CFA_val_expression:
+        reg = read_uleb128(&pos, end);
+        pos += std::min<uint64_t>(read_uleb128(&pos, end), end - pos);
+        set_reg_rule(state, reg, reg_rule::UNSUPPORTED, 0);
+        break;
+      case DW_CFA_GNU_args_size:
+        read_uleb128(&pos, end);
+        break;
+      default:
+        // including DW_CFA_set_loc, which GCC and clang don't emit
+        DEBUG("unsupported call frame instruction " << int_to_hex(op));
+        return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Works out how to unwind from pc, returning false if there's no call frame
+ * information for it. ra_reg is set to the column holding the return address.
+ */
+static bool find_cfa_state(uint64_t pc, const symbol_index &syms,
+                           cfa_state *state, uint64_t *ra_reg) {
+  auto mapping = syms.mappings.upper_bound(interval(pc, pc));
+  if (mapping == syms.mappings.begin() || !(--mapping)->first.contains(pc)) {
+    return false;
+  }
+  const cfi_table *table = get_cfi_table(mapping->second.path);
+  if (table == nullptr) {
+    return false;
+  }
+
+  uint64_t file_pc = table->relocatable ? pc - mapping->second.load_base : pc;
+  auto next = std::upper_bound(
+      table->fdes.begin(), table->fdes.end(), file_pc,
+      [](uint64_t p, const cfi_fde &fde) { return p < fde.pc_begin; });
+  if (next == table->fdes.begin() || file_pc >= (next - 1)->pc_end) {
+    return false;
+  }
+  const cfi_fde &fde = *(next - 1);
+  const cfi_cie &cie = table->cies[fde.cie];
+  if (!cie.initial_valid) {
+    return false;
+  }
+  *state = cie.initial;
+  *ra_reg = cie.ra_reg;
+  return run_cfa_program(fde.instructions, fde.instructions_end, cie,
+                         fde.pc_begin, file_pc, cie.initial, state);
+}
+
+bool parse_user_stack(const uint8_t *pos, const uint8_t *end,
+                      user_stack *stack) {
+  if (end - pos < static_cast<ptrdiff_t>(sizeof(uint64_t))) {
+    return false;
+  }
+  stack->abi = read_value<uint64_t>(&pos, end);
+  if (stack->abi != PERF_SAMPLE_REGS_ABI_NONE) {
+    for (const auto &reg : sampled_regs) {
+      stack->regs[reg[1]] = read_value<uint64_t>(&pos, end);
+    }
+  }
+
+  if (end - pos < static_cast<ptrdiff_t>(sizeof(uint64_t))) {
+    return false;
+  }
+  uint64_t size = read_value<uint64_t>(&pos, end);
+  if (size != 0) {
+    if (static_cast<uint64_t>(end - pos) < size + sizeof(uint64_t)) {
+      return false;
+    }
+    const uint8_t *data = pos;
+    pos += size;
+    // only this much of the copy actually held stack
+    uint64_t dyn_size = std::min(read_value<uint64_t>(&pos, end), size);
+    stack->data.assign(data, data + dyn_size);
+  }
+  return true;
+}
+
+/*
+ * Walks the copied stack, returning the sampled instruction pointer followed
+ * by each return address.
+ */
+static vector<uint64_t> unwind_user_stack(const user_stack &stack,
+                                          const symbol_index &syms) {
+  vector<uint64_t> pcs;
+  if (stack.abi != PERF_SAMPLE_REGS_ABI_64) {
+    return pcs;
+  }
+
+  uint64_t regs[UNWIND_NUM_REGS];
+  bool valid[UNWIND_NUM_REGS];
+  std::copy(stack.regs, stack.regs + UNWIND_NUM_REGS, regs);
+  std::fill(valid, valid + UNWIND_NUM_REGS, true);
+
+  uint64_t stack_start = stack.regs[UNWIND_REG_SP],
+           stack_end = stack_start + stack.data.size();
+  auto read_stack = [&](uint64_t addr, uint64_t *value) {
+    if (addr < stack_start || addr + sizeof(uint64_t) > stack_end) {
+      return false;
+    }
+    memcpy(value, stack.data.data() + (addr - stack_start), sizeof(uint64_t));
+    return true;
+  };
+
+  for (size_t depth = 0; depth < SAMPLE_MAX_STACK; depth++) {
+    uint64_t pc = regs[UNWIND_REG_IP];
+    if (pc == 0) {
+      break;
+    }
+    pcs.push_back(pc);
+
+    uint64_t new_regs[UNWIND_NUM_REGS];
+    bool new_valid[UNWIND_NUM_REGS];
+    cfa_state state;
+    uint64_t ra_reg;
+    // return addresses point after the call, which may be past the end of
+    // the caller's FDE if the call was its last instruction
+    if (find_cfa_state(depth == 0 ? pc : pc - 1, syms, &state, &ra_reg)) {
+      if (!state.cfa_valid || state.cfa_reg >= UNWIND_NUM_REGS ||
+          !valid[state.cfa_reg] || ra_reg >= UNWIND_NUM_REGS) {
+        break;
+      }
+      uint64_t cfa = regs[state.cfa_reg] + state.cfa_offset;
+      for (uint32_t r = 0; r < UNWIND_NUM_REGS; r++) {
+        const reg_state &rule = state.regs[r];
+        new_regs[r] = 0;
+        switch (rule.rule) {
+          case reg_rule::SAME:
+            new_regs[r] = regs[r];
+            new_valid[r] = valid[r];
+            break;
+          case reg_rule::OFFSET:
+            new_valid[r] = read_stack(cfa + rule.value, &new_regs[r]);
+            break;
+          case reg_rule::VAL_OFFSET:
+            new_regs[r] = cfa + rule.value;
+            new_valid[r] = true;
+            break;
+          case reg_rule::REGISTER:
+            new_valid[r] = rule.value < UNWIND_NUM_REGS && valid[rule.value];
+            if (new_valid[r]) {
+              new_regs[r] = regs[rule.value];
+            }
+            break;
+          default:
+            new_valid[r] = false;
+        }
+      }
+      if (!new_valid[ra_reg]) {
+        break;
+      }
+      new_regs[UNWIND_REG_IP] = new_regs[ra_reg];
+      new_regs[UNWIND_REG_SP] = cfa;
+      new_valid[UNWIND_REG_IP] = new_valid[UNWIND_REG_SP] = true;
+    } else {
+      // no call frame information (eg. JIT code), so hope there's a frame
+      // pointer
+      uint64_t fp = regs[UNWIND_REG_BP];
+      std::fill(new_valid, new_valid + UNWIND_NUM_REGS, false);
+      if (!valid[UNWIND_REG_BP] ||
+          !read_stack(fp, &new_regs[UNWIND_REG_BP]) ||
+          !read_stack(fp + sizeof(uint64_t), &new_regs[UNWIND_REG_IP])) {
+        break;
+      }
+      new_regs[UNWIND_REG_SP] = fp + 2 * sizeof(uint64_t);
+      new_valid[UNWIND_REG_BP] = new_valid[UNWIND_REG_IP] =
+          new_valid[UNWIND_REG_SP] = true;
+    }
+
+    // callers are always further up the stack, anything else is garbage and
+    // could loop forever
+    if (new_regs[UNWIND_REG_SP] <= regs[UNWIND_REG_SP]) {
+      break;
+    }
+    std::copy(new_regs, new_regs + UNWIND_NUM_REGS, regs);
+    std::copy(new_valid, new_valid + UNWIND_NUM_REGS, valid);
+  }
+  return pcs;
+}
+
+vector<uint64_t> unwind_callchain(const uint64_t *ips, uint64_t n,
+                                  const user_stack &stack,
+                                  const symbol_index &syms) {
+  vector<uint64_t> callchain;
+  for (uint64_t i = 0; i < n && ips[i] != PERF_CONTEXT_USER; i++) {
+    callchain.push_back(ips[i]);
+  }
+  vector<uint64_t> user_pcs = unwind_user_stack(stack, syms);
+  if (!user_pcs.empty()) {
+    callchain.push_back(PERF_CONTEXT_USER);
+    callchain.insert(callchain.end(), user_pcs.begin(), user_pcs.end());
+  }
+  return callchain;
+}
+
+}  // namespace alex
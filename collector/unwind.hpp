@@ -0,0 +1,64 @@
+#ifndef COLLECTOR_UNWIND
+#define COLLECTOR_UNWIND
+
+#include <linux/perf_event.h>
+#include <cstdint>
+#include <vector>
+
+#include "symbols.hpp"
+
+namespace alex {
+
+// registers in DWARF (x86_64 psABI) numbering, which is what call frame
+// information refers to them by
+enum : uint32_t {
+  UNWIND_REG_BP = 6,
+  UNWIND_REG_SP = 7,
+  // the return address column, used for the instruction pointer
+  UNWIND_REG_IP = 16,
+  UNWIND_NUM_REGS = 17
+};
+
+/*
+ * The user registers and the top of the user stack, as copied by the kernel
+ * with a PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER sample.
+ */
+struct user_stack {
+  // PERF_SAMPLE_REGS_ABI_NONE if the sample was taken in a kernel thread
+  uint64_t abi = PERF_SAMPLE_REGS_ABI_NONE;
+  uint64_t regs[UNWIND_NUM_REGS] = {};
+  // the stack contents starting at regs[UNWIND_REG_SP]
+  std::vector<uint8_t> data;
+};
+
+/*
+ * Whether user stacks can be unwound on this architecture.
+ */
+bool dwarf_unwind_supported();
+
+/*
+ * The user registers to sample (sample_regs_user), which are the registers
+ * call frame information can refer to.
+ */
+uint64_t user_regs_mask();
+
+/*
+ * Reads the registers and stack that start at pos in a sample record into
+ * stack. Returns false if the record ends before they do.
+ */
+bool parse_user_stack(const uint8_t* pos, const uint8_t* end,
+                      user_stack* stack);
+
+/*
+ * Replaces the user part of a callchain (everything after PERF_CONTEXT_USER)
+ * with one unwound from the copied stack, using the .eh_frame or .debug_frame
+ * of each object it passes through. Frames without call frame information
+ * fall back to following the frame pointer.
+ */
+std::vector<uint64_t> unwind_callchain(const uint64_t* ips, uint64_t n,
+                                       const user_stack& stack,
+                                       const symbol_index& syms);
+
+}  // namespace alex
+
+#endif
@@ -1,3 +1,4 @@
+#include <cxxabi.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -84,4 +85,23 @@ string getenv_safe(const char* var, const char* fallback) {
   return string(value);
 }
 
+/*
+ * The demangled name of a symbol, or the name itself if it can't be
+ * demangled. status is set to __cxa_demangle's status, if given.
+ */
+string demangle(const string& name, int* status) {
+  int demangle_status;
+  char* demangled =
+      abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &demangle_status);
+  if (status != nullptr) {
+    *status = demangle_status;
+  }
+  if (demangle_status != 0) {
+    return name;
+  }
+  string result = demangled;
+  free(demangled);  // NOLINT
+  return result;
+}
+
 }  // namespace alex
\ No newline at end of file
@@ -23,6 +23,7 @@ set<string> str_split_set(const string& str, const string& delim);
 pid_t gettid();
 bool preset_enabled(const char* name);
 string getenv_safe(const char* var, const char* fallback = "");
+string demangle(const string& name, int* status = nullptr);
 
 }  // namespace alex
 
@@ -0,0 +1,144 @@
+/*
+ * Pretends to be a WattsUp meter, for running the wattsup preset without one.
+ * It opens a pseudo-terminal, prints the name of its device relative to /dev
+ * (eg. pts/3, for COLLECTOR_WATTSUP_DEVICE), and once it's told to start
+ * logging replays the frames of a capture of a real meter's output, one per
+ * interval, until it's told to stop or killed.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+// commands the collector sends, see wu_start_external_log and
+// wu_stop_external_log
+#define START_LOG_COMMAND "#L,W"
+#define STOP_LOG_COMMAND "#L,R"
+
+enum : int {
+  DEFAULT_INTERVAL = 1000,  // ms between frames, the meter's fastest rate
+  HANGUP_RETRY = 10         // ms to wait for the device to be opened
+};
+
+/*
+ * The "#...;" frames in a capture, without whatever is between them.
+ */
+vector<string> read_frames(const string &path) {
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  string capture = contents.str();
+
+  vector<string> frames;
+  size_t start = capture.find('#');
+  while (start != string::npos) {
+    size_t end = capture.find(';', start);
+    if (end == string::npos) {
+      break;
+    }
+    frames.push_back(capture.substr(start, end - start + 1));
+    start = capture.find('#', end);
+  }
+  return frames;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2 && argc != 3) {
+    cerr << "usage: wattsup-sim <capture file> [ms between frames]" << endl;
+    return 1;
+  }
+  vector<string> frames = read_frames(argv[1]);
+  if (frames.empty()) {
+    cerr << "no frames in " << argv[1] << endl;
+    return 1;
+  }
+  int interval = argc == 3 ? atoi(argv[2]) : DEFAULT_INTERVAL;
+  if (interval <= 0) {
+    cerr << "the interval must be a positive number of ms" << endl;
+    return 1;
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+    perror("couldn't open a pseudo-terminal");
+    return 2;
+  }
+  const char *device = ptsname(master);
+  // the collector prepends /dev/ itself
+  cout << device + strlen("/dev/") << endl;
+
+  bool logging = false;
+  size_t next_frame = 0;
+  string commands;
+  auto next_write = std::chrono::steady_clock::now();
+  while (true) {
+    int timeout = -1;
+    if (logging) {
+      timeout = std::max<int64_t>(
+          0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                 next_write - std::chrono::steady_clock::now())
+                 .count());
+    }
+    pollfd pfd = {master, POLLIN, 0};
+    int ready = poll(&pfd, 1, timeout);
+    if (ready == -1 && errno != EINTR) {
+      perror("couldn't poll the pseudo-terminal");
+      return 2;
+    }
+
+    if ((pfd.revents & POLLIN) != 0) {
+      char buf[256];
+      ssize_t n = read(master, buf, sizeof(buf));
+      if (n > 0) {
+        commands.append(buf, n);
+      }
+    } else if ((pfd.revents & POLLHUP) != 0) {
+      // nothing has the device open, either yet or any more
+      logging = false;
+      std::this_thread::sleep_for(std::chrono::milliseconds(HANGUP_RETRY));
+      continue;
+    }
+
+    for (size_t end; (end = commands.find(';')) != string::npos;
+         commands.erase(0, end + 1)) {
+      string command = commands.substr(0, end + 1);
+      if (command.find(START_LOG_COMMAND) != string::npos) {
+        cerr << "logging started" << endl;
+        logging = true;
+        next_write = std::chrono::steady_clock::now();
+      } else if (command.find(STOP_LOG_COMMAND) != string::npos) {
+        cerr << "logging stopped" << endl;
+        logging = false;
+      }
+    }
+
+    if (logging && std::chrono::steady_clock::now() >= next_write) {
+      // replay the capture in a loop, with the line ending the meter uses
+      string frame = frames[next_frame] + "\r\n";
+      next_frame = (next_frame + 1) % frames.size();
+      if (write(master, frame.data(), frame.size()) == -1 && errno != EIO) {
+        perror("couldn't write to the pseudo-terminal");
+        return 2;
+      }
+      next_write += std::chrono::milliseconds(interval);
+    }
+  }
+}
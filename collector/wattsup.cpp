@@ -21,14 +21,13 @@
 #include <cstring>
 #include <ctime>
 
+#include "const.hpp"
 #include "debug.hpp"
 #include "util.hpp"
 #include "wattsup.hpp"
 
 namespace alex {
 
-#define STRING_SIZE 256
-
 /* start the external logging of power info */
 /* #L,W,3,E,<Reserved>,<Interval>; */
 int wu_start_external_log(int wu_fd, int interval) {
@@ -96,8 +95,8 @@ int open_device(const char* device_name) {
     return -1;
   }
 
-  /* Not NONBLOCK */
-  ret = open(full_device_name, O_RDWR);
+  /* NONBLOCK, since it's read from the collector's epoll loop */
+  ret = open(full_device_name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
   if (ret < 0) {
     perror("could not open wattsup device");
     return -1;
@@ -148,60 +147,61 @@ int setup_serial_device(int fd) {
   return 0;
 }
 
-/* Read from the meter */
-double wu_read(int fd) {
-  DEBUG("reading from wattsup fd " << fd);
-  int ret = -1;
-  int offset = 0;
-
-  char string[STRING_SIZE];
-
-  memset(string, 0, STRING_SIZE);
-
-  while (ret < 0 || string[0] != '#') {
-    ret = read(fd, string, STRING_SIZE);
-    if ((ret < 0) && (errno != EAGAIN)) {
-      perror("error reading from wattsup device");
-      return -1;
-    }
-    if (string[0] != '#') {
-      DEBUG("wattsup protocol error, re-reading");
+void wu_parse(wu_parser* parser, const char* data, size_t len, uint64_t time,
+              std::vector<wu_reading>* readings) {
+  for (size_t i = 0; i < len; i++) {
+    char c = data[i];
+    if (c == '#') {
+      if (parser->in_frame) {
+        DEBUG("wattsup frame " << parser->frame << " was cut off");
+      }
+      parser->frame = c;
+      parser->in_frame = true;
+    } else if (!parser->in_frame) {
+      continue;
+    } else if (c == ';') {
+      parser->in_frame = false;
+      auto fields = str_split_vec(parser->frame, ",");
+      if (fields.empty() || fields[0] != WU_DATA_FRAME) {
+        DEBUG("skipping wattsup frame " << parser->frame);
+        continue;
+      }
+      if (fields.size() <= WU_WATTS_FIELD) {
+        DEBUG("wattsup protocol error, short frame " << parser->frame);
+        continue;
+      }
+      double watts = atof(fields[WU_WATTS_FIELD].c_str()) / 10.0;
+      DEBUG("wattsup read in " << watts << " watts");
+      readings->push_back({time, watts});
+    } else if (parser->frame.size() < WU_FRAME_MAX) {
+      parser->frame += c;
+    } else {
+      DEBUG("wattsup protocol error, dropping overlong frame");
+      parser->in_frame = false;
     }
   }
+}
 
-  offset = ret;
-
-  /* Typically ends in ;\r\n */
-  while (string[offset - 1] != '\n') {
-    ret = read(fd, string + offset, STRING_SIZE - ret);
-    offset += ret;
-  }
-
-  char watts_string[BUFSIZ];
-  double watts;
-  int i = 0, j = 0, commas = 0;
-  while (i < strlen(string)) {
-    if (string[i] == ',') {
-      commas++;
-    }
-    if (commas == 3) {
-      i++;
-      while (string[i] != ',') {
-        watts_string[j] = string[i];
-        i++;
-        j++;
-      }
-      watts_string[j] = 0;
-      break;
+bool wu_read(int fd, wu_parser* parser, std::vector<wu_reading>* readings) {
+  char buf[WU_FRAME_MAX];
+  while (true) {
+    ssize_t ret = read(fd, buf, sizeof(buf));
+    if (ret > 0) {
+      timespec ts{};
+      clock_gettime(SAMPLE_CLOCK, &ts);
+      wu_parse(parser, buf, ret,
+               static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec,
+               readings);
+    } else if (ret == 0) {
+      DEBUG_CRITICAL("wattsup device hung up");
+      return false;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return true;
+    } else if (errno != EINTR) {
+      perror("error reading from wattsup device");
+      return false;
     }
-    i++;
   }
-
-  watts = atof(watts_string);
-  watts /= 10.0;
-
-  DEBUG("wattsup read in " << watts << " watts");
-  return watts;
 }
 
 int wu_setup(const char* device_name) {
@@ -13,12 +13,42 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <string>
+#include <vector>
 
 #include "debug.hpp"
 #include "util.hpp"
 
 namespace alex {
 
+// the meter's output is a stream of "#<command>,<subcommand>,<count>,...;"
+// frames, the logged readings being "#d,-,18,<watts x 10>,<volts x 10>,...;"
+#define WU_DATA_FRAME "#d"
+
+enum : size_t {
+  WU_FRAME_MAX = 256,  // longest frame kept, anything longer is line noise
+  WU_WATTS_FIELD = 3,  // comma separated field of a data frame with the watts
+  WU_HISTORY = 16      // readings kept for samples that are processed late,
+                       // the meter logs one a second
+};
+
+/*
+ * A reading of the meter, stamped with SAMPLE_CLOCK when it arrived.
+ */
+struct wu_reading {
+  uint64_t time;
+  double watts;
+};
+
+/*
+ * Streaming parser state, since the device is read whenever it has anything
+ * and a frame can be split across reads.
+ */
+struct wu_parser {
+  std::string frame;
+  bool in_frame = false;
+};
+
 /* start the external logging of power info */
 /* #L,W,3,E,<Reserved>,<Interval>; */
 int wu_start_external_log(int wu_fd, int interval);
@@ -32,8 +62,20 @@ int open_device(char* device_name);
 /* Do the annoying Linux serial setup */
 int setup_serial_device(int fd);
 
-/* Read from the meter */
-double wu_read(int fd);
+/*
+ * Feeds len bytes of the meter's output to the parser, adding a reading at
+ * time for each data frame it completes. Partial frames are kept for the next
+ * call, and anything between frames (the \r\n after each) is skipped.
+ */
+void wu_parse(wu_parser* parser, const char* data, size_t len, uint64_t time,
+              std::vector<wu_reading>* readings);
+
+/*
+ * Reads everything the non-blocking device has buffered and parses it,
+ * stamping the readings with the time they were read. Returns false if the
+ * device failed or hung up, after which it shouldn't be polled any more.
+ */
+bool wu_read(int fd, wu_parser* parser, std::vector<wu_reading>* readings);
 
 int wu_setup(const char* device_name =
                  getenv_safe("COLLECTOR_WATTSUP_DEVICE", "ttyUSB0").c_str());
@@ -75,6 +75,36 @@ yargs
           type: "boolean",
           default: true
         })
+        .option("kernel-callchain", {
+          description:
+            "Include kernel frames in stack traces.  Use --no-kernel-callchain to drop them.",
+          type: "boolean",
+          default: true
+        })
+        .option("unwind", {
+          description:
+            "How to walk user stacks.  `dwarf` copies part of the stack with each sample and unwinds it with the binaries' call frame information, for programs built without frame pointers.",
+          choices: ["fp", "dwarf"],
+          default: "fp"
+        })
+        .option("stack-dump-size", {
+          description:
+            "Bytes of user stack to copy with each sample when using --unwind dwarf.",
+          type: "number",
+          default: 8192
+        })
+        .option("mux-interval", {
+          description:
+            "Timeslices to count each group of events for, when there are more events than hardware counters and they have to take turns.",
+          type: "number",
+          default: 1
+        })
+        .option("energy-interval", {
+          description:
+            "Microseconds between readings of RAPL energy, when it's read from sysfs rather than the power PMU.",
+          type: "number",
+          default: 1000
+        })
         .option("period", {
           description: `The period in CPU cycles.  Must be at least ${MIN_PERIOD}`,
           type: "number",
@@ -252,7 +282,12 @@ async function collect({
   errFile,
   visualizeOption,
   showTimer,
-  wattsupDevice
+  wattsupDevice,
+  kernelCallchain,
+  unwind,
+  stackDumpSize,
+  muxInterval,
+  energyInterval
 }) {
   const resultFile = resultOption || tempy.file({ extension: "bin" });
 
@@ -264,12 +299,31 @@ async function collect({
       : [])
   ]);
 
+  // Presets counted by the PMU can't run without one (eg. in most VMs), but
+  // the kernel's software events can still be counted in their place
+  const pmuPresets = new Set([
+    "cpu",
+    "cache",
+    "branches",
+    "frequency",
+    "topdown"
+  ]);
+  const softwareInfo = allPresetInfo.find(info => info.name === "software");
   for (const preset of presetsSet) {
     const presetInfo = allPresetInfo.find(info => info.name === preset);
     if (!presetInfo) {
       console.error(`Invalid preset: ${preset}`);
       console.error("Try `alex list` to see a list of available presets.");
       process.exit(1);
+    } else if (
+      !presetInfo.isAvailable &&
+      pmuPresets.has(preset) &&
+      softwareInfo &&
+      softwareInfo.isAvailable
+    ) {
+      console.warn(`Preset unavailable: ${preset}, using software instead`);
+      presetsSet.delete(preset);
+      presetsSet.add("software");
     } else if (!presetInfo.isAvailable) {
       console.error(`Preset unavailable: ${preset}`);
       console.error("This is most likely due to a lack of hardware support.");
@@ -317,6 +371,11 @@ async function collect({
       COLLECTOR_WATTSUP_DEVICE: wattsupDevice,
       COLLECTOR_NOTIFY_START: "yes",
       COLLECTOR_INPUT: inFile ? inFile : "",
+      COLLECTOR_EXCLUDE_KERNEL_CALLCHAIN: kernelCallchain ? "no" : "yes",
+      COLLECTOR_UNWIND: unwind,
+      COLLECTOR_STACK_DUMP_SIZE: stackDumpSize,
+      COLLECTOR_MUX_INTERVAL: muxInterval,
+      COLLECTOR_ENERGY_INTERVAL: energyInterval,
       LD_PRELOAD: path.join(__dirname, "./collector/build/collector.so")
     }
   });
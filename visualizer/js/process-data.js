@@ -7,28 +7,16 @@ function processData(data) {
     sectionsMap.set(StackFrame.Section[section], section);
   }
 
-  data.map((d, i, arr) => {
-    if (i > 0) {
-      // convert to microseconds
-      d.cpuTimeElapsed = d.numCpuTimerTicks / 1000;
-      const a = d.events.core - arr[i - 1].events.core;
-      if (a >= 0) {
-        // convert to watts by dividing microjoules by microseconds
-        d.events.periodCpu = a / d.cpuTimeElapsed;
-      }
-      const b = d.events.dram - arr[i - 1].events.dram;
-      if (b >= 0) {
-        d.events.periodMemory = b / d.cpuTimeElapsed;
-      }
-      const c = d.events["package-0"] - arr[i - 1].events["package-0"];
-      if (c >= 0) {
-        d.events.periodOverall = c / d.cpuTimeElapsed;
-      }
-    } else {
-      d.events.periodCpu = 0;
-      d.events.periodMemory = 0;
-      d.events.periodOverall = 0;
-    }
+  data.map(d => {
+    // convert to microseconds
+    d.cpuTimeElapsed = d.numCpuTimerTicks / 1000;
+    // the energy the package the timeslice ran on used during it, which is
+    // missing from each thread's first timeslice
+    const energy = d.energy || {};
+    // convert to watts by dividing microjoules by microseconds
+    d.events.periodCpu = (energy.core || 0) / d.cpuTimeElapsed || 0;
+    d.events.periodMemory = (energy.dram || 0) / d.cpuTimeElapsed || 0;
+    d.events.periodOverall = (energy.package || 0) / d.cpuTimeElapsed || 0;
   });
   return data
     .filter(